@@ -0,0 +1,1477 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * argon2i for the hashers.
+ *
+ * This is crypto_argon2i_general() from Monocypher (also CC0), restricted to
+ * what LM needs, with the block compression function G split out so that it
+ * can be replaced by a SIMD kernel at startup.
+ * The output must stay bit-identical to crypto_argon2i(); argon2_init()
+ * checks that before any kernel is used.
+ *
+ * Argon2i's addressing does not depend on the password, so the reference
+ * index of every block is the same for all hashes with the same parameters.
+ * The indices for the parameters new hashes use are computed once, by
+ * argon2_prepare(); while hashing, the upcoming reference blocks are
+ * prefetched from that schedule.
+ * Hashes with any other parameters (accounts not yet rehashed) compute the
+ * indices as they go, so that they cannot make the cache grow without bound.
+ *
+ * References to R, Z, Q etc. come from the spec.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "logging.h"
+#include "monocypher.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define KAT_BLOCKS	(16)
+#define KAT_ITERATIONS	(2)
+/* How many blocks ahead of the current one to prefetch the reference block. */
+#define PREFETCH_DISTANCE	(4)
+
+/* Argon2 operates on 1024 byte blocks. */
+typedef struct {
+	uint64_t a[128];
+} block;
+
+/* G, both versions:
+ *   xor == 0: result = R ^ Z          (first pass)
+ *   xor != 0: result = R ^ Z ^ result (subsequent passes)
+ * where R = x ^ y and Z = P(R).
+ */
+typedef void (*CompressFunc)(block *result, const block *x, const block *y,
+		int xor);
+
+struct Kernel {
+	const char *name;
+	CompressFunc compress;
+	/* NULL if always available */
+	int (*supported)(void);
+};
+
+/* The reference block for every block computed, in order. */
+struct Schedule {
+	struct Schedule *next;
+	uint32_t nb_blocks;
+	uint32_t nb_iterations;
+	size_t nrefs;
+	uint32_t refs[];
+};
+
+static const struct Kernel *kernel;
+static struct Schedule *schedules;
+static pthread_mutex_t schedules_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+min(uint32_t a, uint32_t b)
+{
+	return a <= b ? a : b;
+}
+
+static uint64_t
+rotr64(uint64_t x, uint64_t n)
+{
+	return (x >> n) ^ (x << (64 - n));
+}
+
+static void
+store32_le(uint8_t out[4], uint32_t in)
+{
+	out[0] =  in        & 0xff;
+	out[1] = (in >>  8) & 0xff;
+	out[2] = (in >> 16) & 0xff;
+	out[3] = (in >> 24) & 0xff;
+}
+
+static uint64_t
+load64_le(const uint8_t s[8])
+{
+	uint64_t v = 0;
+
+	for (size_t i = 0; i < 8; ++i)
+		v |= (uint64_t)s[i] << (8 * i);
+	return v;
+}
+
+static void
+store64_le(uint8_t out[8], uint64_t in)
+{
+	for (size_t i = 0; i < 8; ++i)
+		out[i] = (in >> (8 * i)) & 0xff;
+}
+
+/* updates a blake2 hash with a 32 bit word, little endian. */
+static void
+blake_update_32(crypto_blake2b_ctx *ctx, uint32_t input)
+{
+	uint8_t buf[4];
+
+	store32_le(buf, input);
+	crypto_blake2b_update(ctx, buf, 4);
+}
+
+static void
+load_block(block *b, const uint8_t bytes[1024])
+{
+	for (size_t i = 0; i < 128; ++i)
+		b->a[i] = load64_le(bytes + i * 8);
+}
+
+static void
+store_block(uint8_t bytes[1024], const block *b)
+{
+	for (size_t i = 0; i < 128; ++i)
+		store64_le(bytes + i * 8, b->a[i]);
+}
+
+static void
+copy_block(block *o, const block *in)
+{
+	for (size_t i = 0; i < 128; ++i)
+		o->a[i] = in->a[i];
+}
+
+static void
+xor_block(block *o, const block *in)
+{
+	for (size_t i = 0; i < 128; ++i)
+		o->a[i] ^= in->a[i];
+}
+
+/* Hash with a virtually unlimited digest size. */
+static void
+extended_hash(uint8_t *digest, uint32_t digest_size,
+		const uint8_t *input, uint32_t input_size)
+{
+	crypto_blake2b_ctx ctx;
+
+	crypto_blake2b_general_init(&ctx, min(digest_size, 64), NULL, 0);
+	blake_update_32(&ctx, digest_size);
+	crypto_blake2b_update(&ctx, input, input_size);
+	crypto_blake2b_final(&ctx, digest);
+
+	if (digest_size > 64) {
+		/* the conversion to uint64_t avoids integer overflow on
+		 * ludicrously big hash sizes.
+		 */
+		uint32_t r   = (uint32_t)((((uint64_t)digest_size + 31) / 32)
+				- 2);
+		uint32_t i   =  1;
+		uint32_t in  =  0;
+		uint32_t out = 32;
+
+		while (i < r) {
+			/* Input and output overlap. This is intentional */
+			crypto_blake2b(digest + out, digest + in, 64);
+			i   +=  1;
+			in  += 32;
+			out += 32;
+		}
+		crypto_blake2b_general(digest + out, digest_size - (32 * r),
+				NULL, 0, digest + in, 64);
+	}
+}
+
+/*
+ * Scalar kernel; this is the reference the others are checked against.
+ */
+
+#define LSB(x) ((x) & 0xffffffff)
+#define G(a, b, c, d)                                            \
+	a += b + 2 * LSB(a) * LSB(b);  d ^= a;  d = rotr64(d, 32);   \
+	c += d + 2 * LSB(c) * LSB(d);  b ^= c;  b = rotr64(b, 24);   \
+	a += b + 2 * LSB(a) * LSB(b);  d ^= a;  d = rotr64(d, 16);   \
+	c += d + 2 * LSB(c) * LSB(d);  b ^= c;  b = rotr64(b, 63)
+#define ROUND(v0,  v1,  v2,  v3,  v4,  v5,  v6,  v7,    \
+		v8,  v9, v10, v11, v12, v13, v14, v15)  \
+	G(v0, v4,  v8, v12);  G(v1, v5,  v9, v13);      \
+	G(v2, v6, v10, v14);  G(v3, v7, v11, v15);      \
+	G(v0, v5, v10, v15);  G(v1, v6, v11, v12);      \
+	G(v2, v7,  v8, v13);  G(v3, v4,  v9, v14)
+
+/* Core of the compression function G.  Computes Z from R in place. */
+static void
+g_rounds(block *work_block)
+{
+	uint64_t *a = work_block->a;
+
+	/* column rounds (work_block = Q) */
+	for (int i = 0; i < 128; i += 16) {
+		ROUND(a[i     ], a[i +  1], a[i +  2], a[i +  3],
+		      a[i +  4], a[i +  5], a[i +  6], a[i +  7],
+		      a[i +  8], a[i +  9], a[i + 10], a[i + 11],
+		      a[i + 12], a[i + 13], a[i + 14], a[i + 15]);
+	}
+	/* row rounds (work_block = Z) */
+	for (int i = 0; i < 16; i += 2) {
+		ROUND(a[i      ], a[i +   1], a[i +  16], a[i +  17],
+		      a[i +  32], a[i +  33], a[i +  48], a[i +  49],
+		      a[i +  64], a[i +  65], a[i +  80], a[i +  81],
+		      a[i +  96], a[i +  97], a[i + 112], a[i + 113]);
+	}
+}
+
+#undef ROUND
+#undef G
+#undef LSB
+
+static void
+compress_scalar(block *result, const block *x, const block *y, int xor)
+{
+	block tmp;
+
+	copy_block(&tmp, x);		/* tmp    = X */
+	xor_block(&tmp, y);		/* tmp    = X ^ Y = R */
+	if (xor)
+		xor_block(result, &tmp);	/* result = R ^ old */
+	else
+		copy_block(result, &tmp);	/* result = R */
+	g_rounds(&tmp);			/* tmp    = Z */
+	xor_block(result, &tmp);	/* result = R ^ Z (^ old) */
+}
+
+/* unary version of the compression function.
+ * The missing argument is implied zero.
+ * Does the transformation in place.
+ * Only used for the index stream, so the scalar version is good enough.
+ */
+static void
+unary_g(block *work_block)
+{
+	block tmp;
+
+	copy_block(&tmp, work_block);	/* tmp        = R */
+	g_rounds(work_block);		/* work_block = Z */
+	xor_block(work_block, &tmp);	/* work_block = Z ^ R */
+}
+
+#ifdef HAS_X86_KERNELS
+/*
+ * SSE2/SSSE3 kernels.
+ * A block is 64 128-bit words; one Blake2b round works on eight of them,
+ * two 64-bit lanes at a time, as in the argon2 reference implementation.
+ * The kernels differ only in how rotations and the diagonal shuffles are
+ * done, so the body is shared through SSE_KERNEL().
+ */
+
+#define SSE_BLAMKA(x, y) _mm_add_epi64(_mm_add_epi64((x), (y)), \
+		_mm_add_epi64(_mm_mul_epu32((x), (y)), \
+			_mm_mul_epu32((x), (y))))
+
+#define SSE_G(P, A0, B0, C0, D0, A1, B1, C1, D1) do {\
+	A0 = SSE_BLAMKA(A0, B0); A1 = SSE_BLAMKA(A1, B1);\
+	D0 = _mm_xor_si128(D0, A0); D1 = _mm_xor_si128(D1, A1);\
+	D0 = P##_rotr32(D0); D1 = P##_rotr32(D1);\
+	C0 = SSE_BLAMKA(C0, D0); C1 = SSE_BLAMKA(C1, D1);\
+	B0 = _mm_xor_si128(B0, C0); B1 = _mm_xor_si128(B1, C1);\
+	B0 = P##_rotr24(B0); B1 = P##_rotr24(B1);\
+	A0 = SSE_BLAMKA(A0, B0); A1 = SSE_BLAMKA(A1, B1);\
+	D0 = _mm_xor_si128(D0, A0); D1 = _mm_xor_si128(D1, A1);\
+	D0 = P##_rotr16(D0); D1 = P##_rotr16(D1);\
+	C0 = SSE_BLAMKA(C0, D0); C1 = SSE_BLAMKA(C1, D1);\
+	B0 = _mm_xor_si128(B0, C0); B1 = _mm_xor_si128(B1, C1);\
+	B0 = P##_rotr63(B0); B1 = P##_rotr63(B1);\
+} while (0)
+
+/* hi_lo(x, y) = (x.hi, y.lo) */
+#define SSE_ROUND(P, A0, A1, B0, B1, C0, C1, D0, D1) do {\
+	__m128i t0, t1;\
+	SSE_G(P, A0, B0, C0, D0, A1, B1, C1, D1);\
+	t0 = P##_hi_lo(B0, B1); t1 = P##_hi_lo(B1, B0); B0 = t0; B1 = t1;\
+	t0 = C0; C0 = C1; C1 = t0;\
+	t0 = P##_hi_lo(D1, D0); t1 = P##_hi_lo(D0, D1); D0 = t0; D1 = t1;\
+	SSE_G(P, A0, B0, C0, D0, A1, B1, C1, D1);\
+	t0 = P##_hi_lo(B1, B0); t1 = P##_hi_lo(B0, B1); B0 = t0; B1 = t1;\
+	t0 = C0; C0 = C1; C1 = t0;\
+	t0 = P##_hi_lo(D0, D1); t1 = P##_hi_lo(D1, D0); D0 = t0; D1 = t1;\
+} while (0)
+
+#define SSE_KERNEL(P, TARGET) \
+__attribute__((target(TARGET))) static void \
+compress_##P(block *result, const block *x, const block *y, int xor) \
+{\
+	const __m128i *xv = (const __m128i *)x->a;\
+	const __m128i *yv = (const __m128i *)y->a;\
+	__m128i *ov = (__m128i *)result->a;\
+	__m128i r[64], s[64];\
+	\
+	for (size_t i = 0; i < 64; ++i) {\
+		r[i] = _mm_xor_si128(_mm_loadu_si128(xv + i),\
+				_mm_loadu_si128(yv + i));\
+		s[i] = r[i];\
+	}\
+	for (size_t i = 0; i < 8; ++i) {\
+		SSE_ROUND(P, s[8 * i + 0], s[8 * i + 1], s[8 * i + 2],\
+				s[8 * i + 3], s[8 * i + 4], s[8 * i + 5],\
+				s[8 * i + 6], s[8 * i + 7]);\
+	}\
+	for (size_t i = 0; i < 8; ++i) {\
+		SSE_ROUND(P, s[8 * 0 + i], s[8 * 1 + i], s[8 * 2 + i],\
+				s[8 * 3 + i], s[8 * 4 + i], s[8 * 5 + i],\
+				s[8 * 6 + i], s[8 * 7 + i]);\
+	}\
+	for (size_t i = 0; i < 64; ++i) {\
+		s[i] = _mm_xor_si128(s[i], r[i]);\
+		if (xor)\
+			s[i] = _mm_xor_si128(s[i], _mm_loadu_si128(ov + i));\
+		_mm_storeu_si128(ov + i, s[i]);\
+	}\
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_rotr32(__m128i x)
+{
+	return _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_rotr24(__m128i x)
+{
+	return _mm_xor_si128(_mm_srli_epi64(x, 24), _mm_slli_epi64(x, 40));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_rotr16(__m128i x)
+{
+	return _mm_xor_si128(_mm_srli_epi64(x, 16), _mm_slli_epi64(x, 48));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_rotr63(__m128i x)
+{
+	return _mm_xor_si128(_mm_srli_epi64(x, 63), _mm_add_epi64(x, x));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+sse2_hi_lo(__m128i x, __m128i y)
+{
+	return _mm_unpackhi_epi64(x, _mm_unpacklo_epi64(y, y));
+}
+
+SSE_KERNEL(sse2, "sse2")
+
+__attribute__((target("ssse3"))) static inline __m128i
+ssse3_rotr32(__m128i x)
+{
+	return _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i
+ssse3_rotr24(__m128i x)
+{
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(
+				3, 4, 5, 6, 7, 0, 1, 2,
+				11, 12, 13, 14, 15, 8, 9, 10));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i
+ssse3_rotr16(__m128i x)
+{
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(
+				2, 3, 4, 5, 6, 7, 0, 1,
+				10, 11, 12, 13, 14, 15, 8, 9));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i
+ssse3_rotr63(__m128i x)
+{
+	return _mm_xor_si128(_mm_srli_epi64(x, 63), _mm_add_epi64(x, x));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i
+ssse3_hi_lo(__m128i x, __m128i y)
+{
+	return _mm_alignr_epi8(y, x, 8);
+}
+
+SSE_KERNEL(ssse3, "ssse3")
+
+/*
+ * AVX2/AVX-512 kernels.
+ * Here one Blake2b round fits in four 256-bit registers: A, B, C and D each
+ * hold four consecutive words of the sixteen the round works on.
+ * The diagonal step is a lane rotation.
+ * AVX-512 (with VL) only adds native 64-bit rotations.
+ */
+
+#define AVX_BLAMKA(x, y) _mm256_add_epi64(_mm256_add_epi64((x), (y)), \
+		_mm256_add_epi64(_mm256_mul_epu32((x), (y)), \
+			_mm256_mul_epu32((x), (y))))
+
+/* Two independent rounds are interleaved to hide the latency of the
+ * cross-lane permutes.
+ */
+#define AVX_G(P, A0, B0, C0, D0, A1, B1, C1, D1) do {\
+	A0 = AVX_BLAMKA(A0, B0); A1 = AVX_BLAMKA(A1, B1);\
+	D0 = _mm256_xor_si256(D0, A0); D1 = _mm256_xor_si256(D1, A1);\
+	D0 = P##_rotr32(D0); D1 = P##_rotr32(D1);\
+	C0 = AVX_BLAMKA(C0, D0); C1 = AVX_BLAMKA(C1, D1);\
+	B0 = _mm256_xor_si256(B0, C0); B1 = _mm256_xor_si256(B1, C1);\
+	B0 = P##_rotr24(B0); B1 = P##_rotr24(B1);\
+	A0 = AVX_BLAMKA(A0, B0); A1 = AVX_BLAMKA(A1, B1);\
+	D0 = _mm256_xor_si256(D0, A0); D1 = _mm256_xor_si256(D1, A1);\
+	D0 = P##_rotr16(D0); D1 = P##_rotr16(D1);\
+	C0 = AVX_BLAMKA(C0, D0); C1 = AVX_BLAMKA(C1, D1);\
+	B0 = _mm256_xor_si256(B0, C0); B1 = _mm256_xor_si256(B1, C1);\
+	B0 = P##_rotr63(B0); B1 = P##_rotr63(B1);\
+} while (0)
+
+#define AVX_PERMUTE(V, a, b, c, d) \
+	V = _mm256_permute4x64_epi64(V, _MM_SHUFFLE(a, b, c, d))
+
+#define AVX_ROUND(P, A0, B0, C0, D0, A1, B1, C1, D1) do {\
+	AVX_G(P, A0, B0, C0, D0, A1, B1, C1, D1);\
+	AVX_PERMUTE(B0, 0, 3, 2, 1); AVX_PERMUTE(B1, 0, 3, 2, 1);\
+	AVX_PERMUTE(C0, 1, 0, 3, 2); AVX_PERMUTE(C1, 1, 0, 3, 2);\
+	AVX_PERMUTE(D0, 2, 1, 0, 3); AVX_PERMUTE(D1, 2, 1, 0, 3);\
+	AVX_G(P, A0, B0, C0, D0, A1, B1, C1, D1);\
+	AVX_PERMUTE(B0, 2, 1, 0, 3); AVX_PERMUTE(B1, 2, 1, 0, 3);\
+	AVX_PERMUTE(C0, 1, 0, 3, 2); AVX_PERMUTE(C1, 1, 0, 3, 2);\
+	AVX_PERMUTE(D0, 0, 3, 2, 1); AVX_PERMUTE(D1, 0, 3, 2, 1);\
+} while (0)
+
+/* The second half of the rounds works on 128-bit columns: the four words of
+ * A come from two different rows, and so on.
+ */
+#define AVX_LOAD2(lo, hi) _mm256_inserti128_si256(\
+		_mm256_castsi128_si256(_mm_loadu_si128(lo)),\
+		_mm_loadu_si128(hi), 1)
+#define AVX_STORE2(lo, hi, v) do {\
+	_mm_storeu_si128((lo), _mm256_castsi256_si128(v));\
+	_mm_storeu_si128((hi), _mm256_extracti128_si256((v), 1));\
+} while (0)
+
+#define AVX_KERNEL(P, TARGET) \
+__attribute__((target(TARGET))) static void \
+compress_##P(block *result, const block *x, const block *y, int xor) \
+{\
+	const __m256i *xv = (const __m256i *)x->a;\
+	const __m256i *yv = (const __m256i *)y->a;\
+	__m256i *ov = (__m256i *)result->a;\
+	__m256i r[32], s[32];\
+	__m128i *sc = (__m128i *)s;\
+	__m256i A0, B0, C0, D0, A1, B1, C1, D1;\
+	\
+	for (size_t i = 0; i < 32; ++i) {\
+		r[i] = _mm256_xor_si256(_mm256_loadu_si256(xv + i),\
+				_mm256_loadu_si256(yv + i));\
+		s[i] = r[i];\
+	}\
+	for (size_t i = 0; i < 32; i += 8) {\
+		AVX_ROUND(P, s[i + 0], s[i + 1], s[i + 2], s[i + 3],\
+				s[i + 4], s[i + 5], s[i + 6], s[i + 7]);\
+	}\
+	for (size_t i = 0; i < 8; i += 2) {\
+		A0 = AVX_LOAD2(sc + 8 * 0 + i, sc + 8 * 1 + i);\
+		B0 = AVX_LOAD2(sc + 8 * 2 + i, sc + 8 * 3 + i);\
+		C0 = AVX_LOAD2(sc + 8 * 4 + i, sc + 8 * 5 + i);\
+		D0 = AVX_LOAD2(sc + 8 * 6 + i, sc + 8 * 7 + i);\
+		A1 = AVX_LOAD2(sc + 8 * 0 + i + 1, sc + 8 * 1 + i + 1);\
+		B1 = AVX_LOAD2(sc + 8 * 2 + i + 1, sc + 8 * 3 + i + 1);\
+		C1 = AVX_LOAD2(sc + 8 * 4 + i + 1, sc + 8 * 5 + i + 1);\
+		D1 = AVX_LOAD2(sc + 8 * 6 + i + 1, sc + 8 * 7 + i + 1);\
+		AVX_ROUND(P, A0, B0, C0, D0, A1, B1, C1, D1);\
+		AVX_STORE2(sc + 8 * 0 + i, sc + 8 * 1 + i, A0);\
+		AVX_STORE2(sc + 8 * 2 + i, sc + 8 * 3 + i, B0);\
+		AVX_STORE2(sc + 8 * 4 + i, sc + 8 * 5 + i, C0);\
+		AVX_STORE2(sc + 8 * 6 + i, sc + 8 * 7 + i, D0);\
+		AVX_STORE2(sc + 8 * 0 + i + 1, sc + 8 * 1 + i + 1, A1);\
+		AVX_STORE2(sc + 8 * 2 + i + 1, sc + 8 * 3 + i + 1, B1);\
+		AVX_STORE2(sc + 8 * 4 + i + 1, sc + 8 * 5 + i + 1, C1);\
+		AVX_STORE2(sc + 8 * 6 + i + 1, sc + 8 * 7 + i + 1, D1);\
+	}\
+	for (size_t i = 0; i < 32; ++i) {\
+		s[i] = _mm256_xor_si256(s[i], r[i]);\
+		if (xor)\
+			s[i] = _mm256_xor_si256(s[i], _mm256_loadu_si256(ov + i));\
+		_mm256_storeu_si256(ov + i, s[i]);\
+	}\
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+avx2_rotr32(__m256i x)
+{
+	return _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+avx2_rotr24(__m256i x)
+{
+	return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+				3, 4, 5, 6, 7, 0, 1, 2,
+				11, 12, 13, 14, 15, 8, 9, 10,
+				3, 4, 5, 6, 7, 0, 1, 2,
+				11, 12, 13, 14, 15, 8, 9, 10));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+avx2_rotr16(__m256i x)
+{
+	return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+				2, 3, 4, 5, 6, 7, 0, 1,
+				10, 11, 12, 13, 14, 15, 8, 9,
+				2, 3, 4, 5, 6, 7, 0, 1,
+				10, 11, 12, 13, 14, 15, 8, 9));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+avx2_rotr63(__m256i x)
+{
+	return _mm256_xor_si256(_mm256_srli_epi64(x, 63),
+			_mm256_add_epi64(x, x));
+}
+
+AVX_KERNEL(avx2, "avx2")
+
+__attribute__((target("avx2,avx512f,avx512vl"))) static inline __m256i
+avx512_rotr32(__m256i x)
+{
+	return _mm256_ror_epi64(x, 32);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl"))) static inline __m256i
+avx512_rotr24(__m256i x)
+{
+	return _mm256_ror_epi64(x, 24);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl"))) static inline __m256i
+avx512_rotr16(__m256i x)
+{
+	return _mm256_ror_epi64(x, 16);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl"))) static inline __m256i
+avx512_rotr63(__m256i x)
+{
+	return _mm256_ror_epi64(x, 63);
+}
+
+AVX_KERNEL(avx512, "avx2,avx512f,avx512vl")
+
+static int
+supports_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+supports_ssse3(void)
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int
+supports_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int
+supports_avx512(void)
+{
+	return __builtin_cpu_supports("avx2")
+		&& __builtin_cpu_supports("avx512f")
+		&& __builtin_cpu_supports("avx512vl");
+}
+#endif
+
+/* Best first; the scalar kernel must be last. */
+static const struct Kernel kernels[] = {
+#ifdef HAS_X86_KERNELS
+	{"avx512", compress_avx512, supports_avx512},
+	{"avx2", compress_avx2, supports_avx2},
+	{"ssse3", compress_ssse3, supports_ssse3},
+	{"sse2", compress_sse2, supports_sse2},
+#endif
+	{"scalar", compress_scalar, NULL}
+};
+
+#define NKERNELS	(sizeof(kernels)/sizeof(*kernels))
+#define SCALAR_KERNEL	(&kernels[NKERNELS - 1])
+
+/* Argon2i uses a kind of stream cipher to determine which reference
+ * block it will take to synthesise the next block.  This context holds
+ * that stream's state.
+ */
+typedef struct {
+	block b;
+	uint32_t pass_number;
+	uint32_t slice_number;
+	uint32_t nb_blocks;
+	uint32_t nb_iterations;
+	uint32_t ctr;
+	uint32_t offset;
+} gidx_ctx;
+
+/* The block in the context will determine array indices.  To avoid
+ * timing attacks, it only depends on public information.
+ */
+static void
+gidx_refresh(gidx_ctx *ctx)
+{
+	/* seed the beginning of the block... */
+	ctx->b.a[0] = ctx->pass_number;
+	ctx->b.a[1] = 0;	/* lane number (we have only one) */
+	ctx->b.a[2] = ctx->slice_number;
+	ctx->b.a[3] = ctx->nb_blocks;
+	ctx->b.a[4] = ctx->nb_iterations;
+	ctx->b.a[5] = 1;	/* type: Argon2i */
+	ctx->b.a[6] = ctx->ctr;
+	/* ...then zero the rest out */
+	for (size_t i = 7; i < 128; ++i)
+		ctx->b.a[i] = 0;
+
+	/* Shuffle the block thus: ctx->b = G((G(ctx->b, zero)), zero)
+	 * (G "square" function), to get cheap pseudo-random numbers.
+	 */
+	unary_g(&ctx->b);
+	unary_g(&ctx->b);
+}
+
+static void
+gidx_init(gidx_ctx *ctx, uint32_t pass_number, uint32_t slice_number,
+		uint32_t nb_blocks, uint32_t nb_iterations)
+{
+	ctx->pass_number   = pass_number;
+	ctx->slice_number  = slice_number;
+	ctx->nb_blocks     = nb_blocks;
+	ctx->nb_iterations = nb_iterations;
+	ctx->ctr           = 0;
+
+	/* Offset from the beginning of the segment.  For the first slice
+	 * of the first pass, we start at the *third* block, so the offset
+	 * starts at 2, not 0.
+	 */
+	if (pass_number != 0 || slice_number != 0) {
+		ctx->offset = 0;
+	} else {
+		ctx->offset = 2;
+		ctx->ctr++;		/* Compensates for missed lazy creation */
+		gidx_refresh(ctx);	/* at the start of gidx_next() */
+	}
+}
+
+static uint32_t
+gidx_next(gidx_ctx *ctx)
+{
+	/* lazily creates the offset block we need */
+	if (ctx->offset % 128 == 0) {
+		ctx->ctr++;
+		gidx_refresh(ctx);
+	}
+	uint32_t index  = ctx->offset % 128;	/* save index  for current call */
+	uint32_t offset = ctx->offset;		/* save offset for current call */
+	ctx->offset++;				/* update offset for next call */
+
+	/* Computes the area size.
+	 * Pass 0 : all already finished segments plus already constructed
+	 *          blocks in this segment
+	 * Pass 1+: 3 last segments plus already constructed
+	 *          blocks in this segment (as the reference implementation
+	 *          does it).
+	 */
+	int first_pass       = ctx->pass_number == 0;
+	uint32_t slice_size  = ctx->nb_blocks / 4;
+	uint32_t nb_segments = first_pass ? ctx->slice_number : 3;
+	uint32_t area_size   = nb_segments * slice_size + offset - 1;
+
+	/* Computes the starting position of the reference area.
+	 * It starts at the next segment, not the next block.
+	 */
+	uint32_t next_slice = ((ctx->slice_number + 1) % 4) * slice_size;
+	uint32_t start_pos  = first_pass ? 0 : next_slice;
+
+	/* Generate offset from J1 (no need for J2, there's only one lane) */
+	uint64_t j1 = ctx->b.a[index] & 0xffffffff;	/* pseudo-random */
+	uint64_t x  = (j1 * j1) >> 32;
+	uint64_t y  = (area_size * x) >> 32;
+	uint64_t z  = (area_size - 1) - y;
+	return (uint32_t)((start_pos + z) % ctx->nb_blocks);
+}
+
+/* nb_blocks must already be rounded down to a multiple of 4. */
+static struct Schedule *
+schedule_new(uint32_t nb_blocks, uint32_t nb_iterations)
+{
+	struct Schedule *sched;
+	uint32_t segment_size = nb_blocks / 4;
+	size_t nrefs = (size_t)nb_blocks * nb_iterations - 2;
+	size_t n = 0;
+
+	if ((sched = malloc(sizeof(*sched) + nrefs * sizeof(*sched->refs)))
+			== NULL)
+		return NULL;
+	sched->next = NULL;
+	sched->nb_blocks = nb_blocks;
+	sched->nb_iterations = nb_iterations;
+	sched->nrefs = nrefs;
+
+	for (uint32_t pass_number = 0; pass_number < nb_iterations;
+			++pass_number) {
+		for (uint32_t segment = 0; segment < 4; ++segment) {
+			gidx_ctx gctx;
+			uint32_t start_offset = pass_number == 0 && segment == 0
+				? 2 : 0;
+
+			gidx_init(&gctx, pass_number, segment, nb_blocks,
+					nb_iterations);
+			for (uint32_t i = start_offset; i < segment_size; ++i)
+				sched->refs[n++] = gidx_next(&gctx);
+		}
+	}
+
+	return sched;
+}
+
+/*
+ * Returns the schedule argon2_prepare() computed for the given parameters.
+ * Returns NULL if there is none; the caller then has to compute the indices
+ * as it goes.
+ */
+static const struct Schedule *
+schedule_get(uint32_t nb_blocks, uint32_t nb_iterations)
+{
+	struct Schedule *sched;
+
+	pthread_mutex_lock(&schedules_lock);
+	for (sched = schedules; sched != NULL; sched = sched->next) {
+		if (sched->nb_blocks == nb_blocks
+				&& sched->nb_iterations == nb_iterations)
+			break;
+	}
+	pthread_mutex_unlock(&schedules_lock);
+
+	return sched;
+}
+
+static void
+prefetch_block(const block *b)
+{
+	const char *p = (const char *)b;
+
+	for (size_t i = 0; i < sizeof(*b); i += 64)
+		__builtin_prefetch(p + i);
+}
+
+/* Computes H0 and fills the first two blocks of one instance. */
+static void
+fill_first_blocks(block *blocks, uint32_t hash_size, uint32_t nb_blocks,
+		uint32_t nb_iterations,
+		const uint8_t *password, uint32_t password_size,
+		const uint8_t *salt, uint32_t salt_size)
+{
+	crypto_blake2b_ctx ctx;
+	uint8_t initial_hash[72];	/* 64 bytes plus 2 words for H' */
+	uint8_t hash_area[1024];
+
+	crypto_blake2b_init(&ctx);
+	blake_update_32(&ctx, 1);		/* p: number of threads */
+	blake_update_32(&ctx, hash_size);
+	blake_update_32(&ctx, nb_blocks);
+	blake_update_32(&ctx, nb_iterations);
+	blake_update_32(&ctx, 0x13);		/* v: version number */
+	blake_update_32(&ctx, 1);		/* y: Argon2i */
+	blake_update_32(&ctx, password_size);
+	crypto_blake2b_update(&ctx, password, password_size);
+	blake_update_32(&ctx, salt_size);
+	crypto_blake2b_update(&ctx, salt, salt_size);
+	blake_update_32(&ctx, 0);		/* no key */
+	blake_update_32(&ctx, 0);		/* no additional data */
+	crypto_blake2b_final(&ctx, initial_hash);
+
+	/* fill first 2 blocks */
+	store32_le(initial_hash + 64, 0);	/* first  additional word */
+	store32_le(initial_hash + 68, 0);	/* second additional word */
+	extended_hash(hash_area, 1024, initial_hash, 72);
+	load_block(blocks, hash_area);
+
+	store32_le(initial_hash + 64, 1);	/* slight modification */
+	extended_hash(hash_area, 1024, initial_hash, 72);
+	load_block(blocks + 1, hash_area);
+
+	crypto_wipe(initial_hash, sizeof(initial_hash));
+	crypto_wipe(hash_area, sizeof(hash_area));
+}
+
+/*
+ * Fills (then re-fills) the remaining blocks of n instances in lockstep:
+ * block i of every instance is computed before block i + 1 of any, so that
+ * loading one instance's reference block overlaps another's arithmetic.
+ * Without a schedule, n must be 1.
+ * nb_blocks must already be rounded down to a multiple of 4.
+ */
+static void
+fill_blocks(const struct Kernel *k, block *const *areas, size_t n,
+		uint32_t nb_blocks, uint32_t nb_iterations,
+		const struct Schedule *sched)
+{
+	uint32_t segment_size = nb_blocks / 4;
+	size_t r = 0;
+
+	if (sched != NULL) {
+		for (size_t i = 0; i < PREFETCH_DISTANCE && i < sched->nrefs;
+				++i) {
+			for (size_t j = 0; j < n; ++j)
+				prefetch_block(areas[j] + sched->refs[i]);
+		}
+	}
+
+	for (uint32_t pass_number = 0; pass_number < nb_iterations;
+			++pass_number) {
+		int first_pass = pass_number == 0;
+
+		for (uint32_t segment = 0; segment < 4; ++segment) {
+			gidx_ctx gctx;
+			/* On the first segment of the first pass,
+			 * blocks 0 and 1 are already filled.
+			 * We use the offset to skip them.
+			 */
+			uint32_t start_offset = first_pass && segment == 0
+				? 2 : 0;
+			uint32_t segment_start = segment * segment_size
+				+ start_offset;
+			uint32_t segment_end = (segment + 1) * segment_size;
+
+			if (sched == NULL)
+				gidx_init(&gctx, pass_number, segment,
+						nb_blocks, nb_iterations);
+			for (uint32_t current_block = segment_start;
+					current_block < segment_end;
+					++current_block) {
+				uint32_t reference_block;
+				uint32_t previous_block = current_block == 0
+					? nb_blocks - 1
+					: current_block - 1;
+				const uint32_t *ahead = NULL;
+
+				if (sched != NULL) {
+					reference_block = sched->refs[r];
+					if (r + PREFETCH_DISTANCE < sched->nrefs)
+						ahead = &sched->refs[r
+							+ PREFETCH_DISTANCE];
+					++r;
+				} else {
+					reference_block = gidx_next(&gctx);
+				}
+
+				for (size_t j = 0; j < n; ++j) {
+					if (ahead != NULL)
+						prefetch_block(areas[j]
+								+ *ahead);
+					k->compress(areas[j] + current_block,
+							areas[j]
+							+ previous_block,
+							areas[j]
+							+ reference_block,
+							!first_pass);
+				}
+			}
+		}
+	}
+}
+
+/* Hashes the last block into the output and wipes the work area. */
+static void
+finish(uint8_t *hash, uint32_t hash_size, void *work_area,
+		uint32_t nb_blocks)
+{
+	block *blocks = work_area;
+	uint8_t hash_area[1024];
+	volatile uint64_t *p;
+
+	/* hash the very last block with H' into the output hash */
+	store_block(hash_area, blocks + (nb_blocks - 1));
+	extended_hash(hash, hash_size, hash_area, 1024);
+
+	/* wipe final block and work area */
+	crypto_wipe(hash_area, sizeof(hash_area));
+	p = work_area;
+	for (size_t i = 0; i < 128 * (size_t)nb_blocks; ++i)
+		p[i] = 0;
+}
+
+static void
+argon2i_kernel(const struct Kernel *k, const struct Argon2Input *in,
+		size_t n, uint32_t hash_size, uint32_t nb_blocks,
+		uint32_t nb_iterations)
+{
+	/* work areas seen as blocks (must be suitably aligned) */
+	block *areas[ARGON2_MAX_WAYS];
+	const struct Schedule *sched;
+	uint32_t rounded;
+
+	if (n == 0 || n > ARGON2_MAX_WAYS) {
+		log_fatal(SS_INT, "argon2i: bad number of instances %zu", n);
+		return;
+	}
+
+	for (size_t j = 0; j < n; ++j) {
+		areas[j] = in[j].work_area;
+		fill_first_blocks(areas[j], hash_size, nb_blocks,
+				nb_iterations,
+				in[j].password, in[j].password_size,
+				in[j].salt, in[j].salt_size);
+	}
+
+	/* Actual number of blocks */
+	rounded = nb_blocks - nb_blocks % 4;	/* round down to 4 p */
+
+	if ((sched = schedule_get(rounded, nb_iterations)) != NULL) {
+		fill_blocks(k, areas, n, rounded, nb_iterations, sched);
+	} else {
+		for (size_t j = 0; j < n; ++j)
+			fill_blocks(k, &areas[j], 1, rounded, nb_iterations,
+					NULL);
+	}
+
+	for (size_t j = 0; j < n; ++j)
+		finish(in[j].hash, hash_size, in[j].work_area, rounded);
+}
+
+void
+argon2i(uint8_t *hash, uint32_t hash_size,
+		void *work_area, uint32_t nb_blocks,
+		uint32_t nb_iterations,
+		const uint8_t *password, uint32_t password_size,
+		const uint8_t *salt, uint32_t salt_size)
+{
+	struct Argon2Input in = {
+		.hash = hash,
+		.work_area = work_area,
+		.password = password,
+		.password_size = password_size,
+		.salt = salt,
+		.salt_size = salt_size
+	};
+
+	argon2i_multi(&in, 1, hash_size, nb_blocks, nb_iterations);
+}
+
+/*
+ * Computes n (at most ARGON2_MAX_WAYS) independent hashes with the same
+ * parameters at once.
+ * The results are the same as n calls to argon2i().
+ */
+void
+argon2i_multi(const struct Argon2Input *in, size_t n, uint32_t hash_size,
+		uint32_t nb_blocks, uint32_t nb_iterations)
+{
+	argon2i_kernel(kernel != NULL ? kernel : SCALAR_KERNEL,
+			in, n, hash_size, nb_blocks, nb_iterations);
+}
+
+/*
+ * Multi-lane argon2 (argon2i and argon2id, any number of lanes), as in
+ * RFC 9106.
+ * Within a slice, the lanes do not depend on each other, so each lane gets a
+ * thread; the threads meet after every slice.
+ * The first two slices of the first pass of argon2id use argon2i's addressing,
+ * the rest derive the reference block from the previous block.
+ */
+
+struct Lanes;
+
+struct LaneWorker {
+	struct Lanes *lanes;
+	uint32_t lane;
+	sem_t go;
+	pthread_t thread;
+	bool started;
+};
+
+struct Lanes {
+	const struct Kernel *k;
+	block *blocks;
+	enum Argon2Type type;
+	uint32_t nb_blocks;
+	uint32_t nb_iterations;
+	uint32_t nb_lanes;
+	uint32_t lane_length;
+	uint32_t segment_length;
+	/* What the lane workers are to do next; set before they are woken */
+	uint32_t pass_number;
+	uint32_t slice_number;
+	bool stop;
+	sem_t done;
+	struct LaneWorker workers[ARGON2_MAX_LANES];
+};
+
+static void
+next_addresses(block *addresses, block *input)
+{
+	input->a[6]++;
+	copy_block(addresses, input);
+	unary_g(addresses);
+	unary_g(addresses);
+}
+
+static void
+fill_segment(const struct Lanes *l, uint32_t pass_number,
+		uint32_t slice_number, uint32_t lane)
+{
+	block *lane_blocks = l->blocks + (size_t)lane * l->lane_length;
+	block addresses, input;
+	bool independent = l->type == ARGON2_I
+		|| (pass_number == 0 && slice_number < 2);
+	/* Blocks 0 and 1 of every lane are already filled. */
+	uint32_t start = pass_number == 0 && slice_number == 0 ? 2 : 0;
+	uint32_t start_pos = pass_number == 0 || slice_number == 3
+		? 0 : (slice_number + 1) * l->segment_length;
+
+	if (independent) {
+		memset(&input, 0, sizeof(input));
+		input.a[0] = pass_number;
+		input.a[1] = lane;
+		input.a[2] = slice_number;
+		input.a[3] = l->nb_blocks;
+		input.a[4] = l->nb_iterations;
+		input.a[5] = l->type;
+		if (start != 0)
+			next_addresses(&addresses, &input);
+	}
+
+	for (uint32_t i = start; i < l->segment_length; ++i) {
+		uint32_t current = slice_number * l->segment_length + i;
+		uint32_t previous = current == 0
+			? l->lane_length - 1 : current - 1;
+		uint64_t pseudo_rand, x, y;
+		uint32_t ref_lane, area_size;
+
+		if (independent) {
+			if (i % 128 == 0)
+				next_addresses(&addresses, &input);
+			pseudo_rand = addresses.a[i % 128];
+		} else {
+			pseudo_rand = lane_blocks[previous].a[0];
+		}
+
+		ref_lane = (uint32_t)((pseudo_rand >> 32) % l->nb_lanes);
+		if (pass_number == 0 && slice_number == 0)
+			ref_lane = lane;
+
+		/* Finished segments (the last three on later passes) plus,
+		 * in the same lane, what is done of this one; other lanes
+		 * lose their last block if this is the segment's first.
+		 */
+		area_size = pass_number == 0
+			? slice_number * l->segment_length
+			: l->lane_length - l->segment_length;
+		if (ref_lane == lane)
+			area_size += i - 1;
+		else if (i == 0)
+			area_size -= 1;
+
+		x = ((pseudo_rand & 0xffffffff) * (pseudo_rand & 0xffffffff))
+			>> 32;
+		y = ((uint64_t)area_size * x) >> 32;
+
+		l->k->compress(lane_blocks + current,
+				lane_blocks + previous,
+				l->blocks + (size_t)ref_lane * l->lane_length
+				+ (start_pos + area_size - 1 - y)
+				% l->lane_length,
+				pass_number != 0);
+	}
+}
+
+static void *
+lane_worker(void *arg)
+{
+	struct LaneWorker *w = arg;
+	struct Lanes *l = w->lanes;
+
+	for (;;) {
+		while (sem_wait(&w->go) != 0)
+			;
+		if (l->stop)
+			break;
+		fill_segment(l, l->pass_number, l->slice_number, w->lane);
+		sem_post(&l->done);
+	}
+
+	return NULL;
+}
+
+/*
+ * Lane 0 always runs on the calling thread, as does any lane whose thread
+ * could not be started.
+ */
+static void
+fill_lanes(struct Lanes *l)
+{
+	uint32_t nstarted = 0;
+
+	if (l->nb_lanes > 1 && sem_init(&l->done, 0, 0) == 0) {
+		for (uint32_t lane = 1; lane < l->nb_lanes; ++lane) {
+			struct LaneWorker *w = &l->workers[lane];
+
+			w->lanes = l;
+			w->lane = lane;
+			if (sem_init(&w->go, 0, 0) != 0)
+				break;
+			if (pthread_create(&w->thread, NULL, lane_worker, w)
+					!= 0) {
+				sem_destroy(&w->go);
+				break;
+			}
+			++nstarted;
+		}
+		if (nstarted == 0)
+			sem_destroy(&l->done);
+	}
+	if (nstarted + 1 < l->nb_lanes)
+		log_debug(SS_INT, "argon2: %" PRIu32 " lane(s) without a "
+				"thread of their own",
+				l->nb_lanes - nstarted - 1);
+
+	l->stop = false;
+	for (uint32_t pass_number = 0; pass_number < l->nb_iterations;
+			++pass_number) {
+		for (uint32_t slice_number = 0; slice_number < 4;
+				++slice_number) {
+			l->pass_number = pass_number;
+			l->slice_number = slice_number;
+			for (uint32_t lane = 1; lane <= nstarted; ++lane)
+				sem_post(&l->workers[lane].go);
+			fill_segment(l, pass_number, slice_number, 0);
+			for (uint32_t lane = nstarted + 1; lane < l->nb_lanes;
+					++lane)
+				fill_segment(l, pass_number, slice_number,
+						lane);
+			for (uint32_t lane = 1; lane <= nstarted; ++lane) {
+				while (sem_wait(&l->done) != 0)
+					;
+			}
+		}
+	}
+
+	if (nstarted == 0)
+		return;
+	l->stop = true;
+	for (uint32_t lane = 1; lane <= nstarted; ++lane) {
+		sem_post(&l->workers[lane].go);
+		pthread_join(l->workers[lane].thread, NULL);
+		sem_destroy(&l->workers[lane].go);
+	}
+	sem_destroy(&l->done);
+}
+
+/*
+ * Computes a (possibly) multi-lane argon2 hash.
+ * The work area must hold nb_blocks blocks; nb_blocks must be at least
+ * 8 * nb_lanes.
+ */
+void
+argon2(enum Argon2Type type, uint8_t *hash, uint32_t hash_size,
+		void *work_area, uint32_t nb_blocks,
+		uint32_t nb_iterations, uint32_t nb_lanes,
+		const uint8_t *password, uint32_t password_size,
+		const uint8_t *salt, uint32_t salt_size,
+		const uint8_t *key, uint32_t key_size,
+		const uint8_t *ad, uint32_t ad_size)
+{
+	struct Lanes l;
+	crypto_blake2b_ctx ctx;
+	uint8_t initial_hash[72];	/* 64 bytes plus 2 words for H' */
+	uint8_t hash_area[1024];
+	block final;
+	volatile uint64_t *p;
+
+	if (nb_lanes == 0 || nb_lanes > ARGON2_MAX_LANES
+			|| nb_blocks < 8 * nb_lanes) {
+		log_fatal(SS_INT, "argon2: bad parameters (%" PRIu32
+				" blocks, %" PRIu32 " lanes)",
+				nb_blocks, nb_lanes);
+		return;
+	}
+
+	crypto_blake2b_init(&ctx);
+	blake_update_32(&ctx, nb_lanes);
+	blake_update_32(&ctx, hash_size);
+	blake_update_32(&ctx, nb_blocks);
+	blake_update_32(&ctx, nb_iterations);
+	blake_update_32(&ctx, 0x13);		/* v: version number */
+	blake_update_32(&ctx, type);
+	blake_update_32(&ctx, password_size);
+	crypto_blake2b_update(&ctx, password, password_size);
+	blake_update_32(&ctx, salt_size);
+	crypto_blake2b_update(&ctx, salt, salt_size);
+	blake_update_32(&ctx, key_size);
+	crypto_blake2b_update(&ctx, key, key_size);
+	blake_update_32(&ctx, ad_size);
+	crypto_blake2b_update(&ctx, ad, ad_size);
+	crypto_blake2b_final(&ctx, initial_hash);
+
+	l.k = kernel != NULL ? kernel : SCALAR_KERNEL;
+	l.blocks = work_area;
+	l.type = type;
+	l.nb_blocks = nb_blocks - nb_blocks % (4 * nb_lanes);
+	l.nb_iterations = nb_iterations;
+	l.nb_lanes = nb_lanes;
+	l.lane_length = l.nb_blocks / nb_lanes;
+	l.segment_length = l.lane_length / 4;
+
+	/* fill the first 2 blocks of every lane */
+	for (uint32_t lane = 0; lane < nb_lanes; ++lane) {
+		block *lane_blocks = l.blocks + (size_t)lane * l.lane_length;
+
+		store32_le(initial_hash + 68, lane);
+		store32_le(initial_hash + 64, 0);
+		extended_hash(hash_area, 1024, initial_hash, 72);
+		load_block(lane_blocks, hash_area);
+		store32_le(initial_hash + 64, 1);
+		extended_hash(hash_area, 1024, initial_hash, 72);
+		load_block(lane_blocks + 1, hash_area);
+	}
+	crypto_wipe(initial_hash, sizeof(initial_hash));
+
+	fill_lanes(&l);
+
+	/* hash the XOR of the last blocks with H' into the output hash */
+	copy_block(&final, l.blocks + l.lane_length - 1);
+	for (uint32_t lane = 1; lane < nb_lanes; ++lane)
+		xor_block(&final, l.blocks + (size_t)lane * l.lane_length
+				+ l.lane_length - 1);
+	store_block(hash_area, &final);
+	extended_hash(hash, hash_size, hash_area, 1024);
+
+	crypto_wipe(&final, sizeof(final));
+	crypto_wipe(hash_area, sizeof(hash_area));
+	p = work_area;
+	for (size_t i = 0; i < 128 * (size_t)l.nb_blocks; ++i)
+		p[i] = 0;
+}
+
+/*
+ * Known-answer test: a kernel has to agree with the scalar kernel on a single
+ * compression in both modes and with crypto_argon2i() on whole (small)
+ * hashes, both alone and interleaved.
+ * The multi-lane code is checked against the test vectors of RFC 9106 and,
+ * with a single lane, against crypto_argon2i().
+ */
+static int
+kernel_kat(const struct Kernel *k)
+{
+	static const uint8_t password[] = "correct horse battery staple";
+	static const uint8_t salt[16] = "LM argon2i KAT!";
+	static block work_area[ARGON2_MAX_WAYS][KAT_BLOCKS];
+	/* RFC 9106, sections 5.2 and 5.3 */
+	static const struct {
+		enum Argon2Type type;
+		uint8_t tag[32];
+	} rfc[] = {
+		{ARGON2_I, {
+			0xc8, 0x14, 0xd9, 0xd1, 0xdc, 0x7f, 0x37, 0xaa,
+			0x13, 0xf0, 0xd7, 0x7f, 0x24, 0x94, 0xbd, 0xa1,
+			0xc8, 0xde, 0x6b, 0x01, 0x6d, 0xd3, 0x88, 0xd2,
+			0x99, 0x52, 0xa4, 0xc4, 0x67, 0x2b, 0x6c, 0xe8
+		}},
+		{ARGON2_ID, {
+			0x0d, 0x64, 0x0d, 0xf5, 0x8d, 0x78, 0x76, 0x6c,
+			0x08, 0xc0, 0x37, 0xa3, 0x4a, 0x8b, 0x53, 0xc9,
+			0xd0, 0x1e, 0xf0, 0x45, 0x2d, 0x75, 0xb6, 0x5e,
+			0xb5, 0x25, 0x20, 0xe9, 0x6b, 0x01, 0xe6, 0x59
+		}}
+	};
+	uint8_t rfc_password[32], rfc_salt[16], rfc_key[8], rfc_ad[12];
+	const struct Kernel *saved;
+	struct Argon2Input in[ARGON2_MAX_WAYS];
+	block x, y, expect, got;
+	uint8_t seed[64];
+	uint8_t want[ARGON2_MAX_WAYS][32], have[ARGON2_MAX_WAYS][32];
+	int ret = 0;
+
+	crypto_blake2b(seed, salt, sizeof(salt));
+	extended_hash((uint8_t *)x.a, sizeof(x.a), seed, 32);
+	extended_hash((uint8_t *)y.a, sizeof(y.a), seed + 32, 32);
+
+	for (int xor = 0; xor <= 1; ++xor) {
+		copy_block(&expect, &y);
+		copy_block(&got, &y);
+		compress_scalar(&expect, &x, &y, xor);
+		k->compress(&got, &x, &y, xor);
+		if (memcmp(&expect, &got, sizeof(got)) != 0)
+			ret = -1;
+	}
+
+	/* Instance j hashes the first len - j bytes of the password. */
+	for (size_t j = 0; j < ARGON2_MAX_WAYS; ++j) {
+		crypto_argon2i(want[j], sizeof(want[j]), work_area[j],
+				KAT_BLOCKS, KAT_ITERATIONS,
+				password, (uint32_t)(sizeof(password) - 1 - j),
+				salt, sizeof(salt));
+		in[j].hash = have[j];
+		in[j].work_area = work_area[j];
+		in[j].password = password;
+		in[j].password_size = (uint32_t)(sizeof(password) - 1 - j);
+		in[j].salt = salt;
+		in[j].salt_size = sizeof(salt);
+	}
+
+	/* First as for parameters without a schedule, then with one. */
+	for (int prepared = 0; prepared <= 1; ++prepared) {
+		if (prepared && argon2_prepare(KAT_BLOCKS, KAT_ITERATIONS) != 0)
+			return -1;
+		for (size_t n = 1; n <= (prepared ? ARGON2_MAX_WAYS : 1);
+				n *= 2) {
+			memset(have, 0, sizeof(have));
+			argon2i_kernel(k, in, n, sizeof(have[0]), KAT_BLOCKS,
+					KAT_ITERATIONS);
+			for (size_t j = 0; j < n; ++j) {
+				if (crypto_verify32(want[j], have[j]) != 0)
+					ret = -1;
+			}
+		}
+	}
+
+	/* argon2() uses the global kernel; put k there for the moment. */
+	saved = kernel;
+	kernel = k;
+
+	argon2(ARGON2_I, have[0], sizeof(have[0]), work_area, KAT_BLOCKS,
+			KAT_ITERATIONS, 1,
+			password, sizeof(password) - 1, salt, sizeof(salt),
+			NULL, 0, NULL, 0);
+	if (crypto_verify32(want[0], have[0]) != 0)
+		ret = -1;
+
+	memset(rfc_password, 0x01, sizeof(rfc_password));
+	memset(rfc_salt, 0x02, sizeof(rfc_salt));
+	memset(rfc_key, 0x03, sizeof(rfc_key));
+	memset(rfc_ad, 0x04, sizeof(rfc_ad));
+	for (size_t i = 0; i < sizeof(rfc)/sizeof(*rfc); ++i) {
+		argon2(rfc[i].type, have[0], sizeof(have[0]), work_area, 32,
+				3, 4,
+				rfc_password, sizeof(rfc_password),
+				rfc_salt, sizeof(rfc_salt),
+				rfc_key, sizeof(rfc_key),
+				rfc_ad, sizeof(rfc_ad));
+		if (crypto_verify32(rfc[i].tag, have[0]) != 0)
+			ret = -1;
+	}
+
+	kernel = saved;
+	return ret;
+}
+
+/*
+ * Picks the compression kernel: the named one, or the best one the CPU
+ * supports for "auto".
+ * Kernels that fail the known-answer test are skipped.
+ */
+int
+argon2_init(const char *name)
+{
+	bool any = !strcmp(name, "auto");
+
+#ifdef HAS_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+
+	kernel = NULL;
+	for (size_t i = 0; i < NKERNELS; ++i) {
+		const struct Kernel *k = &kernels[i];
+
+		if (!any && strcmp(name, k->name))
+			continue;
+		if (k->supported != NULL && !k->supported()) {
+			if (!any)
+				log_warn(SS_INT, "argon2 kernel %s not "
+						"supported by this CPU",
+						k->name);
+			continue;
+		}
+		if (kernel_kat(k) != 0) {
+			log_error(SS_INT, "argon2 kernel %s failed its "
+					"known-answer test", k->name);
+			continue;
+		}
+
+		kernel = k;
+		break;
+	}
+
+	if (kernel == NULL) {
+		if (any) {
+			log_fatal(SS_INT, "no working argon2 kernel");
+			return -1;
+		}
+		log_warn(SS_INT, "falling back to the scalar argon2 kernel");
+		kernel = SCALAR_KERNEL;
+	}
+
+	log_info(SS_INT, "using the %s argon2 kernel", kernel->name);
+	return 0;
+}
+
+const char *
+argon2_kernel_name(void)
+{
+	return kernel != NULL ? kernel->name : SCALAR_KERNEL->name;
+}
+
+/*
+ * Computes the index schedule for the given parameters ahead of time, so that
+ * forked hashers share it; only hashes with prepared parameters use one.
+ * Kept until argon2_fini().
+ */
+int
+argon2_prepare(uint32_t nb_blocks, uint32_t nb_iterations)
+{
+	struct Schedule *sched;
+
+	nb_blocks -= nb_blocks % 4;
+	if (schedule_get(nb_blocks, nb_iterations) != NULL)
+		return 0;
+	if ((sched = schedule_new(nb_blocks, nb_iterations)) == NULL) {
+		log_error(SS_INT, "unable to allocate argon2i schedule for %"
+				PRIu32 " blocks, %" PRIu32 " passes",
+				nb_blocks, nb_iterations);
+		return -1;
+	}
+	pthread_mutex_lock(&schedules_lock);
+	sched->next = schedules;
+	schedules = sched;
+	pthread_mutex_unlock(&schedules_lock);
+	log_debug(SS_INT, "argon2i schedule for %" PRIu32 " blocks, %" PRIu32
+			" passes ready", nb_blocks, nb_iterations);
+	return 0;
+}
+
+void
+argon2_fini(void)
+{
+	struct Schedule *sched, *next;
+
+	pthread_mutex_lock(&schedules_lock);
+	for (sched = schedules; sched != NULL; sched = next) {
+		next = sched->next;
+		free(sched);
+	}
+	schedules = NULL;
+	pthread_mutex_unlock(&schedules_lock);
+}
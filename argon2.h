@@ -0,0 +1,59 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_ARGON2_H
+#define LM_ARGON2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The most hashes argon2i_multi() computes at once. */
+#define ARGON2_MAX_WAYS	(4)
+/* The most lanes argon2() supports; each lane may get a thread. */
+#define ARGON2_MAX_LANES	(16)
+
+/* The y of the spec */
+enum Argon2Type {
+	ARGON2_I = 1,
+	ARGON2_ID = 2
+};
+
+struct Argon2Input {
+	uint8_t *hash;
+	void *work_area;
+	const uint8_t *password;
+	uint32_t password_size;
+	const uint8_t *salt;
+	uint32_t salt_size;
+};
+
+int argon2_init(const char *kernel);
+int argon2_prepare(uint32_t nb_blocks, uint32_t nb_iterations);
+void argon2_fini(void);
+const char *argon2_kernel_name(void);
+void argon2i(uint8_t *hash, uint32_t hash_size,
+		void *work_area, uint32_t nb_blocks,
+		uint32_t nb_iterations,
+		const uint8_t *password, uint32_t password_size,
+		const uint8_t *salt, uint32_t salt_size);
+void argon2(enum Argon2Type type, uint8_t *hash, uint32_t hash_size,
+		void *work_area, uint32_t nb_blocks,
+		uint32_t nb_iterations, uint32_t nb_lanes,
+		const uint8_t *password, uint32_t password_size,
+		const uint8_t *salt, uint32_t salt_size,
+		const uint8_t *key, uint32_t key_size,
+		const uint8_t *ad, uint32_t ad_size);
+void argon2i_multi(const struct Argon2Input *in, size_t n, uint32_t hash_size,
+		uint32_t nb_blocks, uint32_t nb_iterations);
+
+#endif
+
@@ -11,6 +11,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -21,11 +22,13 @@
 
 #include "commands.h"
 #include "db.h"
+#include "hasher.h"
 #include "lm.h"
 #include "logging.h"
 #include "numnick.h"
 #include "mail.h"
 #include "monocypher.h"
+#include "stats.h"
 #include "entities.h"
 #include "token.h"
 #include "util.h"
@@ -35,7 +38,7 @@
 #define C_NM	"\002"
 #define C_SY	"\002"
 
-#define NCOMMANDS	(9)
+#define NCOMMANDS	(10)
 /* Four for RESETPASS. */
 #define MAX_ARGS	(4)
 
@@ -68,6 +71,28 @@ usage(const struct User *u, const struct Command *cmd)
 	reply(u, "Usage: " C_NM "%s %s", cmd->name, cmd->usage);
 }
 
+/* DBE_BUSY: too many requests waiting for a hasher, or this one waited
+ * too long.
+ */
+static void
+reply_busy(const struct User *u)
+{
+	reply(u, "Services are busy right now; please try again in a "
+			"minute.");
+}
+
+/* For callbacks that may run after the user is gone; the callback resolves
+ * it with user_from_handle() and frees it.
+ */
+static struct UserHandle *
+hold_user(const struct User *u)
+{
+	struct UserHandle *h = smalloc(sizeof(*h));
+
+	*h = user_handle(u);
+	return h;
+}
+
 /* ':' restriction in case a network has a /AUTH command and a client naively
  * forwards the colon.
  */
@@ -102,9 +127,14 @@ is_valid_email(const char *email)
 static void
 cmd_auth_cb(enum DBError dbe, const char *account, time_t ts, void *arg)
 {
-	struct User *source = arg;
+	struct User *source = user_from_handle(arg);
 	char numnick[6];
 
+	free(arg);
+	/* Quit or split while we were hashing; also DBE_CANCELLED. */
+	if (source == NULL)
+		return;
+
 	switch (dbe) {
 	case DBE_OK:
 		strcpy(source->account, account);
@@ -125,6 +155,9 @@ cmd_auth_cb(enum DBError dbe, const char *account, time_t ts, void *arg)
 			(dbe == DBE_NO_SUCH_ACCOUNT) ? "non-existent " : "",
 			account);
 		break;
+	case DBE_BUSY:
+		reply_busy(source);
+		break;
 	default:
 		reply(source, "An error was encountered when fetching "
 				"the account.");
@@ -151,7 +184,8 @@ cmd_auth(const struct Command *cmd, struct User *source,
 		return CS_SYNTAX;
 	}
 
-	db_check_auth(argv[0], argv[1], cmd_auth_cb, source);
+	db_check_auth(argv[0], argv[1], source, HC_AUTH, cmd_auth_cb,
+			hold_user(source));
 	return CS_OK;
 }
 
@@ -205,13 +239,75 @@ cmd_help(const struct Command *cmd, struct User *source,
 	return CS_FAILURE;
 }
 
+static void
+cmd_hello_cb(enum DBError dbe, const char *account, const char *email,
+		void *arg)
+{
+	const struct User *source = user_from_handle(arg);
+	char token[TOKEN_LEN + 1];
+
+	free(arg);
+	/* The account expires unconfirmed. */
+	if (source == NULL)
+		return;
+
+	switch (dbe) {
+	case DBE_ACCOUNT_IN_USE:
+		reply(source, "Username or e-mail already in use.");
+		return;
+	case DBE_OK:
+		break;
+	default:
+		reply(source, "An error was encountered when creating "
+				"your account.");
+		reply(source, "Please contact an IRC operator with this "
+				"error code: %d.", dbe);
+		return;
+	}
+
+	if (token_create(token, account) == NULL) {
+		/* We only get here on randombytes() failure. */
+		reply(source, "An error was encountered when creating "
+				"your account.");
+		reply(source, "Please contact an IRC operator with this "
+				"error code: RND.");
+		return;
+	}
+
+	if (mail(source, email,
+				"Dear %s,\n"
+				"\n"
+				"Thank you for signing up with %s.\n"
+				"You must still confirm your account.\n"
+				"If you did not request this, please ignore "
+				"this message.\n"
+				"To confirm your account, use this command:\n"
+				"/msg %s@%s CONFIRM %s newpassword "
+				"newpassword\n"
+				"where \"newpassword\" is the new password to "
+				"use.",
+				account,
+				config.user.nick,
+				config.user.nick,
+				config.server.name,
+				token) != 0) {
+		reply(source, "An error was encountered sending e-mail.");
+		reply(source, "Please contact an IRC operator.");
+		return;
+	}
+
+	reply(source, "Account created successfully.");
+	reply(source, C_SY "Your account still needs to be confirmed in the "
+			"next 30 minutes" C_SY ".");
+	reply(source, "Please check your e-mail inbox for further"
+			" instructions.");
+}
+
 static enum CommandStatus
 cmd_hello(const struct Command *cmd, struct User *source,
 		size_t argc, char *argv[])
 {
 	size_t account_len;
-	enum DBError dbe;
-	char token[TOKEN_LEN + 1];
 	char *account, *email;
 
 	if (user_authed(source)) {
@@ -275,56 +371,7 @@ cmd_hello(const struct Command *cmd, struct User *source,
 		return CS_FAILURE;
 	}
 
-	switch ((dbe = db_create_account(source, account, email))) {
-	case DBE_ACCOUNT_IN_USE:
-		reply(source, "Username or e-mail already in use.");
-		return CS_FAILURE;
-	case DBE_OK:
-		break;
-	default:
-		reply(source, "An error was encountered when creating "
-				"your account.");
-		reply(source, "Please contact an IRC operator with this "
-				"error code: %d.", dbe);
-		return CS_INTERNAL;
-	}
-
-	if (token_create(token, account) == NULL) {
-		/* We only get here on randombytes() failure. */
-		reply(source, "An error was encountered when creating "
-				"your account.");
-		reply(source, "Please contact an IRC operator with this "
-				"error code: RND.");
-		return CS_INTERNAL;
-	}
-
-	if (mail(source, email,
-				"Dear %s,\n"
-				"\n"
-				"Thank you for signing up with %s.\n"
-				"You must still confirm your account.\n"
-				"If you did not request this, please ignore "
-				"this message.\n"
-				"To confirm your account, use this command:\n"
-				"/msg %s@%s CONFIRM %s newpassword "
-				"newpassword\n"
-				"where \"newpassword\" is the new password to "
-				"use.",
-				account,
-				config.user.nick,
-				config.user.nick,
-				config.server.name,
-				token) != 0) {
-		reply(source, "An error was encountered sending e-mail.");
-		reply(source, "Please contact an IRC operator.");
-		return CS_INTERNAL;
-	}
-
-	reply(source, "Account created successfully.");
-	reply(source, C_SY "Your account still needs to be confirmed in the "
-			"next 30 minutes" C_SY ".");
-	reply(source, "Please check your e-mail inbox for further"
-			" instructions.");
+	db_create_account(account, email, cmd_hello_cb, hold_user(source));
 	return CS_OK;
 }
 
@@ -332,10 +379,22 @@ static void
 cmd_confirm_cb(enum DBError dbe, const char *account, time_t ts,
 		void *arg)
 {
-	const struct User *source = arg;
+	const struct User *source = user_from_handle(arg);
 
 	(void)ts;
+	free(arg);
+
+	if (source == NULL) {
+		if (dbe == DBE_OK)
+			log_audit("password for account %s set (registered) "
+					"after its user quit", account);
+		return;
+	}
 
+	if (dbe == DBE_BUSY) {
+		reply_busy(source);
+		return;
+	}
 	if (dbe != DBE_OK) {
 		reply(source, "An error was encountered when setting "
 				"your password.");
@@ -406,24 +465,31 @@ cmd_confirm(const struct Command *cmd, struct User *source,
 		return CS_FAILURE;
 	}
 
-	db_change_password(account, argv[1],
-		cmd_confirm_cb, source);
+	db_change_password(account, argv[1], source,
+		cmd_confirm_cb, hold_user(source));
 	return CS_OK;
 }
 
-struct NewPassInfo {
-	struct User *source;
-	char newpass[PASSWORD_LEN];
-};
-
 static void
 password_change_cb(enum DBError dbe, const char *account, time_t ts,
 		void *arg)
 {
-	const struct User *source = arg;
+	const struct User *source = user_from_handle(arg);
 
 	(void)ts;
+	free(arg);
+
+	if (source == NULL) {
+		if (dbe == DBE_OK)
+			log_audit("password for account %s changed after its "
+					"user quit", account);
+		return;
+	}
 
+	if (dbe == DBE_BUSY) {
+		reply_busy(source);
+		return;
+	}
 	if (dbe != DBE_OK) {
 		reply(source, "An error was encountered when changing "
 				"your password.");
@@ -440,48 +506,32 @@ password_change_cb(enum DBError dbe, const char *account, time_t ts,
 }
 
 static void
-cmd_newpass_auth_cb(enum DBError dbe, const char *account, time_t ts, void *arg)
+cmd_newpass_cb(enum DBError dbe, const char *account, time_t ts, void *arg)
 {
-	struct NewPassInfo *npi = arg;
-
-	(void)ts;
+	const struct User *source;
 
-	switch (dbe) {
-	case DBE_OK:
-		break;
-	case DBE_PW_MISMATCH:
-		log_audit("%s%s!%s@%s(%s)=%s/%s failed NEWPASS auth for "
-				"account %s",
-			npi->source->is_oper ? "*" : "", npi->source->nick,
-			npi->source->ident,
-			npi->source->host, npi->source->sockip,
-			npi->source->account,
-			npi->source->gecos,
-			account);
-		reply(npi->source, "Old password incorrect.");
-		goto clean;
-	default:
-		reply(npi->source, "An error was encountered when fetching "
-				"your account.");
-		reply(npi->source, "Please contact an IRC operator with this "
-				"error code: %d.", dbe);
-		goto clean;
+	if (dbe != DBE_PW_MISMATCH) {
+		password_change_cb(dbe, account, ts, arg);
+		return;
 	}
 
-	db_change_password(npi->source->account, npi->newpass,
-		password_change_cb, npi->source);
+	source = user_from_handle(arg);
+	free(arg);
+	if (source == NULL)
+		return;
 
-clean:
-	crypto_wipe(npi, sizeof(*npi));
-	free(npi);
+	log_audit("%s%s!%s@%s(%s)=%s/%s failed NEWPASS auth for account %s",
+		source->is_oper ? "*" : "", source->nick, source->ident,
+		source->host, source->sockip, source->account,
+		source->gecos,
+		account);
+	reply(source, "Old password incorrect.");
 }
 
 static enum CommandStatus
 cmd_newpass(const struct Command *cmd, struct User *source,
 		size_t argc, char *argv[])
 {
-	struct NewPassInfo *npi = smalloc(sizeof(*npi));
-
 	if (!user_authed(source)) {
 		reply(source, "You must be authenticated to use this command.");
 		return CS_FAILURE;
@@ -504,12 +554,8 @@ cmd_newpass(const struct Command *cmd, struct User *source,
 		return CS_FAILURE;
 	}
 
-	npi->source = source;
-	/* is_valid_password() does a length check already */
-	strcpy(npi->newpass, argv[1]);
-
-	db_check_auth(source->account, argv[0], cmd_newpass_auth_cb,
-			npi);
+	db_swap_password(source->account, argv[0], argv[1], source,
+			cmd_newpass_cb, hold_user(source));
 
 	crypto_wipe(argv[0], strlen(argv[0]));
 	crypto_wipe(argv[1], strlen(argv[1]));
@@ -517,80 +563,20 @@ cmd_newpass(const struct Command *cmd, struct User *source,
 	return CS_OK;
 }
 
-static enum CommandStatus
-cmd_lostpass(const struct Command *cmd, struct User *source,
-		size_t argc, char *argv[])
+/* Sends the reset token for account to email, once LOSTPASS found them. */
+static void
+lostpass_mail(const struct User *source, const char *account,
+		const char *email)
 {
-	enum DBError dbe;
-	char account[ACCOUNT_LEN + 1];
-	char email[EMAIL_LEN + 1];
 	char token[TOKEN_LEN + 1];
 
-	if ((source->is_oper && argc < 1) ||
-			(!source->is_oper && argc < 2)) {
-		usage(source, cmd);
-		return CS_SYNTAX;
-	}
-
-	/* Due to the way the e-mail shim works, only opers may reset passwords
-	 * if e-mail support is disabled.
-	 * Otherwise, any user could reset any other user's password.
-	 */
-	if (!source->is_oper && *config.mail.sendmailcmd == '\0') {
-		reply(source, "E-mails are disabled.");
-		reply(source, "If you have lost your password, "
-				"contact an IRC operator.");
-		return CS_FAILURE;
-	}
-
-	if (!source->is_oper) {
-		switch ((dbe = db_get_account_by_email(argv[1], account))) {
-		case DBE_OK:
-			break;
-		case DBE_NO_SUCH_ACCOUNT:
-			reply(source, "E-mail %s not associated with any account.",
-					argv[1]);
-			return CS_FAILURE;
-		default:
-			reply(source, "An error was encountered when fetching "
-					"account data.");
-			reply(source, "Please contact an IRC operator with this "
-					"error code: %d.", dbe);
-			return CS_INTERNAL;
-		}
-
-		if (user_authed(source)
-				&& strcasecmp(account, source->account)) {
-			reply(source, "E-mail address mismatch "
-					"for your account.");
-			return CS_FAILURE;
-		}
-
-		strcpy(email, argv[1]);
-	} else {
-		strcpy(account, argv[0]);
-		switch ((dbe = db_get_email_by_account(account, email))) {
-		case DBE_OK:
-			break;
-		case DBE_NO_SUCH_ACCOUNT:
-			reply(source, "No such account %s.", account);
-			return CS_FAILURE;
-		default:
-			reply(source, "An error was encountered when fetching "
-					"account data.");
-			reply(source, "Please contact an IRC operator with this "
-					"error code: %d.", dbe);
-			return CS_INTERNAL;
-		}
-	}
-
 	if (token_create(token, account) == NULL) {
 		/* We only get here on randombytes() failure. */
 		reply(source, "An error was encountered when creating "
 				"your account.");
 		reply(source, "Please contact an IRC operator with this "
 				"error code: RND.");
-		return CS_INTERNAL;
+		return;
 	}
 
 	if (mail(source, email,
@@ -611,12 +597,101 @@ cmd_lostpass(const struct Command *cmd, struct User *source,
 				token) != 0) {
 		reply(source, "An error was encountered sending e-mail.");
 		reply(source, "Please contact an IRC operator.");
-		return CS_INTERNAL;
+		return;
 	}
 
 	reply(source, "A password reset e-mail has been sent to %s.", email);
 	reply(source, "Please check your e-mail account for further "
 			"instructions.");
+}
+
+static void
+lostpass_by_email_cb(enum DBError dbe, const char *account,
+		const char *email, void *arg)
+{
+	const struct User *source = user_from_handle(arg);
+
+	free(arg);
+	if (source == NULL)
+		return;
+
+	switch (dbe) {
+	case DBE_OK:
+		break;
+	case DBE_NO_SUCH_ACCOUNT:
+		reply(source, "E-mail %s not associated with any account.",
+				email);
+		return;
+	default:
+		reply(source, "An error was encountered when fetching "
+				"account data.");
+		reply(source, "Please contact an IRC operator with this "
+				"error code: %d.", dbe);
+		return;
+	}
+
+	if (user_authed(source) && strcasecmp(account, source->account)) {
+		reply(source, "E-mail address mismatch for your account.");
+		return;
+	}
+
+	lostpass_mail(source, account, email);
+}
+
+static void
+lostpass_by_account_cb(enum DBError dbe, const char *account,
+		const char *email, void *arg)
+{
+	const struct User *source = user_from_handle(arg);
+
+	free(arg);
+	if (source == NULL)
+		return;
+
+	switch (dbe) {
+	case DBE_OK:
+		break;
+	case DBE_NO_SUCH_ACCOUNT:
+		reply(source, "No such account %s.", account);
+		return;
+	default:
+		reply(source, "An error was encountered when fetching "
+				"account data.");
+		reply(source, "Please contact an IRC operator with this "
+				"error code: %d.", dbe);
+		return;
+	}
+
+	lostpass_mail(source, account, email);
+}
+
+static enum CommandStatus
+cmd_lostpass(const struct Command *cmd, struct User *source,
+		size_t argc, char *argv[])
+{
+	if ((source->is_oper && argc < 1) ||
+			(!source->is_oper && argc < 2)) {
+		usage(source, cmd);
+		return CS_SYNTAX;
+	}
+
+	/* Due to the way the e-mail shim works, only opers may reset passwords
+	 * if e-mail support is disabled.
+	 * Otherwise, any user could reset any other user's password.
+	 */
+	if (!source->is_oper && *config.mail.sendmailcmd == '\0') {
+		reply(source, "E-mails are disabled.");
+		reply(source, "If you have lost your password, "
+				"contact an IRC operator.");
+		return CS_FAILURE;
+	}
+
+	if (!source->is_oper)
+		db_get_account_by_email(argv[1], lostpass_by_email_cb,
+				hold_user(source));
+	else
+		db_get_email_by_account(argv[0], lostpass_by_account_cb,
+				hold_user(source));
 	return CS_OK;
 }
 
@@ -670,8 +745,8 @@ cmd_resetpass(const struct Command *cmd, struct User *source,
 		return CS_FAILURE;
 	}
 
-	db_change_password(source->account, argv[1],
-		password_change_cb, source);
+	db_change_password(source->account, argv[1], source,
+		password_change_cb, hold_user(source));
 	crypto_wipe(argv[1], strlen(argv[1]));
 	crypto_wipe(argv[2], strlen(argv[2]));
 
@@ -712,6 +787,102 @@ cmd_registerchan(const struct Command *cmd, struct User *source,
 	return CS_OK;
 }
 
+static enum CommandStatus
+cmd_stats(const struct Command *cmd, struct User *source,
+		size_t argc, char *argv[])
+{
+	struct HasherStats hs;
+	struct HashClassStats cs[HC_COUNT];
+	const struct Histogram *h;
+	struct VerifyCacheStats vcs;
+	struct AccountIndexStats ais;
+	struct QueryStats qs[16];
+	struct DBThreadStats dts;
+	char line[400];
+	size_t nqueries, len;
+
+	if (!source->is_oper) {
+		reply(source, "Only IRC operators may use this command.");
+		return CS_FAILURE;
+	}
+
+	hasher_stats(&hs);
+	reply(source, "Hashers (%s): %zu running, %zu to %zu, %u "
+			"request(s) in progress.",
+			hs.engine, hs.workers, hs.min_workers, hs.max_workers,
+			hs.busy);
+	reply(source, "Requests waiting for a hasher: %zu (at most %zu so "
+			"far).", db_hash_queue_length(), stats_queue_peak());
+	db_hash_class_stats(cs);
+	for (size_t i = 0; i < HC_COUNT; ++i) {
+		reply(source, "  %-8s weight %lu: %zu waiting, %" PRIu64
+				" served, %" PRIu64 " busy; waited %" PRIu64
+				" ms on average, %" PRIu64 " ms at most.",
+				cs[i].name, cs[i].weight, cs[i].waiting,
+				cs[i].served, cs[i].busy,
+				(cs[i].served != 0)
+					? cs[i].wait_ms_total / cs[i].served
+					: 0,
+				cs[i].wait_ms_max);
+	}
+	for (size_t i = 0; i < ST_COUNT; ++i) {
+		h = stats_histogram((enum Stage)i);
+		reply(source, "Time for %s: %.1f ms median, %.1f ms p90, "
+				"%.1f ms p99, %.1f ms at most (%" PRIu64
+				" hashes).", stats_stage_name((enum Stage)i),
+				histogram_percentile(h, 0.5) / 1000.0,
+				histogram_percentile(h, 0.9) / 1000.0,
+				histogram_percentile(h, 0.99) / 1000.0,
+				h->max / 1000.0, h->count);
+	}
+	db_verify_cache_stats(&vcs);
+	if (vcs.capacity != 0)
+		reply(source, "Verification cache: %zu of %zu entries, %"
+				PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+				" stored, %" PRIu64 " evicted.",
+				vcs.entries, vcs.capacity, vcs.hits,
+				vcs.misses, vcs.stores, vcs.evictions);
+	else
+		reply(source, "Verification cache: off.");
+	db_account_index_stats(&ais);
+	if (ais.enabled)
+		reply(source, "Account index: %zu accounts%s, %zu KiB (%zu "
+				"bytes per account) plus %zu KiB of buckets.",
+				ais.accounts, ais.loaded ? "" : " so far",
+				ais.bytes / 1024,
+				(ais.accounts != 0)
+					? ais.bytes / ais.accounts : 0,
+				ais.bucket_bytes / 1024);
+	else
+		reply(source, "Account index: off.");
+	nqueries = db_query_stats(qs, sizeof(qs)/sizeof(*qs));
+	len = (size_t)snprintf(line, sizeof(line), "Queries run:");
+	for (size_t i = 0; i < nqueries && i < sizeof(qs)/sizeof(*qs)
+			&& len < sizeof(line); ++i)
+		len += (size_t)snprintf(line + len, sizeof(line) - len,
+				"%s %s %" PRIu64, (i == 0) ? "" : ",",
+				qs[i].name, qs[i].executions);
+	reply(source, "%s.", line);
+	db_thread_stats(&dts);
+	reply(source, "Database thread: %s, %zu job(s) waiting, %" PRIu64
+			" done; %.1f ms in sqlite kept off the event loop, "
+			"%.1f ms at most per job.",
+			dts.running ? "running" : "stopped", dts.waiting,
+			dts.jobs, dts.busy_us_total / 1000.0,
+			dts.busy_us_max / 1000.0);
+	if (hs.budget != 0)
+		reply(source, "Work areas: %zu MB per hasher, %lu MB budget.",
+				hs.footprint, hs.budget);
+	else
+		reply(source, "Work areas: %zu MB per hasher, no budget.",
+				hs.footprint);
+	if (hs.rss != 0)
+		reply(source, "Hasher RSS: %" PRIu64 " MB.", hs.rss >> 10);
+	else
+		reply(source, "Hasher RSS: unknown.");
+	return CS_OK;
+}
+
 static const char *
 cstoa(enum CommandStatus cs) {
 	switch (cs) {
@@ -853,6 +1024,21 @@ C_AR "#channel",
 cmd_registerchan,
 0,
 {(size_t)-1}
+},
+{
+"STATS",
+"Shows hasher and database statistics (IRC operators only).",
+"",
+"Shows how many hashers are running and how busy they are, how many\n"
+"requests of each kind are waiting for one and how long they waited,\n"
+"how long queueing, hashing and the whole request take, how the\n"
+"verification cache and the account index are doing, how often each\n"
+"database query has run, how busy the database thread is, and how much\n"
+"memory the hashers use.\n"
+"This command is only available to IRC operators.",
+cmd_stats,
+0,
+{(size_t)-1}
 }
 };
 
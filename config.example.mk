@@ -6,6 +6,7 @@ CFLAGS += -O2
 # dev: CFLAGS += -Wall -Wextra -Wpedantic -Wno-unused-parameter
 # BSD: CFLAGS += -I/usr/local/include
 # OpenBSD 6.5+: CFLAGS += -DHAS_OPENBSD
+# crypt(3) legacy hashes (see README.md): CFLAGS += -DHAS_CRYPT
 
 # linking
 # BSD: LDFLAGS = -L/usr/local/lib
@@ -13,4 +14,5 @@ CFLAGS += -O2
 # libevent must be libevent2; Solaris may need additional libraries
 LDLIBS  = -levent -lpthread -ldl
 #OpenBSD: LDLIBS  = -levent_core -levent_openssl -lpthread
+# crypt(3) legacy hashes, except on OpenBSD: LDLIBS += -lcrypt
 
@@ -10,17 +10,33 @@
  * <https://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
 #include "db.h"
+#include "hasher.h"
+#include "legacy.h"
 #include "lm.h"
 #include "logging.h"
 #include "mail.h"
 #include "monocypher.h"
+#include "numnick.h"
 #include "sqlite3.h"
+#include "stats.h"
 #include "entities.h"
 #include "token.h"
 #include "util.h"
@@ -28,38 +44,724 @@
 struct HashRequest {
 	struct HashRequest *next;
 	void *theirarg;
+	/* NULL once mycallback has passed the answer on to a database job */
 	void (*theircallback)(enum DBError dbe,
 			const char *account,
 			time_t ts,
 			void *arg);
-	enum DBError (*mycallback)(uint8_t *salt,
-			uint8_t *myhash,
-			uint8_t *theirhash,
-			const char *account,
-			time_t ts);
+	enum DBError (*mycallback)(struct HashRequest *hr,
+			uint8_t *theirhash);
 	time_t ts;
-	char account[ACCOUNT_LEN];
+	/* CLOCK_MONOTONIC second after which a request that is still waiting
+	 * for a hasher is given up on; 0 for never.
+	 */
+	time_t deadline;
+	/* When the request was queued and handed to a hasher, for stats.c */
+	struct timespec queued;
+	struct timespec dispatched;
+	uint32_t id;
+	enum HashClass cls;
+	/* Where the request came from, see source_key() */
+	char source[SOCKIP_LEN + 1];
+	/* The user who is waiting for the result; a zero generation means
+	 * nobody in particular, and the request is never cancelled.
+	 */
+	struct UserHandle owner;
+	char account[ACCOUNT_LEN + 1];
+	/* Only held until the request is handed to a hasher, unless the
+	 * account is to be rehashed once the password checks out.
+	 */
+	char password[PASSWORD_LEN];
+	bool rehash;
 	uint8_t myhash[HASH_LEN];
 	uint8_t salt[SALT_LEN];
+	struct HashParams params;
+	/* Keyed MAC of params, salt and password, so that a duplicate can
+	 * be recognized without holding on to the password.
+	 */
+	uint8_t key[32];
+	/* Duplicates waiting on this request's hash, oldest first, chained
+	 * through next.
+	 */
+	struct HashRequest *followers;
+	/* What to put in the verification cache on success, if cacheable */
+	bool cacheable;
+	uint8_t cache_mac[32];
+};
+
+/* The waiting requests of one class from one source, oldest first */
+struct HashFlow {
+	/* Next flow of the same class to be served */
+	struct HashFlow *next;
+	struct HashRequest *head;
+	struct HashRequest *tail;
+	size_t length;
+	char source[SOCKIP_LEN + 1];
+};
+
+/*
+ * Requests waiting for a free hasher.
+ * Every class gets hasher:<class>_weight requests per round in turn (deficit
+ * round-robin, with every hash costing the same); within a class, every
+ * source gets one request per turn, so that one source flooding a class only
+ * slows down itself.
+ */
+static struct HashClassQueue {
+	const char *name;
+	/* Flows with waiting requests, the one to serve next first */
+	struct HashFlow *head;
+	struct HashFlow *tail;
+	/* Requests left in the class's current turn */
+	unsigned long deficit;
+	struct HashClassStats stats;
+} classes[HC_COUNT] = {
+	[HC_AUTH] = {.name = "auth"},
+	[HC_ACCOUNT] = {.name = "account"},
+	[HC_OPER] = {.name = "oper"},
+	[HC_REHASH] = {.name = "rehash"}
+};
+static size_t current_class;
+static size_t hash_requests_waiting;
+/* Requests a hasher is working on; they may complete in any order. */
+static struct HashRequest *hash_requests_inflight;
+static uint32_t next_hash_request_id;
+/* Random for every run, so keys mean nothing outside of this process. */
+static uint8_t hash_request_mac_key[32];
+
+/*
+ * Passwords that recently checked out, so that a client that reconnects and
+ * authenticates again does not cost a hash; see hasher:verify_cache.
+ * An entry is a MAC of account, password and stored hash, so changing the
+ * password invalidates it, and nothing in here helps to recover a password.
+ * Entries are found by the start of their MAC; each set holds
+ * VERIFY_CACHE_WAYS of them, and a full set gives up its oldest.
+ */
+#define VERIFY_CACHE_WAYS	(4)
+
+struct VerifyCacheEntry {
+	/* CLOCK_MONOTONIC second when the entry stops counting; 0 if free */
+	time_t expires;
+	uint8_t mac[32];
+	/* case-folded, for verify_cache_forget() */
+	char account[ACCOUNT_LEN + 1];
+};
+
+static struct VerifyCacheEntry *verify_cache;
+static size_t verify_cache_sets;
+static uint8_t verify_cache_key[32];
+static struct VerifyCacheStats verify_cache_stats;
+
+/*
+ * In-memory copy of the confirmed accounts, so that AUTH and the e-mail
+ * lookups need not ask sqlite.
+ * The database thread fills it a slice at a time after db_start(); until it
+ * is complete, an account it does not have is looked up in sqlite instead.
+ * Every write to a confirmed account in lm.db is followed by index_refresh().
+ * Only the event loop touches it.
+ */
+struct AccountEntry {
+	struct AccountEntry *name_next;
+	struct AccountEntry *email_next;
+	char name[ACCOUNT_LEN + 1];
+	/* Legacy hash or bad parameters: check_auth() asks sqlite, which
+	 * knows what to do about it.
+	 */
+	bool sql_only;
+	struct HashParams params;
+	time_t created;
+	uint8_t salt[SALT_LEN];
+	uint8_t hash[HASH_LEN];
+	char email[];
+};
+
+/* Rows read per index_load_run() */
+#define INDEX_SLICE	(1000)
+
+static struct AccountEntry **index_by_name;
+static struct AccountEntry **index_by_email;
+/* A power of two, or 0 if the index is off */
+static size_t index_buckets;
+static size_t index_entries;
+static size_t index_bytes;
+static bool index_loaded;
+static int64_t index_last_id;
+/* Random for every run, so nobody can pick names that share a bucket. */
+static uint8_t index_key[16];
+
+/*
+ * All sqlite work happens on the database thread, so that the event loop never
+ * waits for lm.db.
+ * A job's run() is called on the database thread, then its done() on the event
+ * loop, in the order the jobs were submitted; the database thread rings the
+ * doorbell when it puts a job into an empty completion queue.
+ * Before db_start() and after db_stop(), jobs run right away instead.
+ */
+struct DBJob {
+	struct DBJob *next;
+	void (*run)(struct DBJob *job);
+	/* NULL if nobody cares how it went */
+	void (*done)(struct DBJob *job);
+	void *theirarg;
+	void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg);
+	void (*lookupcallback)(enum DBError dbe,
+			const char *account,
+			const char *email,
+			void *arg);
+	enum DBError dbe;
+	/* Time run() took on the database thread */
+	uint64_t busy_us;
+	char account[ACCOUNT_LEN + 1];
+	char email[EMAIL_LEN + 1];
+	/* check_auth(): the user waiting for it, if any, and the password,
+	 * which the event loop still needs once the row is found
+	 */
+	struct UserHandle owner;
+	enum HashClass cls;
+	bool may_rehash;
+	/* The hash was a legacy one, which run() checked already. */
+	bool legacy;
+	char password[PASSWORD_LEN];
+	time_t ts;
+	/* The hash found or to be stored; oldhash is what a rehash replaces. */
+	struct HashParams params;
+	uint8_t salt[SALT_LEN];
+	uint8_t hash[HASH_LEN];
+	uint8_t oldhash[HASH_LEN];
+	/* Whether an UPDATE found its row */
+	bool changed;
+	/* Whether to read the account back for index_refresh() after a write */
+	bool refresh;
+	/* Accounts for index_insert(), chained through name_next */
+	struct AccountEntry *rows;
+	size_t nrows;
+	int64_t last_id;
 };
 
-static struct HashRequest *hash_requests_head;
+static pthread_t db_thread;
+static bool db_thread_running;
+/* Jobs for the database thread, oldest first */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct DBJob *job_head;
+static struct DBJob *job_tail;
+static bool jobs_stopping;
+/* Jobs the database thread is done with, oldest first */
+static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct DBJob *completion_head;
+static struct DBJob *completion_tail;
+static int doorbell[2] = {-1, -1};
+static struct event *doorbell_ev;
+static struct DBThreadStats thread_stats;
+/* Set by db_post_exit() for the event loop */
+static atomic_bool exit_posted;
 
-/* In case argon2i ever gets broken or we need to change the default parameters
- * for argon2i, it's best we encode this information already.
+static void rehash(const struct HashRequest *hr, const uint8_t *oldhash);
+static void rehash_legacy(const char *account, const char *password);
+static void index_load_next(void);
+
+/*
+ * Schema changes on top of the original accounts table, applied in order.
+ * PRAGMA user_version counts how many of them a database has had.
  */
-enum PasswordAlgorithm {
-	PA_ARGON2I
+static const char *const migrations[] = {
+	/* 1: per-account argon2i parameters; rows from before used the
+	 * then-fixed 100000 KiB and 3 passes.
+	 */
+	"ALTER TABLE accounts ADD COLUMN pwmemory INTEGER NOT NULL "
+		"DEFAULT 100000;"
+	"ALTER TABLE accounts ADD COLUMN pwpasses INTEGER NOT NULL "
+		"DEFAULT 3",
+	/* 2: argon2 lanes; pwalgo tells argon2i from argon2id (see
+	 * enum PasswordAlgorithm), every row so far has a single lane.
+	 */
+	"ALTER TABLE accounts ADD COLUMN pwlanes INTEGER NOT NULL "
+		"DEFAULT 1",
+	/* 3: lookup keys, so that lookups can use an index instead of
+	 * LOWER() on every row; see casefold() for name_key.
+	 * The partial index is for db_purge_expired().
+	 */
+	"ALTER TABLE accounts ADD COLUMN name_key VARCHAR(12) NOT NULL "
+		"DEFAULT '';"
+	"ALTER TABLE accounts ADD COLUMN email_key VARCHAR(254) NOT NULL "
+		"DEFAULT '';"
+	"UPDATE accounts SET name_key = LOWER(REPLACE(REPLACE(REPLACE("
+		"REPLACE(name, '[', '{'), '\\', '|'), ']', '}'), "
+		"'^', '~')), email_key = LOWER(email);"
+	"CREATE INDEX accounts_name_key ON accounts(name_key);"
+	"CREATE INDEX accounts_email_key ON accounts(email_key);"
+	"CREATE INDEX accounts_expires ON accounts(expires) "
+		"WHERE expires != 0",
+	/* 4: names with the same name_key are the same account, so there
+	 * may only be one of each; see check_name_collisions().
+	 */
+	"DROP INDEX accounts_name_key;"
+	"CREATE UNIQUE INDEX accounts_name_key ON accounts(name_key)"
 };
 
+/* The migration that makes name_key unique */
+#define UNIQUE_NAME_KEY	(4)
+
+#define NMIGRATIONS	(sizeof(migrations)/sizeof(*migrations))
+
 static sqlite3 *db;
 
+/*
+ * Every statement db.c runs, prepared once by db_init() and reset after each
+ * use rather than prepared and finalized every time.
+ */
+enum Query {
+	Q_CHECK_AUTH,
+	Q_CREATE_ACCOUNT,
+	Q_STORE_PASSWORD,
+	Q_REHASH,
+	Q_LEGACY_REHASH,
+	Q_ACCOUNT_BY_EMAIL,
+	Q_EMAIL_BY_ACCOUNT,
+	Q_PURGE_EXPIRED,
+	Q_INDEX_LOAD,
+	Q_INDEX_ACCOUNT,
+	Q_COUNT
+};
+
+static struct {
+	const char *name;
+	const char *sql;
+	sqlite3_stmt *stmt;
+	/* Counted on the database thread, read on the event loop */
+	atomic_uint_fast64_t executions;
+} queries[Q_COUNT] = {
+	[Q_CHECK_AUTH] = {"check_auth",
+		"SELECT pwsalt, pwhash, created, pwalgo, pwmemory, "
+		"pwpasses, pwlanes FROM accounts WHERE "
+		"name_key = ? AND expires = 0 LIMIT 1"},
+	[Q_CREATE_ACCOUNT] = {"create_account",
+		"INSERT INTO accounts(name, email, name_key, email_key, "
+		"pwalgo, pwsalt, pwhash) VALUES (?, ?, ?, ?, -1, '', '')"},
+	[Q_STORE_PASSWORD] = {"store_password",
+		"UPDATE accounts SET pwalgo = ?, pwsalt = ?, pwhash = ?, "
+		"pwmemory = ?, pwpasses = ?, pwlanes = ?, "
+		"expires = 0 WHERE name_key = ?"},
+	[Q_REHASH] = {"rehash",
+		"UPDATE accounts SET pwalgo = ?, pwsalt = ?, pwhash = ?, "
+		"pwmemory = ?, pwpasses = ?, pwlanes = ? "
+		"WHERE name_key = ? AND pwhash = ?"},
+	[Q_LEGACY_REHASH] = {"legacy_rehash",
+		"UPDATE accounts SET pwalgo = ?, pwsalt = ?, pwhash = ?, "
+		"pwmemory = ?, pwpasses = ?, pwlanes = ? "
+		"WHERE name_key = ? AND pwalgo NOT IN (?, ?)"},
+	[Q_ACCOUNT_BY_EMAIL] = {"account_by_email",
+		"SELECT name FROM accounts WHERE "
+		"email_key = ? AND expires = 0 LIMIT 1"},
+	[Q_EMAIL_BY_ACCOUNT] = {"email_by_account",
+		"SELECT email FROM accounts WHERE "
+		"name_key = ? AND expires = 0 LIMIT 1"},
+	[Q_PURGE_EXPIRED] = {"purge_expired",
+		"DELETE FROM accounts WHERE expires != 0 AND expires < ?"},
+	[Q_INDEX_LOAD] = {"index_load",
+		"SELECT id, name, email, pwalgo, pwsalt, pwhash, pwmemory, "
+		"pwpasses, pwlanes, created FROM accounts "
+		"WHERE id > ? AND expires = 0 ORDER BY id LIMIT ?"},
+	[Q_INDEX_ACCOUNT] = {"index_account",
+		"SELECT id, name, email, pwalgo, pwsalt, pwhash, pwmemory, "
+		"pwpasses, pwlanes, created FROM accounts "
+		"WHERE name_key = ? AND expires = 0 LIMIT 1"}
+};
+
+
 static inline int
 prepare(const char *query, sqlite3_stmt **s)
 {
 	return sqlite3_prepare_v2(db, query, (int)strlen(query), s, NULL);
 }
 
+/* The statement for q, ready to bind */
+static sqlite3_stmt *
+query(enum Query q)
+{
+	atomic_fetch_add(&queries[q].executions, 1);
+	return queries[q].stmt;
+}
+
+/* Readies s for its next use. */
+static void
+query_done(sqlite3_stmt *s)
+{
+	sqlite3_reset(s);
+	sqlite3_clear_bindings(s);
+}
+
+/*
+ * Binds the lookup key of a name (irc) or e-mail address to parameter i of s,
+ * as in name_key and email_key; see casefold().
+ */
+static void
+bind_key(sqlite3_stmt *s, int i, const char *text, bool irc)
+{
+	char key[EMAIL_LEN + 1];
+
+	/* Too long for any key, so it cannot match as it is either. */
+	if (strlen(text) >= sizeof(key)) {
+		sqlite3_bind_text(s, i, text, -1, SQLITE_TRANSIENT);
+		return;
+	}
+	sqlite3_bind_text(s, i, casefold(key, text, irc), -1,
+			SQLITE_TRANSIENT);
+}
+
+/*
+ * Warns about statements that would look at every row: the table is too big
+ * for that, and everything else waits for the database thread meanwhile.
+ */
+static void
+check_query_plans(void)
+{
+	sqlite3_stmt *s;
+	char sql[512];
+	const char *detail;
+
+	for (size_t i = 0; i < Q_COUNT; ++i) {
+		snprintf(sql, sizeof(sql), "EXPLAIN QUERY PLAN %s",
+				queries[i].sql);
+		if (prepare(sql, &s) != SQLITE_OK) {
+			log_warn(SS_SQL, "unable to explain %s: %s",
+					queries[i].name, sqlite3_errmsg(db));
+			continue;
+		}
+		/* The last column is the detail: "SCAN accounts" (or
+		 * "SCAN TABLE accounts" before sqlite 3.36) for a full scan,
+		 * "SEARCH ..." for an index lookup.
+		 */
+		while (sqlite3_step(s) == SQLITE_ROW) {
+			detail = (const char *)sqlite3_column_text(s,
+					sqlite3_column_count(s) - 1);
+			if (detail != NULL && strncmp(detail, "SCAN", 4) == 0)
+				log_warn(SS_SQL, "query %s does a full scan "
+						"(%s)", queries[i].name,
+						detail);
+		}
+		sqlite3_finalize(s);
+	}
+}
+
+static int
+prepare_queries(void)
+{
+	for (size_t i = 0; i < Q_COUNT; ++i) {
+		if (prepare(queries[i].sql, &queries[i].stmt) != SQLITE_OK) {
+			log_fatal(SS_SQL, "unable to prepare %s: %s",
+					queries[i].name, sqlite3_errmsg(db));
+			return -1;
+		}
+	}
+	check_query_plans();
+
+	return 0;
+}
+
+size_t
+db_query_stats(struct QueryStats *stats, size_t n)
+{
+	for (size_t i = 0; i < n && i < Q_COUNT; ++i) {
+		stats[i].name = queries[i].name;
+		stats[i].executions = atomic_load(&queries[i].executions);
+	}
+
+	return Q_COUNT;
+}
+
+static struct DBJob *
+db_job(void (*run)(struct DBJob *job), void (*done)(struct DBJob *job))
+{
+	struct DBJob *job = scalloc(1, sizeof(*job));
+
+	job->run = run;
+	job->done = done;
+	return job;
+}
+
+static void
+job_free(struct DBJob *job)
+{
+	struct AccountEntry *e;
+
+	/* Rows that done() did not take */
+	while ((e = job->rows) != NULL) {
+		job->rows = e->name_next;
+		crypto_wipe(e, sizeof(*e));
+		free(e);
+	}
+	crypto_wipe(job, sizeof(*job));
+	free(job);
+}
+
+/* Runs job on the database thread; or right away, if there is none. */
+static void
+db_submit(struct DBJob *job)
+{
+	if (!db_thread_running) {
+		job->run(job);
+		if (job->done != NULL)
+			job->done(job);
+		job_free(job);
+		return;
+	}
+
+	job->next = NULL;
+	pthread_mutex_lock(&job_lock);
+	if (job_tail == NULL)
+		job_head = job;
+	else
+		job_tail->next = job;
+	job_tail = job;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	++thread_stats.waiting;
+}
+
+static void *
+db_thread_main(void *arg)
+{
+	struct DBJob *job;
+	struct timespec start;
+	bool ring;
+
+	(void)arg;
+
+	pthread_mutex_lock(&job_lock);
+	for (;;) {
+		while (job_head == NULL && !jobs_stopping)
+			pthread_cond_wait(&job_cond, &job_lock);
+		/* Whatever was submitted before db_stop() still runs. */
+		if ((job = job_head) == NULL)
+			break;
+		if ((job_head = job->next) == NULL)
+			job_tail = NULL;
+		pthread_mutex_unlock(&job_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		job->run(job);
+		job->busy_us = stats_elapsed_us(&start);
+
+		job->next = NULL;
+		pthread_mutex_lock(&completion_lock);
+		/* Otherwise the event loop has yet to get to the queue. */
+		ring = (completion_head == NULL);
+		if (completion_tail == NULL)
+			completion_head = job;
+		else
+			completion_tail->next = job;
+		completion_tail = job;
+		pthread_mutex_unlock(&completion_lock);
+		if (ring)
+			doorbell_ring(doorbell[1]);
+
+		pthread_mutex_lock(&job_lock);
+	}
+	pthread_mutex_unlock(&job_lock);
+
+	return NULL;
+}
+
+/* Hands the jobs the database thread is done with to their done(). */
+static void
+db_completions(void)
+{
+	struct DBJob *job, *next;
+
+	pthread_mutex_lock(&completion_lock);
+	job = completion_head;
+	completion_head = completion_tail = NULL;
+	pthread_mutex_unlock(&completion_lock);
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		--thread_stats.waiting;
+		++thread_stats.jobs;
+		thread_stats.busy_us_total += job->busy_us;
+		if (job->busy_us > thread_stats.busy_us_max)
+			thread_stats.busy_us_max = job->busy_us;
+		if (job->done != NULL)
+			job->done(job);
+		job_free(job);
+	}
+}
+
+static void
+doorbell_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	doorbell_drain(fd);
+	db_completions();
+	/* Frees this event, so nothing may come after it. */
+	if (atomic_exchange(&exit_posted, false))
+		lm_exit();
+}
+
+/*
+ * Has the event loop call lm_exit() after a fatal error on another thread,
+ * which must not tear down what it may itself be using.
+ * After db_stop(), the event loop is on its way out anyway.
+ */
+void
+db_post_exit(void)
+{
+	atomic_store(&exit_posted, true);
+	pthread_mutex_lock(&completion_lock);
+	if (doorbell[1] != -1)
+		doorbell_ring(doorbell[1]);
+	pthread_mutex_unlock(&completion_lock);
+}
+
+void
+db_thread_stats(struct DBThreadStats *dts)
+{
+	*dts = thread_stats;
+	dts->running = db_thread_running;
+}
+
+/* Whether lm.db is in WAL mode with checkpoints left to db_checkpoint() */
+static bool checkpoints;
+
+/* Applies the database section of lm.ini. */
+static int
+db_configure(void)
+{
+	sqlite3_stmt *s;
+	char query[160];
+	char *errmsg = NULL;
+	const char *mode;
+	bool wal = !strcmp(config.database.journal_mode, "wal");
+
+	/* journal_mode reports the mode it ended up with. */
+	snprintf(query, sizeof(query), "PRAGMA journal_mode = %s",
+			config.database.journal_mode);
+	if (prepare(query, &s) != SQLITE_OK || sqlite3_step(s) != SQLITE_ROW) {
+		log_fatal(SS_SQL, "unable to set journal mode: %s",
+				sqlite3_errmsg(db));
+		sqlite3_finalize(s);
+		return -1;
+	}
+	mode = (const char *)sqlite3_column_text(s, 0);
+	if (mode == NULL || strcasecmp(mode, config.database.journal_mode)) {
+		log_warn(SS_SQL, "journal mode %s instead of %s",
+				(mode != NULL) ? mode : "unknown",
+				config.database.journal_mode);
+		wal = false;
+	}
+	sqlite3_finalize(s);
+
+	/* cache_size is in pages if positive, in KiB if negative. */
+	snprintf(query, sizeof(query), "PRAGMA synchronous = %s;"
+			"PRAGMA cache_size = -%lu;"
+			"PRAGMA mmap_size = %llu;"
+			"PRAGMA temp_store = %s",
+			config.database.synchronous,
+			config.database.cache_size,
+			(unsigned long long)config.database.mmap_size << 20,
+			config.database.temp_store);
+	if (sqlite3_exec(db, query, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to configure lm.db: %s", errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+
+	checkpoints = (wal && config.database.checkpoint_interval != 0);
+	if (checkpoints && sqlite3_exec(db, "PRAGMA wal_autocheckpoint = 0",
+				NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to configure lm.db: %s", errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Logs every set of accounts whose names only differ in case (as casefold()
+ * sees it), which lm.db cannot have from UNIQUE_NAME_KEY on.
+ * Returns -1 if there are any; which of them to keep is up to the operator.
+ */
+static int
+check_name_collisions(void)
+{
+	sqlite3_stmt *s;
+	size_t n = 0;
+
+	if (prepare("SELECT group_concat(name, ', ') FROM accounts "
+				"GROUP BY name_key HAVING COUNT(*) > 1",
+				&s) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to prepare name check: %s",
+				sqlite3_errmsg(db));
+		return -1;
+	}
+	while (sqlite3_step(s) == SQLITE_ROW) {
+		log_error(SS_SQL, "accounts differ only in case: %s",
+				(const char *)sqlite3_column_text(s, 0));
+		++n;
+	}
+	sqlite3_finalize(s);
+
+	if (n != 0) {
+		log_fatal(SS_SQL, "lm.db has %zu set(s) of accounts that "
+				"differ only in case; delete all but one of "
+				"each, then start lm again", n);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+db_migrate(void)
+{
+	sqlite3_stmt *s;
+	char query[64];
+	char *errmsg = NULL;
+	int version;
+
+	prepare("PRAGMA user_version", &s);
+	if (sqlite3_step(s) != SQLITE_ROW) {
+		log_fatal(SS_SQL, "unable to read schema version: %s",
+				sqlite3_errmsg(db));
+		sqlite3_finalize(s);
+		return -1;
+	}
+	version = sqlite3_column_int(s, 0);
+	sqlite3_finalize(s);
+
+	if (version < 0 || (size_t)version > NMIGRATIONS) {
+		log_fatal(SS_SQL, "lm.db has unknown schema version %d",
+				version);
+		return -1;
+	}
+
+	for (size_t i = (size_t)version; i < NMIGRATIONS; ++i) {
+		log_info(SS_SQL, "migrating lm.db to schema version %zu",
+				i + 1);
+		if (i + 1 == UNIQUE_NAME_KEY && check_name_collisions() != 0)
+			return -1;
+		snprintf(query, sizeof(query), "PRAGMA user_version = %zu",
+				i + 1);
+		if (sqlite3_exec(db, "BEGIN", NULL, NULL, &errmsg)
+					!= SQLITE_OK
+				|| sqlite3_exec(db, migrations[i], NULL, NULL,
+					&errmsg) != SQLITE_OK
+				|| sqlite3_exec(db, query, NULL, NULL, &errmsg)
+					!= SQLITE_OK
+				|| sqlite3_exec(db, "COMMIT", NULL, NULL,
+					&errmsg) != SQLITE_OK) {
+			log_fatal(SS_SQL, "unable to migrate lm.db: %s",
+					errmsg);
+			sqlite3_free(errmsg);
+			(void)sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 int
 db_init(void)
 {
@@ -87,345 +789,2165 @@ db_init(void)
 		return -1;
 	}
 
-	if (sqlite3_exec(db, create_query, NULL, NULL, &errmsg) != SQLITE_OK) {
-		log_fatal(SS_SQL, "unable to create table accounts: %s\n",
-				errmsg);
-		return -1;
+	if (db_configure() != 0)
+		return -1;
+
+	if (sqlite3_exec(db, create_query, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to create table accounts: %s\n",
+				errmsg);
+		return -1;
+	}
+
+	if (db_migrate() != 0 || prepare_queries() != 0)
+		return -1;
+
+	if (randombytes(hash_request_mac_key,
+				sizeof(hash_request_mac_key)) == NULL) {
+		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+				sizeof(hash_request_mac_key));
+		return -1;
+	}
+
+	if (config.database.account_index) {
+		if (randombytes(index_key, sizeof(index_key)) == NULL) {
+			log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+					sizeof(index_key));
+			return -1;
+		}
+		index_buckets = 1024;
+		index_by_name = scalloc(index_buckets, sizeof(*index_by_name));
+		index_by_email = scalloc(index_buckets,
+				sizeof(*index_by_email));
+	}
+
+	if (config.hasher.verify_cache != 0) {
+		if (randombytes(verify_cache_key,
+					sizeof(verify_cache_key)) == NULL) {
+			log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+					sizeof(verify_cache_key));
+			return -1;
+		}
+		verify_cache_sets = (config.hasher.verify_cache
+				+ VERIFY_CACHE_WAYS - 1) / VERIFY_CACHE_WAYS;
+		verify_cache = scalloc(verify_cache_sets * VERIFY_CACHE_WAYS,
+				sizeof(*verify_cache));
+		verify_cache_stats.capacity = verify_cache_sets
+			* VERIFY_CACHE_WAYS;
+	}
+
+	log_info(SS_SQL, "database lm.db opened");
+	return 0;
+}
+
+/*
+ * Starts the database thread, which takes over lm.db from here on, and the
+ * loading of the account index.
+ * Not part of db_init(), which comes before daemonizing.
+ */
+int
+db_start(struct event_base *base)
+{
+	int error;
+
+	if (doorbell_open(doorbell) != 0)
+		return -1;
+	if ((doorbell_ev = event_new(base, doorbell[0], EV_READ | EV_PERSIST,
+					doorbell_cb, NULL)) == NULL)
+		oom();
+	event_add(doorbell_ev, NULL);
+
+	jobs_stopping = false;
+	if ((error = pthread_create(&db_thread, NULL, db_thread_main,
+					NULL)) != 0) {
+		log_fatal(SS_SQL, "unable to create database thread: %s",
+				strerror(error));
+		return -1;
+	}
+	db_thread_running = true;
+
+	index_load_next();
+	return 0;
+}
+
+/*
+ * Lets the database thread finish what it has been given and hands the results
+ * to their callbacks; jobs submitted from then on run right away.
+ */
+void
+db_stop(void)
+{
+	if (!db_thread_running)
+		return;
+
+	pthread_mutex_lock(&job_lock);
+	jobs_stopping = true;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	log_info(SS_SQL, "waiting for the database thread to finish...");
+	pthread_join(db_thread, NULL);
+	db_thread_running = false;
+	db_completions();
+
+	event_free(doorbell_ev);
+	doorbell_ev = NULL;
+	/* Hasher threads may still call db_post_exit(). */
+	pthread_mutex_lock(&completion_lock);
+	doorbell_close(doorbell);
+	pthread_mutex_unlock(&completion_lock);
+	log_info(SS_SQL, "database thread finished");
+}
+
+static time_t
+monotonic_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void
+verify_cache_mac(uint8_t mac[32], const char *account, const char *password,
+		const uint8_t myhash[HASH_LEN])
+{
+	crypto_blake2b_ctx ctx;
+	char name[ACCOUNT_LEN + 1];
+
+	/* Zero-padded, so that where account ends and password begins is
+	 * unambiguous; folded like name_key, since accounts are
+	 * case-insensitive the way nicks are.
+	 */
+	memset(name, 0, sizeof(name));
+	snprintf(name, sizeof(name), "%s", account);
+	casefold(name, name, true);
+
+	crypto_blake2b_general_init(&ctx, 32, verify_cache_key,
+			sizeof(verify_cache_key));
+	crypto_blake2b_update(&ctx, (const uint8_t *)name, sizeof(name));
+	crypto_blake2b_update(&ctx, myhash, HASH_LEN);
+	crypto_blake2b_update(&ctx, (const uint8_t *)password,
+			strlen(password));
+	crypto_blake2b_final(&ctx, mac);
+}
+
+static struct VerifyCacheEntry *
+verify_cache_set(const uint8_t mac[32])
+{
+	uint64_t index = (uint64_t)mac[0]
+		| ((uint64_t)mac[1] << 8)
+		| ((uint64_t)mac[2] << 16)
+		| ((uint64_t)mac[3] << 24)
+		| ((uint64_t)mac[4] << 32);
+
+	return &verify_cache[(index % verify_cache_sets) * VERIFY_CACHE_WAYS];
+}
+
+static bool
+verify_cache_hit(const uint8_t mac[32])
+{
+	struct VerifyCacheEntry *e = verify_cache_set(mac);
+	time_t now = monotonic_now();
+
+	for (size_t i = 0; i < VERIFY_CACHE_WAYS; ++i) {
+		if (e[i].expires >= now
+				&& crypto_verify32(e[i].mac, mac) == 0) {
+			++verify_cache_stats.hits;
+			return true;
+		}
+	}
+
+	++verify_cache_stats.misses;
+	return false;
+}
+
+static void
+verify_cache_store(const uint8_t mac[32], const char *account)
+{
+	struct VerifyCacheEntry *set = verify_cache_set(mac);
+	struct VerifyCacheEntry *e = &set[0];
+
+	/* The same entry again, a free one, or else the oldest */
+	for (size_t i = 0; i < VERIFY_CACHE_WAYS; ++i) {
+		if (set[i].expires != 0
+				&& crypto_verify32(set[i].mac, mac) == 0) {
+			e = &set[i];
+			break;
+		}
+		if (set[i].expires < e->expires)
+			e = &set[i];
+	}
+
+	if (e->expires == 0)
+		++verify_cache_stats.entries;
+	else if (crypto_verify32(e->mac, mac) != 0)
+		++verify_cache_stats.evictions;
+	++verify_cache_stats.stores;
+
+	memcpy(e->mac, mac, sizeof(e->mac));
+	snprintf(e->account, sizeof(e->account), "%s", account);
+	casefold(e->account, e->account, true);
+	e->expires = monotonic_now() + (time_t)config.hasher.verify_cache_ttl;
+}
+
+/* Drops all entries for account, e.g. once its password changed. */
+static void
+verify_cache_forget(const char *account)
+{
+	size_t n = verify_cache_sets * VERIFY_CACHE_WAYS;
+	char key[ACCOUNT_LEN + 1];
+
+	snprintf(key, sizeof(key), "%s", account);
+	casefold(key, key, true);
+	for (size_t i = 0; i < n; ++i) {
+		if (verify_cache[i].expires != 0
+				&& !strcmp(verify_cache[i].account, key)) {
+			crypto_wipe(&verify_cache[i],
+					sizeof(verify_cache[i]));
+			--verify_cache_stats.entries;
+		}
+	}
+}
+
+void
+db_verify_cache_stats(struct VerifyCacheStats *vcs)
+{
+	*vcs = verify_cache_stats;
+}
+
+static size_t
+index_bucket(const char *key)
+{
+	uint8_t h[8];
+	uint64_t n;
+
+	crypto_blake2b_general(h, sizeof(h), index_key, sizeof(index_key),
+			(const uint8_t *)key, strlen(key));
+	memcpy(&n, h, sizeof(n));
+	return (size_t)(n & (index_buckets - 1));
+}
+
+static struct AccountEntry *
+index_find(const char *name)
+{
+	struct AccountEntry *e;
+	char key[ACCOUNT_LEN + 1];
+	char other[ACCOUNT_LEN + 1];
+
+	if (index_buckets == 0 || strlen(name) > ACCOUNT_LEN)
+		return NULL;
+
+	casefold(key, name, true);
+	for (e = index_by_name[index_bucket(key)]; e != NULL;
+			e = e->name_next) {
+		if (!strcmp(casefold(other, e->name, true), key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct AccountEntry *
+index_find_email(const char *email)
+{
+	struct AccountEntry *e;
+	char key[EMAIL_LEN + 1];
+	char other[EMAIL_LEN + 1];
+
+	if (index_buckets == 0 || strlen(email) > EMAIL_LEN)
+		return NULL;
+
+	casefold(key, email, false);
+	for (e = index_by_email[index_bucket(key)]; e != NULL;
+			e = e->email_next) {
+		if (!strcmp(casefold(other, e->email, false), key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+index_link(struct AccountEntry *e)
+{
+	char key[EMAIL_LEN + 1];
+	size_t b;
+
+	b = index_bucket(casefold(key, e->name, true));
+	e->name_next = index_by_name[b];
+	index_by_name[b] = e;
+	b = index_bucket(casefold(key, e->email, false));
+	e->email_next = index_by_email[b];
+	index_by_email[b] = e;
+}
+
+/* Doubles the buckets once there are as many accounts as buckets. */
+static void
+index_grow(void)
+{
+	struct AccountEntry **old = index_by_name;
+	struct AccountEntry *e, *next;
+	size_t nold = index_buckets;
+
+	index_buckets *= 2;
+	index_by_name = scalloc(index_buckets, sizeof(*index_by_name));
+	free(index_by_email);
+	index_by_email = scalloc(index_buckets, sizeof(*index_by_email));
+	for (size_t i = 0; i < nold; ++i) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->name_next;
+			index_link(e);
+		}
+	}
+	free(old);
+}
+
+static void
+index_remove(const char *name)
+{
+	struct AccountEntry *e, **pp;
+	char key[EMAIL_LEN + 1];
+
+	if ((e = index_find(name)) == NULL)
+		return;
+
+	for (pp = &index_by_name[index_bucket(casefold(key, e->name, true))];
+			*pp != e; pp = &(*pp)->name_next)
+		;
+	*pp = e->name_next;
+	for (pp = &index_by_email[index_bucket(casefold(key, e->email,
+						false))];
+			*pp != e; pp = &(*pp)->email_next)
+		;
+	*pp = e->email_next;
+
+	--index_entries;
+	index_bytes -= sizeof(*e) + strlen(e->email) + 1;
+	crypto_wipe(e, sizeof(*e));
+	free(e);
+}
+
+/*
+ * The account on the row s is on, for index_insert(), or NULL if it does not
+ * fit; the columns are those of Q_INDEX_LOAD and Q_INDEX_ACCOUNT.
+ * Called on the database thread, which must leave the index itself alone.
+ */
+static struct AccountEntry *
+index_entry(sqlite3_stmt *s)
+{
+	struct AccountEntry *e;
+	const char *name = (const char *)sqlite3_column_text(s, 1);
+	const char *email = (const char *)sqlite3_column_text(s, 2);
+	size_t email_len;
+
+	if (name == NULL || email == NULL || strlen(name) > ACCOUNT_LEN
+			|| (email_len = strlen(email)) > EMAIL_LEN)
+		return NULL;
+
+	e = scalloc(1, sizeof(*e) + email_len + 1);
+	strcpy(e->name, name);
+	memcpy(e->email, email, email_len + 1);
+	e->params.algorithm = (enum PasswordAlgorithm)sqlite3_column_int(s, 3);
+	e->params.memory = (uint32_t)sqlite3_column_int64(s, 6);
+	e->params.passes = (uint32_t)sqlite3_column_int64(s, 7);
+	e->params.lanes = (uint32_t)sqlite3_column_int64(s, 8);
+	e->created = (time_t)sqlite3_column_int64(s, 9);
+	if (sqlite3_column_bytes(s, 4) == SALT_LEN
+			&& sqlite3_column_bytes(s, 5) == HASH_LEN
+			&& hasher_params_valid(&e->params)) {
+		memcpy(e->salt, sqlite3_column_blob(s, 4), SALT_LEN);
+		memcpy(e->hash, sqlite3_column_blob(s, 5), HASH_LEN);
+	} else {
+		e->sql_only = true;
+	}
+
+	return e;
+}
+
+/*
+ * Puts e into the index, replacing whatever it had for the account.
+ * lm.db cannot have another account with the same name_key (see
+ * UNIQUE_NAME_KEY); should one turn up all the same, neither of them is
+ * indexed, so that both are left to sqlite.
+ */
+static void
+index_insert(struct AccountEntry *e)
+{
+	struct AccountEntry *old;
+
+	if ((old = index_find(e->name)) != NULL
+			&& strcmp(old->name, e->name) != 0) {
+		log_error(SS_SQL, "accounts %s and %s differ only in case; "
+				"leaving both out of the account index",
+				old->name, e->name);
+		index_remove(old->name);
+		crypto_wipe(e, sizeof(*e));
+		free(e);
+		return;
+	}
+
+	index_remove(e->name);
+	if (index_entries == index_buckets)
+		index_grow();
+	index_link(e);
+	++index_entries;
+	index_bytes += sizeof(*e) + strlen(e->email) + 1;
+}
+
+/*
+ * Reads job->account back after a write, on the database thread, for
+ * index_refresh().
+ */
+static void
+read_back(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	if (!job->refresh)
+		return;
+
+	s = query(Q_INDEX_ACCOUNT);
+	bind_key(s, 1, job->account, true);
+	if ((sqlite_ret = sqlite3_step(s)) == SQLITE_ROW)
+		job->rows = index_entry(s);
+	else if (sqlite_ret != SQLITE_DONE)
+		log_error(SS_SQL, "unable to SELECT: %s",
+				sqlite3_errstr(sqlite_ret));
+	query_done(s);
+}
+
+/* Brings the index up to date with what read_back() found. */
+static void
+index_refresh(struct DBJob *job)
+{
+	if (!job->refresh)
+		return;
+
+	if (job->rows != NULL) {
+		index_insert(job->rows);
+		job->rows = NULL;
+	} else {
+		/* An index that does not know better asks sqlite. */
+		index_remove(job->account);
+	}
+}
+
+/* Reads the INDEX_SLICE accounts after job->last_id. */
+static void
+index_load_run(struct DBJob *job)
+{
+	struct AccountEntry *e;
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	s = query(Q_INDEX_LOAD);
+	sqlite3_bind_int64(s, 1, job->last_id);
+	sqlite3_bind_int(s, 2, INDEX_SLICE);
+	while ((sqlite_ret = sqlite3_step(s)) == SQLITE_ROW) {
+		job->last_id = sqlite3_column_int64(s, 0);
+		++job->nrows;
+		if ((e = index_entry(s)) != NULL) {
+			e->name_next = job->rows;
+			job->rows = e;
+		}
+	}
+	query_done(s);
+
+	if (sqlite_ret != SQLITE_DONE) {
+		log_error(SS_SQL, "unable to load the account index: %s",
+				sqlite3_errstr(sqlite_ret));
+		job->dbe = DBE_SQLITE;
+	}
+}
+
+static void
+index_load_done(struct DBJob *job)
+{
+	struct AccountEntry *e;
+
+	while ((e = job->rows) != NULL) {
+		job->rows = e->name_next;
+		index_insert(e);
+	}
+
+	/* Lookups keep going to sqlite; so be it. */
+	if (job->dbe != DBE_OK)
+		return;
+
+	index_last_id = job->last_id;
+	if (job->nrows < INDEX_SLICE) {
+		index_loaded = true;
+		log_info(SS_SQL, "account index loaded: %zu accounts in %zu "
+				"KiB", index_entries,
+				(index_bytes + index_buckets * 2
+				 * sizeof(*index_by_name)) / 1024);
+		return;
+	}
+
+	/* Not while db_stop() is at it, though */
+	if (db_thread_running)
+		index_load_next();
+}
+
+/*
+ * Has the database thread read the next INDEX_SLICE accounts for the index, so
+ * that other jobs get their turn in between.
+ */
+static void
+index_load_next(void)
+{
+	struct DBJob *job;
+
+	if (index_buckets == 0 || index_loaded)
+		return;
+
+	job = db_job(index_load_run, index_load_done);
+	job->last_id = index_last_id;
+	db_submit(job);
+}
+
+void
+db_account_index_stats(struct AccountIndexStats *ais)
+{
+	ais->enabled = (index_buckets != 0);
+	ais->loaded = index_loaded;
+	ais->accounts = index_entries;
+	ais->bytes = index_bytes;
+	ais->bucket_bytes = index_buckets * 2 * sizeof(*index_by_name);
+}
+
+static void
+index_fini(void)
+{
+	struct AccountEntry *e, *next;
+
+	for (size_t i = 0; i < index_buckets; ++i) {
+		for (e = index_by_name[i]; e != NULL; e = next) {
+			next = e->name_next;
+			crypto_wipe(e, sizeof(*e));
+			free(e);
+		}
+	}
+	free(index_by_name);
+	free(index_by_email);
+	index_by_name = index_by_email = NULL;
+	index_buckets = index_entries = index_bytes = 0;
+}
+
+static enum DBError
+db_check_auth_cb(struct HashRequest *hr, uint8_t *theirhash)
+{
+	enum DBError ret;
+
+	if (crypto_verify32(theirhash, hr->myhash) != 0) {
+		ret = DBE_PW_MISMATCH;
+		log_debug(SS_SQL, "auth check for %s failed", hr->account);
+	} else {
+		ret = DBE_OK;
+		log_debug(SS_SQL, "auth check for %s succeeded (TS: %llu)",
+				hr->account,
+				(unsigned long long)hr->ts);
+		if (hr->cacheable)
+			verify_cache_store(hr->cache_mac, hr->account);
+	}
+	crypto_wipe(hr->cache_mac, sizeof(hr->cache_mac));
+	crypto_wipe(theirhash, HASH_LEN);
+	crypto_wipe(hr->myhash, HASH_LEN);
+	crypto_wipe(hr->salt, SALT_LEN);
+	return ret;
+}
+
+/* Answers hr and everything waiting on it with dbe instead of a hash. */
+static void
+hash_reject(struct HashRequest *hr, enum DBError dbe)
+{
+	struct HashRequest *follower;
+
+	while ((follower = hr->followers) != NULL) {
+		hr->followers = follower->next;
+		follower->theircallback(dbe, follower->account, 0,
+				follower->theirarg);
+		crypto_wipe(follower, sizeof(*follower));
+		free(follower);
+	}
+	hr->theircallback(dbe, hr->account, 0, hr->theirarg);
+	crypto_wipe(hr, sizeof(*hr));
+	free(hr);
+}
+
+static unsigned long
+class_weight(enum HashClass cls)
+{
+	switch (cls) {
+	case HC_AUTH:
+		return config.hasher.auth_weight;
+	case HC_ACCOUNT:
+		return config.hasher.account_weight;
+	case HC_OPER:
+		return config.hasher.oper_weight;
+	case HC_REHASH:
+	case HC_COUNT:
+		break;
+	}
+	return 1;
+}
+
+/*
+ * The source of a request is the IP of the user it is for, or the /64 for
+ * IPv6, where a single customer commonly has that many addresses.
+ * Requests on nobody's behalf share the empty source.
+ */
+static void
+source_key(char out[static SOCKIP_LEN + 1], const struct User *u)
+{
+	struct in6_addr addr6;
+
+	if (u == NULL) {
+		*out = '\0';
+		return;
+	}
+
+	if (strchr(u->sockip, ':') != NULL
+			&& inet_pton(AF_INET6, u->sockip, &addr6) == 1) {
+		memset(&addr6.s6_addr[8], 0, 8);
+		if (inet_ntop(AF_INET6, &addr6, out, SOCKIP_LEN + 1) != NULL)
+			return;
+	}
+	snprintf(out, SOCKIP_LEN + 1, "%s", u->sockip);
+}
+
+static void
+hash_enqueue(struct HashRequest *hr)
+{
+	struct HashClassQueue *c = &classes[hr->cls];
+	struct HashFlow *f;
+
+	for (f = c->head; f != NULL; f = f->next) {
+		if (!strcmp(f->source, hr->source))
+			break;
+	}
+	if (f == NULL) {
+		f = scalloc(1, sizeof(*f));
+		strcpy(f->source, hr->source);
+		if (c->tail == NULL)
+			c->head = f;
+		else
+			c->tail->next = f;
+		c->tail = f;
+	}
+
+	hr->next = NULL;
+	if (f->tail == NULL)
+		f->head = hr;
+	else
+		f->tail->next = hr;
+	f->tail = hr;
+	++f->length;
+	++c->stats.waiting;
+	++hash_requests_waiting;
+	stats_queue_depth(hash_requests_waiting);
+}
+
+/* Takes the next request to hash out of the queue. */
+static struct HashRequest *
+hash_dequeue(void)
+{
+	struct HashClassQueue *c;
+	struct HashFlow *f;
+	struct HashRequest *hr;
+
+	if (hash_requests_waiting == 0)
+		return NULL;
+
+	for (;;) {
+		c = &classes[current_class];
+		if (c->head != NULL)
+			break;
+		c->deficit = 0;
+		current_class = (current_class + 1) % HC_COUNT;
+	}
+	if (c->deficit == 0)
+		c->deficit = class_weight((enum HashClass)current_class);
+
+	f = c->head;
+	hr = f->head;
+	f->head = hr->next;
+	--f->length;
+	--c->stats.waiting;
+	--hash_requests_waiting;
+
+	/* Move on to the next source; this one goes to the back. */
+	c->head = f->next;
+	if (c->head == NULL)
+		c->tail = NULL;
+	f->next = NULL;
+	if (f->head == NULL) {
+		free(f);
+	} else {
+		if (c->tail == NULL)
+			c->head = f;
+		else
+			c->tail->next = f;
+		c->tail = f;
+	}
+
+	if (--c->deficit == 0)
+		current_class = (current_class + 1) % HC_COUNT;
+
+	return hr;
+}
+
+/*
+ * Removes every waiting request for which drop() is true and hands it to
+ * dispose().
+ * drop() may also take apart the request's followers.
+ */
+static void
+hash_sweep(bool (*drop)(struct HashRequest *hr, time_t now),
+		void (*dispose)(struct HashRequest *hr),
+		time_t now)
+{
+	struct HashClassQueue *c;
+	struct HashFlow **fp;
+	struct HashFlow *f;
+	struct HashRequest **hrp;
+	struct HashRequest *hr;
+	size_t i;
+
+	for (i = 0; i < HC_COUNT; ++i) {
+		c = &classes[i];
+		c->tail = NULL;
+		fp = &c->head;
+		while ((f = *fp) != NULL) {
+			f->tail = NULL;
+			hrp = &f->head;
+			while ((hr = *hrp) != NULL) {
+				if (drop(hr, now)) {
+					*hrp = hr->next;
+					--f->length;
+					--c->stats.waiting;
+					--hash_requests_waiting;
+					dispose(hr);
+				} else {
+					f->tail = hr;
+					hrp = &hr->next;
+				}
+			}
+
+			if (f->head == NULL) {
+				*fp = f->next;
+				free(f);
+			} else {
+				c->tail = f;
+				fp = &f->next;
+			}
+		}
+	}
+}
+
+/* Answers a request that did not make it to a hasher with DBE_BUSY. */
+static void
+hash_turn_away(struct HashRequest *hr)
+{
+	++classes[hr->cls].stats.busy;
+	hash_reject(hr, DBE_BUSY);
+}
+
+static bool
+hash_expired(struct HashRequest *hr, time_t now)
+{
+	if (hr->deadline >= now)
+		return false;
+
+	log_debug(SS_SQL, "hash request %lu for %s timed out",
+			(unsigned long)hr->id, hr->account);
+	return true;
+}
+
+/*
+ * Gives up on requests that have waited longer than hasher:queue_timeout for
+ * a hasher.
+ */
+void
+db_expire_hash_requests(void)
+{
+	if (config.hasher.queue_timeout == 0 || hash_requests_waiting == 0)
+		return;
+
+	hash_sweep(hash_expired, hash_turn_away, monotonic_now());
+}
+
+/*
+ * Makes room for a request from a source with queued requests already in the
+ * full queue, by turning away the newest request of the longest flow.
+ * Only flows of classes weighted no higher than the request's own are
+ * considered, so that nobody can push out requests that matter more.
+ * Returns false if the request itself would be the one to turn away.
+ */
+static bool
+hash_evict_for(const struct HashRequest *hr)
+{
+	struct HashClassQueue *c;
+	struct HashClassQueue *longest_class = NULL;
+	struct HashFlow *f;
+	struct HashFlow *longest = NULL;
+	struct HashRequest *victim;
+	struct HashRequest **hrp;
+	size_t mine = 0;
+	size_t i;
+
+	for (i = 0; i < HC_COUNT; ++i) {
+		if (class_weight((enum HashClass)i) > class_weight(hr->cls))
+			continue;
+		c = &classes[i];
+		for (f = c->head; f != NULL; f = f->next) {
+			if ((enum HashClass)i == hr->cls
+					&& !strcmp(f->source, hr->source))
+				mine = f->length;
+			if (longest == NULL || f->length > longest->length) {
+				longest = f;
+				longest_class = c;
+			}
+		}
+	}
+
+	/* Ties go to whoever is already queued. */
+	if (longest == NULL || longest->length <= mine + 1)
+		return false;
+
+	for (hrp = &longest->head; (*hrp)->next != NULL; hrp = &(*hrp)->next)
+		longest->tail = *hrp;
+	victim = *hrp;
+	*hrp = NULL;
+	--longest->length;
+	--longest_class->stats.waiting;
+	--hash_requests_waiting;
+
+	log_debug(SS_SQL, "hash queue full, turning away request for %s "
+			"from %s", victim->account, longest->source);
+	hash_turn_away(victim);
+	return true;
+}
+
+static void
+hash_dispatch(void)
+{
+	struct HashClassStats *st;
+	struct HashRequest *hr;
+	uint64_t waited;
+	time_t now = monotonic_now();
+
+	while (hash_requests_waiting != 0 && hasher_can_submit()) {
+		hr = hash_dequeue();
+		/* The rest are left to db_expire_hash_requests(). */
+		if (hr->deadline != 0 && hash_expired(hr, now)) {
+			hash_turn_away(hr);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &hr->dispatched);
+		waited = stats_elapsed_us(&hr->queued);
+		stats_record(ST_QUEUE, waited);
+		waited /= 1000;
+		st = &classes[hr->cls].stats;
+		++st->served;
+		st->wait_ms_total += waited;
+		if (waited > st->wait_ms_max)
+			st->wait_ms_max = waited;
+
+		hasher_submit(hr->id, hr->password, hr->salt, &hr->params);
+		if (!hr->rehash)
+			crypto_wipe(hr->password, sizeof(hr->password));
+
+		hr->next = hash_requests_inflight;
+		hash_requests_inflight = hr;
+	}
+}
+
+/* How many hash requests are waiting for a free hasher */
+size_t
+db_hash_queue_length(void)
+{
+	return hash_requests_waiting;
+}
+
+void
+db_hash_class_stats(struct HashClassStats stats[static HC_COUNT])
+{
+	size_t i;
+
+	for (i = 0; i < HC_COUNT; ++i) {
+		stats[i] = classes[i].stats;
+		stats[i].name = classes[i].name;
+		stats[i].weight = class_weight((enum HashClass)i);
+	}
+}
+
+static bool
+owner_gone(const struct HashRequest *hr)
+{
+	return (hr->owner.generation != 0
+			&& user_from_handle(&hr->owner) == NULL);
+}
+
+/* Tells the caller that the request is off, so that it can clean up. */
+static void
+hash_cancel(struct HashRequest *hr)
+{
+	log_debug(SS_SQL, "cancelling hash request %lu for %s",
+			(unsigned long)hr->id, hr->account);
+	hr->theircallback(DBE_CANCELLED, hr->account, 0, hr->theirarg);
+	crypto_wipe(hr, sizeof(*hr));
+	free(hr);
+}
+
+/* Cancels the followers of hr whose owners are gone. */
+static void
+hash_cancel_followers(struct HashRequest *hr)
+{
+	struct HashRequest **fp = &hr->followers;
+	struct HashRequest *f;
+
+	while ((f = *fp) != NULL) {
+		if (owner_gone(f)) {
+			*fp = f->next;
+			hash_cancel(f);
+		} else {
+			fp = &f->next;
+		}
+	}
+}
+
+static bool
+hash_orphaned(struct HashRequest *hr, time_t now)
+{
+	(void)now;
+
+	hash_cancel_followers(hr);
+	return (owner_gone(hr) && hr->followers == NULL);
+}
+
+/*
+ * Drops the requests of users who have quit or been split off.
+ * Requests that have not been handed to a hasher yet are removed from the
+ * queue, unless another user is waiting on the same hash;
+ * the results of those that have are discarded in hash_complete().
+ */
+void
+db_cancel_orphans(void)
+{
+	struct HashRequest *hr;
+
+	if (hash_requests_waiting != 0)
+		hash_sweep(hash_orphaned, hash_cancel, 0);
+
+	for (hr = hash_requests_inflight; hr != NULL; hr = hr->next)
+		hash_cancel_followers(hr);
+}
+
+static void
+hash_complete(struct HashRequest *hr, uint8_t *theirhash)
+{
+	uint8_t oldhash[HASH_LEN];
+	enum DBError dbe;
+
+	if (owner_gone(hr)) {
+		crypto_wipe(theirhash, HASH_LEN);
+		hash_cancel(hr);
+		return;
+	}
+
+	/* The callback wipes myhash, but a rehash needs it. */
+	if (hr->rehash)
+		memcpy(oldhash, hr->myhash, sizeof(oldhash));
+	dbe = hr->mycallback(hr, theirhash);
+	if (dbe == DBE_OK && hr->rehash)
+		rehash(hr, oldhash);
+	crypto_wipe(oldhash, sizeof(oldhash));
+	if (hr->theircallback != NULL)
+		hr->theircallback(dbe, hr->account, hr->ts, hr->theirarg);
+	crypto_wipe(hr, sizeof(*hr));
+	free(hr);
+}
+
+void
+db_hash_response(uint32_t id, uint8_t *theirhash)
+{
+	struct HashRequest **hrp;
+	struct HashRequest *hr;
+	struct HashRequest *follower;
+	uint8_t hash[HASH_LEN];
+
+	for (hrp = &hash_requests_inflight; *hrp != NULL; hrp = &(*hrp)->next) {
+		if ((*hrp)->id == id)
+			break;
+	}
+
+	if ((hr = *hrp) == NULL) {
+		log_fatal(SS_INT, "got hasher response for unknown "
+				"request %lu", (unsigned long)id);
+		return;
+	}
+	*hrp = hr->next;
+	stats_record(ST_SERVICE, stats_elapsed_us(&hr->dispatched));
+	stats_record(ST_TOTAL, stats_elapsed_us(&hr->queued));
+
+	/* Every callback wipes the hash it is given, so each duplicate
+	 * gets its own copy.
+	 */
+	while ((follower = hr->followers) != NULL) {
+		hr->followers = follower->next;
+		memcpy(hash, theirhash, sizeof(hash));
+		hash_complete(follower, hash);
+	}
+	crypto_wipe(hash, sizeof(hash));
+	hash_complete(hr, theirhash);
+
+	hash_dispatch();
+}
+
+/*
+ * Answers the request with the given id, which the hasher could not hash, and
+ * its duplicates with dbe.
+ */
+void
+db_hash_failed(uint32_t id, enum DBError dbe)
+{
+	struct HashRequest **hrp;
+	struct HashRequest *hr;
+
+	for (hrp = &hash_requests_inflight; *hrp != NULL; hrp = &(*hrp)->next) {
+		if ((*hrp)->id == id)
+			break;
+	}
+
+	if ((hr = *hrp) == NULL) {
+		log_error(SS_INT, "hasher failed unknown request %lu",
+				(unsigned long)id);
+		return;
+	}
+	*hrp = hr->next;
+	hash_reject(hr, dbe);
+
+	hash_dispatch();
+}
+
+/* Answers every request a hasher has with dbe, once the hasher is gone. */
+void
+db_hash_failed_all(enum DBError dbe)
+{
+	struct HashRequest *hr;
+
+	while ((hr = hash_requests_inflight) != NULL) {
+		hash_requests_inflight = hr->next;
+		hash_reject(hr, dbe);
+	}
+}
+
+/* Hands waiting requests to hashers that have become available again. */
+void
+db_hash_dispatch(void)
+{
+	hash_dispatch();
+}
+
+static void
+hash_request_key(struct HashRequest *hr)
+{
+	crypto_blake2b_ctx ctx;
+	uint8_t params[10];
+
+	/* Only compared within this process, so host byte order will do;
+	 * hasher_params_valid() keeps lanes below 256.
+	 */
+	params[0] = (uint8_t)hr->params.algorithm;
+	params[1] = (uint8_t)hr->params.lanes;
+	memcpy(&params[2], &hr->params.memory, sizeof(hr->params.memory));
+	memcpy(&params[6], &hr->params.passes, sizeof(hr->params.passes));
+
+	crypto_blake2b_general_init(&ctx, sizeof(hr->key),
+			hash_request_mac_key, sizeof(hash_request_mac_key));
+	crypto_blake2b_update(&ctx, params, sizeof(params));
+	crypto_blake2b_update(&ctx, hr->salt, sizeof(hr->salt));
+	/* Zero-padded, and passwords cannot contain NUL. */
+	crypto_blake2b_update(&ctx, (const uint8_t *)hr->password,
+			sizeof(hr->password));
+	crypto_blake2b_final(&ctx, hr->key);
+}
+
+/* An earlier request, waiting or in flight, that computes the same hash */
+static struct HashRequest *
+find_duplicate(const struct HashRequest *hr)
+{
+	struct HashFlow *f;
+	struct HashRequest *other;
+	size_t i;
+
+	for (i = 0; i < HC_COUNT; ++i) {
+		for (f = classes[i].head; f != NULL; f = f->next) {
+			for (other = f->head; other != NULL;
+					other = other->next) {
+				if (crypto_verify32(other->key, hr->key) == 0)
+					return other;
+			}
+		}
+	}
+
+	for (other = hash_requests_inflight; other != NULL;
+			other = other->next) {
+		if (crypto_verify32(other->key, hr->key) == 0)
+			return other;
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues a hash of password with salt and params.
+ * A request identical to one already waiting or in flight is attached to it
+ * instead and gets the same hash once that completes.
+ * If hasher:queue_length requests are waiting already, the callback is told
+ * DBE_BUSY right away, unless a source with more requests waiting can give
+ * up one instead.
+ * Returns the request, or NULL if it was turned away.
+ * rehash keeps the password around for rehash() past the hasher.
+ * requester is the user the request is on behalf of, if any; it decides the
+ * source, and operators get HC_OPER whatever cls says.
+ * With cancellable, the request is cancelled once the requester is gone.
+ */
+static struct HashRequest *
+hash_request(const char *account,
+		const uint8_t *myhash,
+		const char *password,
+		const uint8_t *salt,
+		const struct HashParams *params,
+		bool rehash,
+		enum HashClass cls,
+		const struct User *requester,
+		bool cancellable,
+		time_t ts,
+		void *theirarg,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg),
+		enum DBError (*mycallback)(struct HashRequest *hr,
+			uint8_t *theirhash))
+{
+	struct HashRequest *hr = scalloc(1, sizeof(*hr));
+	struct HashRequest *leader;
+	struct HashRequest **tailp;
+
+	hr->theirarg = theirarg;
+	hr->theircallback = theircallback;
+	hr->mycallback = mycallback;
+	hr->ts = ts;
+	/* 0 is never used so that a zeroed frame can't match anything. */
+	if (++next_hash_request_id == 0)
+		++next_hash_request_id;
+	hr->id = next_hash_request_id;
+	if (requester != NULL && cancellable)
+		hr->owner = user_handle(requester);
+	else
+		memset(&hr->owner, 0, sizeof(hr->owner));
+	hr->cls = (requester != NULL && requester->is_oper) ? HC_OPER : cls;
+	source_key(hr->source, requester);
+	if (strlen(account) >= sizeof(hr->account))
+		log_fatal(SS_SQL, "oversized account name passed");
+	strcpy(hr->account, account);
+	memset(hr->password, 0, sizeof(hr->password));
+	/* is_valid_password() in commands.c did the length check */
+	memcpy(hr->password, password, strlen(password));
+	memcpy(hr->salt, salt, SALT_LEN);
+	hr->params = *params;
+	hr->rehash = rehash;
+	if (myhash != NULL)
+		memcpy(hr->myhash, myhash, HASH_LEN);
+	else
+		memset(hr->myhash, 0, HASH_LEN);
+	hr->followers = NULL;
+	hr->cacheable = false;
+	hash_request_key(hr);
+
+	if ((leader = find_duplicate(hr)) != NULL) {
+		log_debug(SS_SQL, "coalescing hash request for %s with %lu",
+				account, (unsigned long)leader->id);
+		if (!hr->rehash)
+			crypto_wipe(hr->password, sizeof(hr->password));
+		/* It waits for the same hash, so as long as the leader;
+		 * dispatched stays zero, as the leader may not have been.
+		 */
+		hr->deadline = leader->deadline;
+		hr->queued = leader->queued;
+		hr->next = NULL;
+		for (tailp = &leader->followers; *tailp != NULL;
+				tailp = &(*tailp)->next)
+			;
+		*tailp = hr;
+		return hr;
+	}
+
+	if (config.hasher.queue_length != 0
+			&& hash_requests_waiting >= config.hasher.queue_length
+			&& !hash_evict_for(hr)) {
+		log_debug(SS_SQL, "hash queue full, turning away request for "
+				"%s from %s", account, hr->source);
+		hash_turn_away(hr);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &hr->queued);
+	if (config.hasher.queue_timeout != 0)
+		hr->deadline = hr->queued.tv_sec
+			+ (time_t)config.hasher.queue_timeout;
+	else
+		hr->deadline = 0;
+
+	hash_enqueue(hr);
+	return hr;
+}
+
+/*
+ * Checks password against a hash imported from elsewhere (s is the row
+ * check_auth_run() found), right away on the database thread: legacy hashes
+ * are cheap next to argon2, and each one is only ever checked until it
+ * matches.
+ */
+static enum DBError
+check_legacy(sqlite3_stmt *s, const struct LegacyVerifier *lv,
+		const char *account, const char *password)
+{
+	const uint8_t *salt = sqlite3_column_blob(s, 0);
+	const uint8_t *hash = sqlite3_column_blob(s, 1);
+	size_t salt_len = (size_t)sqlite3_column_bytes(s, 0);
+	size_t hash_len = (size_t)sqlite3_column_bytes(s, 1);
+
+	if (hash_len == 0 || !lv->verify(password, hash, hash_len,
+				salt, salt_len)) {
+		log_debug(SS_SQL, "%s auth check for %s failed", lv->name,
+				account);
+		return DBE_PW_MISMATCH;
+	}
+
+	log_debug(SS_SQL, "%s auth check for %s succeeded", lv->name,
+			account);
+	return DBE_OK;
+}
+
+/* The argon2 hash on the row s is on, for check_auth_done() */
+static enum DBError
+read_hash(sqlite3_stmt *s, struct DBJob *job)
+{
+	if (sqlite3_column_bytes(s, 0) != SALT_LEN) {
+		log_error(SS_SQL, "SALT_LEN desync");
+		return DBE_DESYNC;
+	}
+	if (sqlite3_column_bytes(s, 1) != HASH_LEN) {
+		log_error(SS_SQL, "HASH_LEN desync");
+		return DBE_DESYNC;
+	}
+	job->params.algorithm = (enum PasswordAlgorithm)sqlite3_column_int(s,
+			3);
+	job->params.memory = (uint32_t)sqlite3_column_int64(s, 4);
+	job->params.passes = (uint32_t)sqlite3_column_int64(s, 5);
+	job->params.lanes = (uint32_t)sqlite3_column_int64(s, 6);
+	if (!hasher_params_valid(&job->params)) {
+		log_error(SS_SQL, "bad argon2 parameters for %s",
+				job->account);
+		return DBE_DESYNC;
+	}
+	memcpy(job->salt, sqlite3_column_blob(s, 0), SALT_LEN);
+	memcpy(job->hash, sqlite3_column_blob(s, 1), HASH_LEN);
+	return DBE_OK;
+}
+
+static void
+check_auth_run(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	const struct LegacyVerifier *lv;
+	int sqlite_ret;
+
+	s = query(Q_CHECK_AUTH);
+	bind_key(s, 1, job->account, true);
+
+	sqlite_ret = sqlite3_step(s);
+	if (sqlite_ret == SQLITE_DONE) {
+		job->dbe = DBE_NO_SUCH_ACCOUNT;
+	} else if (sqlite_ret != SQLITE_ROW) {
+		log_error(SS_SQL, "unable to SELECT: %s",
+				sqlite3_errstr(sqlite_ret));
+		job->dbe = DBE_SQLITE;
+	} else if ((lv = legacy_verifier((enum PasswordAlgorithm)
+					sqlite3_column_int(s, 3))) != NULL) {
+		job->legacy = true;
+		job->ts = (time_t)sqlite3_column_int64(s, 2);
+		job->dbe = check_legacy(s, lv, job->account, job->password);
+	} else {
+		job->ts = (time_t)sqlite3_column_int64(s, 2);
+		job->dbe = read_hash(s, job);
+	}
+	query_done(s);
+}
+
+/*
+ * Verifies password against myhash, from the verification cache if possible,
+ * by hashing it otherwise.
+ */
+static void
+check_hash(const char *account, const char *password,
+		const struct User *owner, enum HashClass cls, bool may_rehash,
+		const uint8_t salt[SALT_LEN], const uint8_t myhash[HASH_LEN],
+		const struct HashParams *params, time_t ts,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg),
+		void *theirarg)
+{
+	struct HashRequest *hr;
+	uint8_t cache_mac[32];
+	bool rehash;
+
+	/* Bring the account up to the current parameters on success. */
+	rehash = may_rehash && !hasher_params_equal(params, hasher_params());
+
+	/* A rehash needs the hash anyway. */
+	if (verify_cache != NULL) {
+		verify_cache_mac(cache_mac, account, password, myhash);
+		if (!rehash && verify_cache_hit(cache_mac)) {
+			log_debug(SS_SQL, "auth check for %s succeeded "
+					"from cache", account);
+			crypto_wipe(cache_mac, sizeof(cache_mac));
+			theircallback(DBE_OK, account, ts, theirarg);
+			return;
+		}
+	}
+
+	hr = hash_request(account, myhash, password, salt, params, rehash,
+			cls, owner, true, ts,
+			theirarg, theircallback, db_check_auth_cb);
+	if (hr != NULL && verify_cache != NULL) {
+		hr->cacheable = true;
+		memcpy(hr->cache_mac, cache_mac, sizeof(cache_mac));
+	}
+	crypto_wipe(cache_mac, sizeof(cache_mac));
+	hash_dispatch();
+}
+
+static void
+check_auth_done(struct DBJob *job)
+{
+	const struct User *owner = user_from_handle(&job->owner);
+
+	/* Quit or split while sqlite had the row looked up */
+	if (job->owner.generation != 0 && owner == NULL) {
+		log_debug(SS_SQL, "cancelling auth check for %s",
+				job->account);
+		job->theircallback(DBE_CANCELLED, job->account, 0,
+				job->theirarg);
+		return;
+	}
+
+	if (job->dbe != DBE_OK || job->legacy) {
+		if (job->dbe == DBE_OK && job->may_rehash)
+			rehash_legacy(job->account, job->password);
+		job->theircallback(job->dbe, job->account,
+				(job->dbe == DBE_OK) ? job->ts : 0,
+				job->theirarg);
+		return;
+	}
+
+	check_hash(job->account, job->password, owner, job->cls,
+			job->may_rehash, job->salt, job->hash, &job->params,
+			job->ts, job->theircallback, job->theirarg);
+}
+
+/*
+ * Accounts in the index are checked right away; anything else has the
+ * database thread look up the row first, and checks it in check_auth_done().
+ * may_rehash: whether to bring the account up to the current parameters if
+ * the password checks out
+ */
+static void
+check_auth(const char *account, char *password, const struct User *owner,
+		enum HashClass cls, bool may_rehash,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg),
+		void *theirarg)
+{
+	struct AccountEntry *e;
+	struct DBJob *job;
+	uint8_t salt[SALT_LEN];
+	uint8_t myhash[HASH_LEN];
+	struct HashParams params;
+
+	log_debug(SS_SQL, "auth check for %s...", account);
+
+	if ((e = index_find(account)) != NULL && !e->sql_only) {
+		/* The callback may come before check_hash() is done with
+		 * them, and a password change may drop e meanwhile.
+		 */
+		memcpy(salt, e->salt, sizeof(salt));
+		memcpy(myhash, e->hash, sizeof(myhash));
+		params = e->params;
+		check_hash(account, password, owner, cls, may_rehash, salt,
+				myhash, &params, e->created,
+				theircallback, theirarg);
+		crypto_wipe(salt, sizeof(salt));
+		crypto_wipe(myhash, sizeof(myhash));
+		crypto_wipe(password, strlen(password));
+		return;
+	}
+	if ((e == NULL && index_loaded) || strlen(account) > ACCOUNT_LEN) {
+		crypto_wipe(password, strlen(password));
+		theircallback(DBE_NO_SUCH_ACCOUNT, account, 0, theirarg);
+		return;
+	}
+
+	job = db_job(check_auth_run, check_auth_done);
+	strcpy(job->account, account);
+	/* is_valid_password() in commands.c did the length check */
+	memcpy(job->password, password, strlen(password));
+	crypto_wipe(password, strlen(password));
+	if (owner != NULL)
+		job->owner = user_handle(owner);
+	job->cls = cls;
+	job->may_rehash = may_rehash;
+	job->theircallback = theircallback;
+	job->theirarg = theirarg;
+	db_submit(job);
+}
+
+void
+db_check_auth(const char *account, char *password, const struct User *owner,
+		enum HashClass cls,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg),
+		void *theirarg)
+{
+	check_auth(account, password, owner, cls, true, theircallback,
+			theirarg);
+}
+
+/* Answers a job for a callback that wants the account and e-mail address. */
+static void
+lookup_done(struct DBJob *job)
+{
+	job->lookupcallback(job->dbe, job->account, job->email,
+			job->theirarg);
+}
+
+static void
+create_account_run(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	s = query(Q_CREATE_ACCOUNT);
+	sqlite3_bind_text(s, 1, job->account, -1, SQLITE_STATIC);
+	sqlite3_bind_text(s, 2, job->email, -1, SQLITE_STATIC);
+	bind_key(s, 3, job->account, true);
+	bind_key(s, 4, job->email, false);
+
+	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
+		if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_UNIQUE) {
+			job->dbe = DBE_ACCOUNT_IN_USE;
+		} else {
+			job->dbe = DBE_SQLITE;
+			log_error(SS_SQL, "unable to INSERT: %s",
+					sqlite3_errstr(sqlite_ret));
+		}
+	}
+
+	query_done(s);
+}
+
+void
+db_create_account(const char *name, const char *email,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			const char *email,
+			void *arg),
+		void *theirarg)
+{
+	struct DBJob *job;
+
+	log_debug(SS_SQL, "creating account for %s with e-mail %s",
+			name, email);
+
+	if (strlen(name) > ACCOUNT_LEN) {
+		theircallback(DBE_ACCOUNT_NAME_TOO_LONG, name, email,
+				theirarg);
+		return;
+	}
+
+	if (strlen(email) > EMAIL_LEN) {
+		theircallback(DBE_EMAIL_TOO_LONG, name, email, theirarg);
+		return;
+	}
+
+	job = db_job(create_account_run, lookup_done);
+	strcpy(job->account, name);
+	strcpy(job->email, email);
+	job->lookupcallback = theircallback;
+	job->theirarg = theirarg;
+	db_submit(job);
+}
+
+/*
+ * A job that writes the hash of a new password for account; it answers the
+ * hash request or whoever else asked for it once the database thread is done.
+ */
+static struct DBJob *
+password_job(const char *account, const struct HashParams *params,
+		const uint8_t salt[SALT_LEN], const uint8_t hash[HASH_LEN],
+		void (*run)(struct DBJob *job), void (*done)(struct DBJob *job))
+{
+	struct DBJob *job = db_job(run, done);
+
+	if (strlen(account) >= sizeof(job->account))
+		log_fatal(SS_SQL, "oversized account name passed");
+	strcpy(job->account, account);
+	job->params = *params;
+	memcpy(job->salt, salt, SALT_LEN);
+	memcpy(job->hash, hash, HASH_LEN);
+	job->refresh = (index_buckets != 0);
+	return job;
+}
+
+/* Submits job, which answers hr in its stead. */
+static enum DBError
+hash_store(struct HashRequest *hr, struct DBJob *job)
+{
+	job->theircallback = hr->theircallback;
+	job->theirarg = hr->theirarg;
+	hr->theircallback = NULL;
+	db_submit(job);
+	return DBE_OK;
+}
+
+/* Binds the parameters, salt and hash of job as ?1 to ?6. */
+static void
+bind_password(sqlite3_stmt *s, struct DBJob *job)
+{
+	sqlite3_bind_int(s, 1, job->params.algorithm);
+	sqlite3_bind_blob(s, 2, job->salt, SALT_LEN, SQLITE_STATIC);
+	sqlite3_bind_blob(s, 3, job->hash, HASH_LEN, SQLITE_STATIC);
+	sqlite3_bind_int64(s, 4, job->params.memory);
+	sqlite3_bind_int64(s, 5, job->params.passes);
+	sqlite3_bind_int64(s, 6, job->params.lanes);
+}
+
+static void
+store_password_run(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	s = query(Q_STORE_PASSWORD);
+	bind_password(s, job);
+	bind_key(s, 7, job->account, true);
+
+	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
+		log_error(SS_SQL, "unable to UPDATE: %s",
+				sqlite3_errstr(sqlite_ret));
+		job->dbe = DBE_SQLITE;
+	}
+
+	query_done(s);
+	if (job->dbe == DBE_OK)
+		read_back(job);
+}
+
+static void
+store_password_done(struct DBJob *job)
+{
+	if (job->dbe == DBE_OK) {
+		if (verify_cache != NULL)
+			verify_cache_forget(job->account);
+		index_refresh(job);
+	}
+	job->theircallback(job->dbe, job->account, 0, job->theirarg);
+}
+
+static void
+store_password(const char *account, const struct HashParams *params,
+		const uint8_t salt[SALT_LEN], const uint8_t hash[HASH_LEN],
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			time_t ts,
+			void *arg),
+		void *theirarg)
+{
+	struct DBJob *job = password_job(account, params, salt, hash,
+			store_password_run, store_password_done);
+
+	job->theircallback = theircallback;
+	job->theirarg = theirarg;
+	db_submit(job);
+}
+
+static enum DBError
+db_change_password_cb(struct HashRequest *hr, uint8_t *theirhash)
+{
+	enum DBError ret;
+
+	ret = hash_store(hr, password_job(hr->account, &hr->params, hr->salt,
+				theirhash, store_password_run,
+				store_password_done));
+	crypto_wipe(hr->salt, SALT_LEN);
+	crypto_wipe(theirhash, HASH_LEN);
+	return ret;
+}
+
+static void
+rehash_run(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	s = query(Q_REHASH);
+	bind_password(s, job);
+	bind_key(s, 7, job->account, true);
+	sqlite3_bind_blob(s, 8, job->oldhash, HASH_LEN, SQLITE_STATIC);
+
+	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
+		log_error(SS_SQL, "unable to UPDATE: %s",
+				sqlite3_errstr(sqlite_ret));
+		job->dbe = DBE_SQLITE;
+	} else {
+		job->changed = (sqlite3_changes(db) != 0);
+	}
+
+	query_done(s);
+	if (job->changed)
+		read_back(job);
+}
+
+static void
+rehash_stored(struct DBJob *job)
+{
+	if (job->dbe == DBE_OK && !job->changed) {
+		log_info(SS_SQL, "password for %s changed during its rehash",
+				job->account);
+	} else if (job->dbe == DBE_OK) {
+		index_refresh(job);
+		log_info(SS_SQL, "rehashed %s with %s, %" PRIu32 " KiB, %"
+				PRIu32 " passes, %" PRIu32 " lane(s)",
+				job->account,
+				job->params.algorithm == PA_ARGON2ID
+				? "argon2id" : "argon2i",
+				job->params.memory, job->params.passes,
+				job->params.lanes);
+	}
+	job->theircallback(job->dbe, job->account, 0, job->theirarg);
+}
+
+/*
+ * Stores a rehashed password, unless the password was changed while the
+ * rehash was running; myhash is the hash it replaces.
+ */
+static enum DBError
+db_rehash_cb(struct HashRequest *hr, uint8_t *theirhash)
+{
+	struct DBJob *job;
+	enum DBError ret;
+
+	job = password_job(hr->account, &hr->params, hr->salt, theirhash,
+			rehash_run, rehash_stored);
+	memcpy(job->oldhash, hr->myhash, HASH_LEN);
+	ret = hash_store(hr, job);
+
+	crypto_wipe(hr->salt, SALT_LEN);
+	crypto_wipe(hr->myhash, HASH_LEN);
+	crypto_wipe(theirhash, HASH_LEN);
+	return ret;
+}
+
+static void
+rehash_done(enum DBError dbe, const char *account, time_t ts, void *arg)
+{
+	(void)ts;
+	(void)arg;
+
+	/* Too busy for it now; the next auth will try again. */
+	if (dbe == DBE_BUSY)
+		log_debug(SS_SQL, "no hasher free to rehash %s", account);
+	else if (dbe != DBE_OK)
+		log_error(SS_SQL, "unable to store rehash for %s", account);
+}
+
+/*
+ * Hashes the password of a request that just verified again with the
+ * current parameters; oldhash is the hash that verified.
+ */
+static void
+rehash(const struct HashRequest *hr, const uint8_t *oldhash)
+{
+	uint8_t salt[SALT_LEN];
+
+	if (randombytes(salt, sizeof(salt)) == NULL) {
+		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+				sizeof(salt));
+		return;
+	}
+	log_debug(SS_SQL, "rehashing %s", hr->account);
+	hash_request(hr->account, oldhash, hr->password, salt,
+			hasher_params(), false, HC_REHASH, NULL, false, 0,
+			NULL, rehash_done, db_rehash_cb);
+	crypto_wipe(salt, sizeof(salt));
+}
+
+static void
+legacy_rehash_run(struct DBJob *job)
+{
+	sqlite3_stmt *s;
+	int sqlite_ret;
+
+	s = query(Q_LEGACY_REHASH);
+	bind_password(s, job);
+	bind_key(s, 7, job->account, true);
+	sqlite3_bind_int(s, 8, PA_ARGON2I);
+	sqlite3_bind_int(s, 9, PA_ARGON2ID);
+
+	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
+		log_error(SS_SQL, "unable to UPDATE: %s",
+				sqlite3_errstr(sqlite_ret));
+		job->dbe = DBE_SQLITE;
+	} else {
+		job->changed = (sqlite3_changes(db) != 0);
 	}
 
-	log_info(SS_SQL, "database lm.db opened");
-	return 0;
+	query_done(s);
+	if (job->changed)
+		read_back(job);
+}
+
+static void
+legacy_rehash_stored(struct DBJob *job)
+{
+	if (job->dbe == DBE_OK && !job->changed) {
+		log_info(SS_SQL, "password for %s changed during its rehash",
+				job->account);
+	} else if (job->dbe == DBE_OK) {
+		index_refresh(job);
+		log_info(SS_SQL, "upgraded legacy hash of %s", job->account);
+	}
+	job->theircallback(job->dbe, job->account, 0, job->theirarg);
 }
 
+/*
+ * Stores the argon2 hash that replaces a legacy one.
+ * Any password change stores argon2 as well, so a legacy pwalgo still being
+ * there means nobody changed the password during the rehash.
+ */
 static enum DBError
-db_check_auth_cb(uint8_t *salt,
-		uint8_t *myhash,
-		uint8_t *theirhash,
-		const char *account,
-		time_t ts)
+db_legacy_rehash_cb(struct HashRequest *hr, uint8_t *theirhash)
 {
 	enum DBError ret;
 
-	if (crypto_verify32(theirhash, myhash) != 0) {
-		ret = DBE_PW_MISMATCH;
-		log_debug(SS_SQL, "auth check for %s failed", account);
-	} else {
-		ret = DBE_OK;
-		log_debug(SS_SQL, "auth check for %s succeeded (TS: %llu)",
-				account,
-				(unsigned long long)ts);
-	}
+	ret = hash_store(hr, password_job(hr->account, &hr->params, hr->salt,
+				theirhash, legacy_rehash_run,
+				legacy_rehash_stored));
+	crypto_wipe(hr->salt, SALT_LEN);
 	crypto_wipe(theirhash, HASH_LEN);
-	crypto_wipe(myhash, HASH_LEN);
-	crypto_wipe(salt, SALT_LEN);
 	return ret;
 }
 
-void
-db_hash_response(uint8_t *theirhash)
+/* Replaces the legacy hash of account, which password just matched. */
+static void
+rehash_legacy(const char *account, const char *password)
 {
-	struct HashRequest *hr = hash_requests_head;
+	uint8_t salt[SALT_LEN];
 
-	if (hr == NULL) {
-		log_fatal(SS_INT, "got hasher response but no requests");
+	if (randombytes(salt, sizeof(salt)) == NULL) {
+		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+				sizeof(salt));
 		return;
 	}
-	hash_requests_head = hr->next;
-	hr->theircallback(hr->mycallback(hr->salt, hr->myhash, theirhash,
-				hr->account, hr->ts),
-			hr->account, hr->ts, hr->theirarg);
-	free(hr);
+	log_debug(SS_SQL, "rehashing legacy hash of %s", account);
+	hash_request(account, NULL, password, salt, hasher_params(), false,
+			HC_REHASH, NULL, false, 0,
+			NULL, rehash_done, db_legacy_rehash_cb);
+	crypto_wipe(salt, sizeof(salt));
+	hash_dispatch();
 }
 
-static void
-hash_request(const char *account,
-		const uint8_t *myhash,
-		const char *password,
-		const uint8_t *salt,
-		time_t ts,
-		void *theirarg,
+void
+db_change_password(const char *account, const char *password,
+		const struct User *requester,
 		void (*theircallback)(enum DBError dbe,
 			const char *account,
 			time_t ts,
 			void *arg),
-		enum DBError (*mycallback)(uint8_t *salt,
-			uint8_t *myhash,
-			uint8_t *theirhash,
-			const char *account,
-			time_t ts))
+		void *theirarg)
 {
-	struct HashRequest *hr = smalloc(sizeof(*hr));
-	struct HashRequest *tail;
+	unsigned char salt[SALT_LEN];
 
-	hr->theirarg = theirarg;
-	hr->theircallback = theircallback;
-	hr->mycallback = mycallback;
-	hr->ts = ts;
-	if (strlen(account) >= sizeof(hr->account))
-		log_fatal(SS_SQL, "oversized account name passed");
-	strcpy(hr->account, account);
-	memcpy(hr->salt, salt, SALT_LEN);
-	if (myhash != NULL)
-		memcpy(hr->myhash, myhash, HASH_LEN);
-	else
-		memset(hr->myhash, 0, HASH_LEN);
+	log_debug(SS_SQL, "updating password for %s", account);
 
-	/* insert at tail to keep order, which lm.c:hasher_read_cb()
-	 * and db_hash_response() rely on. */
-	hr->next = NULL;
-	if (hash_requests_head == NULL) {
-		hash_requests_head = hr;
-	} else {
-		for (tail = hash_requests_head;
-				tail->next != NULL;
-				tail = tail->next)
-			;
-		tail->next = hr;
+	if (randombytes(salt, sizeof(salt)) == NULL) {
+		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+				sizeof(salt));
+		return;
 	}
-
-	lm_send_hasher_request(password, salt);
+	/* Not cancellable: the user asked for the change, whether or not
+	 * they are still around to hear that it went through.
+	 */
+	hash_request(account, NULL, password, salt, hasher_params(), false,
+			HC_ACCOUNT, requester, false, 0,
+			theirarg, theircallback, db_change_password_cb);
+	hash_dispatch();
+	crypto_wipe(salt, sizeof(salt));
 }
 
-void
-db_check_auth(const char *account, char *password,
-		void (*theircallback)(enum DBError dbe,
+/*
+ * NEWPASS: the old password is checked and the new one hashed at the same
+ * time if there are hashers enough for both, one after the other otherwise.
+ * The new hash is only stored once the old password checks out.
+ */
+struct PasswordSwap {
+	void (*theircallback)(enum DBError dbe,
 			const char *account,
 			time_t ts,
-			void *arg),
-		void *theirarg)
-{
-	sqlite3_stmt *s;
-	const uint8_t *salt;
-	const uint8_t *myhash;
-	int sqlite_ret;
-
-	log_debug(SS_SQL, "auth check for %s...", account);
+			void *arg);
+	void *theirarg;
+	struct UserHandle requester;
+	char account[ACCOUNT_LEN + 1];
+	bool speculative;
+	/* halves still to come back */
+	unsigned int pending;
+	enum DBError checked;
+	enum DBError hashed;
+	/* The new password until it is handed over, unless speculative */
+	char password[PASSWORD_LEN];
+	/* The new hash, once hashed is DBE_OK */
+	struct HashParams params;
+	uint8_t salt[SALT_LEN];
+	uint8_t hash[HASH_LEN];
+};
 
-	prepare("SELECT pwsalt, pwhash, created FROM accounts WHERE "
-			"LOWER(name) = LOWER(?) AND expires = 0 LIMIT 1", &s);
-	sqlite3_bind_text(s, 1, account, (int)strlen(account), SQLITE_STATIC);
+static void
+swap_half_done(struct PasswordSwap *ps)
+{
+	enum DBError dbe;
 
-	sqlite_ret = sqlite3_step(s);
-	if (sqlite_ret == SQLITE_DONE) {
-		crypto_wipe(password, strlen(password));
-		sqlite3_finalize(s);
-		theircallback(DBE_NO_SUCH_ACCOUNT, account, 0, theirarg);
-		return;
-	} else if (sqlite_ret != SQLITE_ROW) {
-		log_error(SS_SQL, "unable to SELECT: %s",
-				sqlite3_errstr(sqlite_ret));
-		crypto_wipe(password, strlen(password));
-		sqlite3_finalize(s);
-		theircallback(DBE_SQLITE, account, 0, theirarg);
+	if (--ps->pending != 0)
 		return;
-	}
 
-	salt = sqlite3_column_blob(s, 0);
-	myhash = sqlite3_column_blob(s, 1);
-	if (sqlite3_column_bytes(s, 0) != SALT_LEN) {
-		log_error(SS_SQL, "SALT_LEN desync");
-		sqlite3_finalize(s);
-		crypto_wipe(password, strlen(password));
-		theircallback(DBE_DESYNC, account, 0, theirarg);
-		return;
-	}
-	if (sqlite3_column_bytes(s, 1) != HASH_LEN) {
-		log_error(SS_SQL, "HASH_LEN desync");
-		sqlite3_finalize(s);
-		crypto_wipe(password, strlen(password));
-		theircallback(DBE_DESYNC, account, 0, theirarg);
-		return;
+	if (ps->checked == DBE_OK && ps->hashed == DBE_OK) {
+		store_password(ps->account, &ps->params, ps->salt, ps->hash,
+				ps->theircallback, ps->theirarg);
+	} else {
+		dbe = (ps->checked != DBE_OK) ? ps->checked : ps->hashed;
+		if (dbe == DBE_PW_MISMATCH && ps->speculative)
+			log_debug(SS_SQL, "discarding new password hash for "
+					"%s", ps->account);
+		ps->theircallback(dbe, ps->account, 0, ps->theirarg);
 	}
-	hash_request(account, myhash, password, salt,
-			(time_t)sqlite3_column_int64(s, 2),
-			theirarg, theircallback, db_check_auth_cb);
-	sqlite3_finalize(s);
-	crypto_wipe(password, strlen(password));
-	/* sqlite3_column_blob() returns const void *,
-	 * so we cannot wipe myhash and salt.
-	 */
+	crypto_wipe(ps, sizeof(*ps));
+	free(ps);
 }
 
-enum DBError
-db_create_account(const struct User *u, const char *name, const char *email)
+/* Keeps the new hash until the old password has been checked. */
+static enum DBError
+swap_hash_cb(struct HashRequest *hr, uint8_t *theirhash)
 {
-	sqlite3_stmt *s;
-	size_t name_len;
-	size_t email_len;
-	int sqlite_ret;
-	enum DBError ret;
+	struct PasswordSwap *ps = hr->theirarg;
 
-	log_debug(SS_SQL, "creating account for %s with e-mail %s",
-			name, email);
+	ps->params = hr->params;
+	memcpy(ps->salt, hr->salt, SALT_LEN);
+	memcpy(ps->hash, theirhash, HASH_LEN);
+	crypto_wipe(hr->salt, SALT_LEN);
+	crypto_wipe(theirhash, HASH_LEN);
+	return DBE_OK;
+}
+
+static void
+swap_hashed(enum DBError dbe, const char *account, time_t ts, void *arg)
+{
+	struct PasswordSwap *ps = arg;
 
-	if ((name_len = strlen(name)) > ACCOUNT_LEN)
-		return DBE_ACCOUNT_NAME_TOO_LONG;
+	(void)account;
+	(void)ts;
 
-	if ((email_len = strlen(email)) > EMAIL_LEN)
-		return DBE_EMAIL_TOO_LONG;
+	ps->hashed = dbe;
+	swap_half_done(ps);
+}
 
-	prepare("INSERT INTO accounts(name, email, pwalgo, pwsalt, pwhash) "
-			"VALUES (?, ?, -1, '', '')", &s);
-	sqlite3_bind_text(s, 1, name, (int)name_len, SQLITE_STATIC);
-	sqlite3_bind_text(s, 2, email, (int)email_len, SQLITE_STATIC);
+static void
+swap_hash(struct PasswordSwap *ps, const struct User *requester)
+{
+	uint8_t salt[SALT_LEN];
 
-	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
-		if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_UNIQUE) {
-			ret = DBE_ACCOUNT_IN_USE;
-		} else {
-			ret = DBE_SQLITE;
-			log_error(SS_SQL, "unable to INSERT: %s",
-					sqlite3_errstr(sqlite_ret));
-		}
-		sqlite3_finalize(s);
-		return ret;
+	if (randombytes(salt, sizeof(salt)) == NULL) {
+		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
+				sizeof(salt));
+		return;
 	}
-
-	return DBE_OK;
+	hash_request(ps->account, NULL, ps->password, salt, hasher_params(),
+			false, HC_ACCOUNT, requester, true, 0,
+			ps, swap_hashed, swap_hash_cb);
+	crypto_wipe(ps->password, sizeof(ps->password));
+	crypto_wipe(salt, sizeof(salt));
+	hash_dispatch();
 }
 
-static enum DBError
-db_change_password_cb(uint8_t *salt,
-		uint8_t *myhash,
-		uint8_t *theirhash,
-		const char *account,
-		time_t ts)
+static void
+swap_checked(enum DBError dbe, const char *account, time_t ts, void *arg)
 {
-	sqlite3_stmt *s;
-	int sqlite_ret;
-	enum DBError ret;
+	struct PasswordSwap *ps = arg;
+	struct User *requester;
 
-	(void)myhash;
+	(void)account;
 	(void)ts;
 
-	prepare("UPDATE accounts SET pwalgo = ?, pwsalt = ?, pwhash = ?, "
-			"expires = 0 WHERE LOWER(name) = LOWER(?)", &s);
-	sqlite3_bind_int(s, 1, PA_ARGON2I);
-	sqlite3_bind_blob(s, 2, salt, SALT_LEN, SQLITE_STATIC);
-	sqlite3_bind_blob(s, 3, theirhash, HASH_LEN, SQLITE_STATIC);
-	sqlite3_bind_text(s, 4, account, (int)strlen(account), SQLITE_STATIC);
-
-	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
-		log_error(SS_SQL, "unable to UPDATE: %s",
-				sqlite3_errstr(sqlite_ret));
-		sqlite3_finalize(s);
-		ret = DBE_SQLITE;
-		goto clean;
+	ps->checked = dbe;
+	if (!ps->speculative) {
+		requester = user_from_handle(&ps->requester);
+		if (dbe == DBE_OK && requester != NULL) {
+			swap_hash(ps, requester);
+		} else {
+			/* The hash that never was */
+			if (dbe == DBE_OK)
+				ps->checked = DBE_CANCELLED;
+			crypto_wipe(ps->password, sizeof(ps->password));
+			--ps->pending;
+		}
 	}
-
-	ret = DBE_OK;
-
-clean:
-	crypto_wipe(salt, SALT_LEN);
-	crypto_wipe(theirhash, HASH_LEN);
-	sqlite3_finalize(s);
-	return ret;
+	swap_half_done(ps);
 }
 
 void
-db_change_password(const char *account, const char *password,
+db_swap_password(const char *account, char *oldpassword,
+		const char *newpassword, const struct User *requester,
 		void (*theircallback)(enum DBError dbe,
 			const char *account,
 			time_t ts,
 			void *arg),
 		void *theirarg)
 {
-	unsigned char salt[SALT_LEN];
+	struct PasswordSwap *ps = scalloc(1, sizeof(*ps));
 
-	log_debug(SS_SQL, "updating password for %s", account);
+	log_debug(SS_SQL, "swapping password for %s", account);
 
-	if (randombytes(salt, sizeof(salt)) == NULL) {
-		log_fatal(SS_INT, "randombytes() for %zu bytes failed",
-				sizeof(salt));
-		return;
-	}
-	hash_request(account, NULL, password, salt, 0,
-			theirarg, theircallback, db_change_password_cb);
-	crypto_wipe(salt, sizeof(salt));
+	ps->theircallback = theircallback;
+	ps->theirarg = theirarg;
+	ps->requester = user_handle(requester);
+	if (strlen(account) >= sizeof(ps->account))
+		log_fatal(SS_SQL, "oversized account name passed");
+	strcpy(ps->account, account);
+	/* is_valid_password() in commands.c did the length check */
+	memcpy(ps->password, newpassword, strlen(newpassword));
+	ps->speculative = (hasher_parallelism() >= 2);
+	ps->pending = 2;
+
+	/* Either half may come back right away, e.g. turned away with
+	 * DBE_BUSY; ps lives until both have.
+	 */
+	if (ps->speculative)
+		swap_hash(ps, requester);
+	check_auth(account, oldpassword, requester, HC_AUTH, false,
+			swap_checked, ps);
 }
 
-enum DBError db_get_account_by_email(const char *email,
-		char account[static ACCOUNT_LEN])
+static void
+account_by_email_run(struct DBJob *job)
 {
 	sqlite3_stmt *s;
 	int sqlite_ret;
 
-	prepare("SELECT name FROM accounts WHERE "
-			"LOWER(email) = LOWER(?) AND "
-			"expires = 0 LIMIT 1", &s);
-	sqlite3_bind_text(s, 1, email, (int)strlen(email), SQLITE_STATIC);
-
-	log_debug(SS_SQL, "selecting account name for e-mail %s", email);
+	s = query(Q_ACCOUNT_BY_EMAIL);
+	bind_key(s, 1, job->email, false);
 
 	sqlite_ret = sqlite3_step(s);
 	if (sqlite_ret == SQLITE_DONE) {
-		sqlite3_finalize(s);
-		return DBE_NO_SUCH_ACCOUNT;
+		job->dbe = DBE_NO_SUCH_ACCOUNT;
 	} else if (sqlite_ret != SQLITE_ROW) {
 		log_error(SS_SQL, "unable to SELECT: %s",
 				sqlite3_errstr(sqlite_ret));
-		sqlite3_finalize(s);
-		return DBE_SQLITE;
+		job->dbe = DBE_SQLITE;
+	} else {
+		snprintf(job->account, sizeof(job->account), "%s",
+				(const char *)sqlite3_column_text(s, 0));
 	}
 
-	strcpy(account, (const char *)sqlite3_column_text(s, 0));
-	sqlite3_finalize(s);
-	return DBE_OK;
+	query_done(s);
+}
+
+/* The callback gets the account and the e-mail address as given. */
+void
+db_get_account_by_email(const char *email,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			const char *email,
+			void *arg),
+		void *theirarg)
+{
+	struct AccountEntry *e;
+	struct DBJob *job;
+	char account[ACCOUNT_LEN + 1];
+
+	if ((e = index_find_email(email)) != NULL) {
+		strcpy(account, e->name);
+		theircallback(DBE_OK, account, email, theirarg);
+		return;
+	} else if (index_loaded || strlen(email) > EMAIL_LEN) {
+		theircallback(DBE_NO_SUCH_ACCOUNT, "", email, theirarg);
+		return;
+	}
+
+	log_debug(SS_SQL, "selecting account name for e-mail %s", email);
+
+	job = db_job(account_by_email_run, lookup_done);
+	strcpy(job->email, email);
+	job->lookupcallback = theircallback;
+	job->theirarg = theirarg;
+	db_submit(job);
 }
 
-enum DBError db_get_email_by_account(const char *account,
-		char email[static EMAIL_LEN])
+static void
+email_by_account_run(struct DBJob *job)
 {
 	sqlite3_stmt *s;
 	int sqlite_ret;
 
-	prepare("SELECT email FROM accounts WHERE "
-			"LOWER(name) = LOWER(?) "
-			"AND expires = 0 LIMIT 1", &s);
-	sqlite3_bind_text(s, 1, account, (int)strlen(account), SQLITE_STATIC);
-
-	log_debug(SS_SQL, "selecting e-mail for account %s", account);
+	s = query(Q_EMAIL_BY_ACCOUNT);
+	bind_key(s, 1, job->account, true);
 
 	sqlite_ret = sqlite3_step(s);
 	if (sqlite_ret == SQLITE_DONE) {
-		sqlite3_finalize(s);
-		return DBE_NO_SUCH_ACCOUNT;
+		job->dbe = DBE_NO_SUCH_ACCOUNT;
 	} else if (sqlite_ret != SQLITE_ROW) {
 		log_error(SS_SQL, "unable to SELECT: %s",
 				sqlite3_errstr(sqlite_ret));
-		sqlite3_finalize(s);
-		return DBE_SQLITE;
+		job->dbe = DBE_SQLITE;
+	} else {
+		snprintf(job->email, sizeof(job->email), "%s",
+				(const char *)sqlite3_column_text(s, 0));
 	}
 
-	strcpy(email, (const char *)sqlite3_column_text(s, 0));
-	sqlite3_finalize(s);
-	return DBE_OK;
+	query_done(s);
 }
 
+/* The callback gets the account as given and its e-mail address. */
 void
-db_purge_expired(void)
+db_get_email_by_account(const char *account,
+		void (*theircallback)(enum DBError dbe,
+			const char *account,
+			const char *email,
+			void *arg),
+		void *theirarg)
+{
+	struct AccountEntry *e;
+	struct DBJob *job;
+	char email[EMAIL_LEN + 1];
+
+	if ((e = index_find(account)) != NULL) {
+		strcpy(email, e->email);
+		theircallback(DBE_OK, account, email, theirarg);
+		return;
+	} else if (index_loaded || strlen(account) > ACCOUNT_LEN) {
+		theircallback(DBE_NO_SUCH_ACCOUNT, account, "", theirarg);
+		return;
+	}
+
+	log_debug(SS_SQL, "selecting e-mail for account %s", account);
+
+	job = db_job(email_by_account_run, lookup_done);
+	strcpy(job->account, account);
+	job->lookupcallback = theircallback;
+	job->theirarg = theirarg;
+	db_submit(job);
+}
+
+static void
+purge_expired_run(struct DBJob *job)
 {
 	sqlite3_stmt *s;
-	int64_t now = time(NULL);
 	int sqlite_ret;
 
-	prepare("DELETE FROM accounts WHERE expires < ? AND expires != 0", &s);
-	sqlite3_bind_int64(s, 1, (int64_t)now);
-
-	log_debug(SS_SQL, "purging accounts where expires < %llu "
-			"&& expires != 0", (unsigned long long)now);
+	s = query(Q_PURGE_EXPIRED);
+	sqlite3_bind_int64(s, 1, (int64_t)job->ts);
 
 	if ((sqlite_ret = sqlite3_step(s)) != SQLITE_DONE) {
 		log_error(SS_SQL, "unable to DELETE: %s",
 				sqlite3_errstr(sqlite_ret));
 	}
 
-	sqlite3_finalize(s);
+	query_done(s);
+}
+
+/* Only ever unconfirmed accounts, which the account index does not have */
+void
+db_purge_expired(void)
+{
+	struct DBJob *job = db_job(purge_expired_run, NULL);
+
+	job->ts = time(NULL);
+	log_debug(SS_SQL, "purging accounts where expires < %llu "
+			"&& expires != 0", (unsigned long long)job->ts);
+	db_submit(job);
+}
+
+/* Whether db_checkpoint() is to be called every database:checkpoint_interval */
+bool
+db_checkpoints(void)
+{
+	return checkpoints;
+}
+
+static void
+checkpoint_run(struct DBJob *job)
+{
+	int wal_frames, copied;
+	int sqlite_ret;
+
+	(void)job;
+
+	if ((sqlite_ret = sqlite3_wal_checkpoint_v2(db, NULL,
+					SQLITE_CHECKPOINT_PASSIVE,
+					&wal_frames, &copied)) != SQLITE_OK) {
+		log_warn(SS_SQL, "unable to checkpoint: %s",
+				sqlite3_errstr(sqlite_ret));
+		return;
+	}
+	if (wal_frames > 0)
+		log_debug(SS_SQL, "checkpointed %d of %d WAL frame(s)",
+				copied, wal_frames);
+}
+
+/*
+ * Copies what it can from lm.db-wal back into lm.db without waiting for
+ * anything, so that lm.db-wal does not grow forever.
+ */
+void
+db_checkpoint(void)
+{
+	if (checkpoints)
+		db_submit(db_job(checkpoint_run, NULL));
 }
 
 void
 db_fini(void)
 {
+	if (verify_cache != NULL) {
+		crypto_wipe(verify_cache, verify_cache_sets
+				* VERIFY_CACHE_WAYS * sizeof(*verify_cache));
+		free(verify_cache);
+		verify_cache = NULL;
+	}
+	crypto_wipe(verify_cache_key, sizeof(verify_cache_key));
+	index_fini();
+	crypto_wipe(index_key, sizeof(index_key));
+	for (size_t i = 0; i < Q_COUNT; ++i) {
+		sqlite3_finalize(queries[i].stmt);
+		queries[i].stmt = NULL;
+	}
 	sqlite3_close(db);
 	log_info(SS_SQL, "database lm.db closed");
 }
@@ -13,6 +13,7 @@
 #ifndef LM_DB_H
 #define LM_DB_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "entities.h"
@@ -34,25 +35,115 @@ enum DBError {
 	DBE_NO_SUCH_ACCOUNT,
 	DBE_ACCOUNT_IN_USE,
 	DBE_CRYPTO,
-	DBE_BUSY
+	DBE_BUSY,
+	/* The user the request was for is gone; only clean up. */
+	DBE_CANCELLED
 };
 
-enum DBError db_create_account(const struct User *u, const char *name,
-		const char *email);
-enum DBError db_confirm_account(const char *account);
+/* What a hash is for; see hash_dispatch() in db.c for how they are weighed. */
+enum HashClass {
+	/* AUTH, and the old password of NEWPASS */
+	HC_AUTH,
+	/* Setting a password: CONFIRM, NEWPASS, RESETPASS */
+	HC_ACCOUNT,
+	/* Anything an IRC operator asks for */
+	HC_OPER,
+	/* Bringing an account up to the current parameters */
+	HC_REHASH,
+	HC_COUNT
+};
+
+struct HashClassStats {
+	const char *name;
+	unsigned long weight;
+	size_t waiting;
+	/* Requests handed to a hasher */
+	uint64_t served;
+	/* Requests answered with DBE_BUSY */
+	uint64_t busy;
+	/* Time served requests spent waiting */
+	uint64_t wait_ms_total;
+	uint64_t wait_ms_max;
+};
+
+struct VerifyCacheStats {
+	size_t entries;
+	size_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+	uint64_t evictions;
+};
+
+struct AccountIndexStats {
+	bool enabled;
+	bool loaded;
+	size_t accounts;
+	/* the accounts themselves, and the hash tables on top */
+	size_t bytes;
+	size_t bucket_bytes;
+};
+
+struct QueryStats {
+	const char *name;
+	/* Times the statement was run */
+	uint64_t executions;
+};
+
+struct DBThreadStats {
+	bool running;
+	/* Jobs handed to the database thread and not answered yet */
+	size_t waiting;
+	uint64_t jobs;
+	/* Time jobs spent in sqlite on the database thread, which the event
+	 * loop would have spent there before
+	 */
+	uint64_t busy_us_total;
+	uint64_t busy_us_max;
+};
+
+struct event_base;
+
+void db_create_account(const char *name, const char *email,
+		void (*theircallback)(enum DBError dbe, const char *account, const char *email, void *arg),
+		void *theirarg);
 void db_check_auth(const char *account, char *password,
+		const struct User *owner, enum HashClass cls,
 		void (*theircallback)(enum DBError dbe, const char *account, time_t ts, void *arg),
 		void *theirarg);
-void db_hash_response(uint8_t *theirhash);
+void db_hash_response(uint32_t id, uint8_t *theirhash);
+void db_hash_failed(uint32_t id, enum DBError dbe);
+void db_hash_failed_all(enum DBError dbe);
+void db_hash_dispatch(void);
+size_t db_hash_queue_length(void);
+void db_hash_class_stats(struct HashClassStats stats[static HC_COUNT]);
+void db_verify_cache_stats(struct VerifyCacheStats *vcs);
+size_t db_query_stats(struct QueryStats *stats, size_t n);
+void db_thread_stats(struct DBThreadStats *dts);
+void db_account_index_stats(struct AccountIndexStats *ais);
+void db_cancel_orphans(void);
+void db_expire_hash_requests(void);
 void db_change_password(const char *account, const char *password,
+		const struct User *requester,
 		void (*theircallback)(enum DBError dbe, const char *account, time_t ts, void *arg),
 		void *theirarg);
-enum DBError db_get_account_by_email(const char *email,
-		char account[static ACCOUNT_LEN]);
-enum DBError db_get_email_by_account(const char *account,
-		char email[static EMAIL_LEN]);
+void db_swap_password(const char *account, char *oldpassword,
+		const char *newpassword, const struct User *requester,
+		void (*theircallback)(enum DBError dbe, const char *account, time_t ts, void *arg),
+		void *theirarg);
+void db_get_account_by_email(const char *email,
+		void (*theircallback)(enum DBError dbe, const char *account, const char *email, void *arg),
+		void *theirarg);
+void db_get_email_by_account(const char *account,
+		void (*theircallback)(enum DBError dbe, const char *account, const char *email, void *arg),
+		void *theirarg);
 void db_purge_expired(void);
+bool db_checkpoints(void);
+void db_checkpoint(void);
 int db_init(void);
+int db_start(struct event_base *base);
+void db_stop(void);
+void db_post_exit(void);
 void db_fini(void);
 
 #endif
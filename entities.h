@@ -14,6 +14,8 @@
 #define LM_ENTITIES_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* These can be controlled on the ircd via CFLAGS=-DTHINGLEN=..., but we'll
  * assume that nobody does that.
@@ -26,6 +28,8 @@
 #define ACCOUNT_LEN	(12)
 
 struct User {
+	/* Never 0 for a registered user; see struct UserHandle. */
+	uint32_t generation;
 	unsigned long uid;
 	unsigned int sid;
 	char nick[NICK_LEN + 1];
@@ -37,6 +41,17 @@ struct User {
 	bool is_oper;
 };
 
+/* A reference to a user that may be held across a QUIT or SQUIT, e.g. while
+ * a hasher works on the user's password.
+ * The slot a user had is reused for the next user with the same numeric, so
+ * user_from_handle() in numnick.c also compares the generation.
+ */
+struct UserHandle {
+	unsigned int sid;
+	unsigned long uid;
+	uint32_t generation;
+};
+
 static inline bool
 user_authed(const struct User *u)
 {
@@ -56,6 +71,8 @@ struct Server {
 	 * This is an array.
 	 */
 	struct User *users;
+	/* Number of entries in users */
+	size_t nusers;
 	/* Server that introduced this server. */
 	struct Server *uplink;
 	/* Name of the server.
@@ -0,0 +1,1604 @@
+/*
+ * Written in 2017, 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * The hasher is a pool of workers doing nothing but argon2.
+ * There are three engines:
+ *
+ * - fork: forked processes, each sharing a pair of rings with the main
+ *   process (see below).  This is the default because it plays well with
+ *   pledge(2).
+ * - thread: threads inside the main process.  Requests and results are passed
+ *   through lock-free queues and completions are signalled to the event loop
+ *   with a doorbell (see util.c).
+ * - daemon: lm-hasherd (see hasherd.c), which may serve other services as
+ *   well, over a UNIX socket; hasher:workers is how many requests LM keeps
+ *   outstanding there.
+ *
+ * Every fork worker has two single-producer/single-consumer rings in memory
+ * mapped before the fork (see shmring.c): requests (struct RingRequest) from
+ * the main process and results (struct RingResult) from the worker.
+ * The worker hashes straight out of the request slots into the result slots,
+ * so neither passwords nor hashes pass through the kernel; only the doorbells
+ * (see util.c) that wake up the other side do.  Slots are wiped as they are
+ * released.
+ *
+ * The hash itself is computed by argon2.c, which picks a SIMD kernel for the
+ * CPU at startup.
+ * Hashes with more than one lane run their lanes on threads of their own, so
+ * a single hash may keep several cores busy.
+ * The argon2 parameters travel with every request because accounts keep the
+ * ones they were hashed with; new hashes use hasher_params(), which is either
+ * configured or calibrated at startup.
+ *
+ * With hasher:memory_budget, the fork engine starts as many workers as the
+ * budget has room for, all at startup: forking later would happen with the
+ * database thread running, and after pledge(2) has taken "proc" away on
+ * OpenBSD.  Workers beyond hasher:workers are parked, and only given requests
+ * while requests are waiting; they are parked again after hasher:idle_timeout
+ * without any.  Parked workers map their work areas only once they get their
+ * first request, and all workers give them back to the OS when idle for
+ * hasher:idle_timeout, so that the budget is a limit rather than a pool; lm.c
+ * refuses a budget with hasher:lock or without an idle timeout for that
+ * reason.
+ *
+ * The request ID is chosen by db.c; workers echo it back so that responses
+ * can complete out of order across workers.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hasher.h"
+#include "argon2.h"
+#include "db.h"
+#include "hasherd.h"
+#include "lfqueue.h"
+#include "lm.h"
+#include "logging.h"
+#include "monocypher.h"
+#include "shmring.h"
+#include "stats.h"
+#include "util.h"
+
+/* Requests a single worker may have outstanding at any one time; this is
+ * hasher:interleave, as a worker hashes up to that many requests at once.
+ * Anything beyond that waits in db.c, where it can still be reordered.
+ */
+#define WORKER_DEPTH	(config.hasher.interleave)
+
+/* For poll(2); hasher:idle_timeout 0 means never */
+#define IDLE_TIMEOUT_MS	(config.hasher.idle_timeout == 0 ? -1 \
+		: (int)config.hasher.idle_timeout * 1000)
+
+/* Rounded up from HASHER_MAX_WORKERS * ARGON2_MAX_WAYS for lfqueue_init(). */
+#define QUEUE_SIZE	(256)
+
+/* Work areas are mapped in whole (2 MB) huge pages. */
+#define HUGE_PAGE_SIZE	((size_t)2 << 20)
+#define WORK_AREA_SIZE(memory)	(((size_t)(memory) * 1024 \
+			+ HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+
+/* Work area memory a worker needs, for hasher:memory_budget */
+#define WORKER_FOOTPRINT	((size_t)WORKER_DEPTH \
+		* WORK_AREA_SIZE(params.memory))
+
+/* Hashes per interleave width in hasher_benchmark() */
+#define BENCHMARK_HASHES	(8)
+
+enum HasherEngine {
+	HE_FORK,
+	HE_THREAD,
+	HE_DAEMON
+};
+
+/* How a work area is backed, best first */
+enum WorkAreaMode {
+	WAM_HUGETLB,
+	WAM_THP,
+	WAM_SMALL
+};
+
+struct WorkArea {
+	void *p;
+	size_t size;
+};
+
+/* Fork worker slots; a parked worker gets no requests */
+enum WorkerState {
+	WS_FREE,
+	WS_RUNNING,
+	WS_PARKED
+};
+
+struct RingRequest {
+	uint32_t id;
+	uint8_t pwlen;
+	uint8_t password[PASSWORD_LEN];
+	uint8_t salt[SALT_LEN];
+	struct HashParams params;
+};
+
+struct RingResult {
+	uint32_t id;
+	uint32_t compute_us;
+	uint8_t hash[HASH_LEN];
+};
+
+struct HasherWorker {
+	struct ShmRing *requests;
+	struct ShmRing *results;
+	/* main process -> worker, worker -> main process */
+	int request_bell[2];
+	int result_bell[2];
+	struct event *ev;
+	pid_t pid;
+	unsigned int inflight;
+	enum WorkerState state;
+	/* when inflight last dropped to 0 */
+	time_t idle_since;
+};
+
+struct ThreadJob {
+	struct ThreadJob *next_free;
+	uint32_t id;
+	uint8_t pwlen;
+	uint8_t password[PASSWORD_LEN];
+	uint8_t salt[SALT_LEN];
+	struct HashParams params;
+	uint8_t hash[HASH_LEN];
+	uint32_t compute_us;
+};
+
+static enum HasherEngine engine;
+/* Parameters for new hashes */
+static struct HashParams params;
+
+/* fork engine */
+static struct event_base *hasher_base;
+/* Slots up to the last one in use; free ones may be in between. */
+static struct HasherWorker workers[HASHER_MAX_WORKERS];
+static size_t nworkers;
+static struct event *sigchld_ev;
+static struct event *idle_ev;
+
+/* thread engine */
+static pthread_t threads[HASHER_MAX_WORKERS];
+static size_t nthreads;
+static struct ThreadJob jobs[QUEUE_SIZE];
+static struct ThreadJob *free_jobs;
+static unsigned int threads_inflight;
+static struct LFQueue request_queue;
+static struct LFQueue result_queue;
+static sem_t request_sem;
+static atomic_bool threads_stopping;
+static int doorbell[2] = {-1, -1};
+static struct event *doorbell_ev;
+
+/* daemon engine; daemon_bev is NULL while reconnecting */
+static struct bufferevent *daemon_bev;
+static unsigned int daemon_inflight;
+static struct event *daemon_retry_ev;
+/* Seconds until the next attempt to reconnect, doubled after each */
+static time_t daemon_backoff;
+
+#define DAEMON_BACKOFF_MAX	(60)
+
+static void
+store32_le(uint8_t out[4], uint32_t in)
+{
+	out[0] =  in        & 0xff;
+	out[1] = (in >>  8) & 0xff;
+	out[2] = (in >> 16) & 0xff;
+	out[3] = (in >> 24) & 0xff;
+}
+
+static uint32_t
+load32_le(const uint8_t s[4])
+{
+	return (uint32_t)s[0]
+		| ((uint32_t)s[1] <<  8)
+		| ((uint32_t)s[2] << 16)
+		| ((uint32_t)s[3] << 24);
+}
+
+bool
+hasher_params_valid(const struct HashParams *hp)
+{
+	return ((hp->algorithm == PA_ARGON2I
+				|| hp->algorithm == PA_ARGON2ID)
+			&& hp->memory >= HASHER_MIN_MEMORY
+			&& hp->memory <= HASHER_MAX_MEMORY
+			&& hp->passes >= 1
+			&& hp->passes <= HASHER_MAX_PASSES
+			&& hp->lanes >= 1
+			&& hp->lanes <= ARGON2_MAX_LANES
+			&& hp->memory >= 8 * hp->lanes);
+}
+
+bool
+hasher_params_equal(const struct HashParams *a, const struct HashParams *b)
+{
+	return (a->algorithm == b->algorithm
+			&& a->memory == b->memory
+			&& a->passes == b->passes
+			&& a->lanes == b->lanes);
+}
+
+static const char *
+algorithm_name(enum PasswordAlgorithm algorithm)
+{
+	return (algorithm == PA_ARGON2ID ? "argon2id" : "argon2i");
+}
+
+static void
+set_input(struct Argon2Input *in, uint8_t hash[HASH_LEN],
+		const uint8_t *password, uint8_t pwlen, const uint8_t *salt)
+{
+	in->hash = hash;
+	in->work_area = NULL;
+	in->password = password;
+	in->password_size = pwlen;
+	in->salt = salt;
+	in->salt_size = SALT_LEN;
+}
+
+static const char *
+work_area_mode_name(enum WorkAreaMode mode)
+{
+	switch (mode) {
+	case WAM_HUGETLB:
+		return "hugetlb pages";
+	case WAM_THP:
+		return "transparent huge pages";
+	case WAM_SMALL:
+		return "small pages";
+	}
+
+	return "?";
+}
+
+/*
+ * Maps a work area, preferably backed by huge pages to spare the TLB, and
+ * faults it in right away rather than during the first hash.
+ */
+static void *
+map_work_area(size_t size, enum WorkAreaMode *mode)
+{
+	void *p;
+
+#if defined(MAP_HUGETLB) && defined(MAP_POPULATE)
+	if (config.hasher.hugepages) {
+		/* Fails unless enough huge pages are reserved. */
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+				| MAP_POPULATE, -1, 0);
+		if (p != MAP_FAILED) {
+			*mode = WAM_HUGETLB;
+			return p;
+		}
+	}
+#endif
+
+	if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+			== MAP_FAILED)
+		oom();
+	*mode = WAM_SMALL;
+#ifdef MADV_HUGEPAGE
+	/* Must come before the pages are faulted in to have any effect. */
+	if (config.hasher.hugepages
+			&& madvise(p, size, MADV_HUGEPAGE) == 0)
+		*mode = WAM_THP;
+#endif
+	memset(p, 0, size);
+
+	return p;
+}
+
+static bool
+lock_work_area(struct WorkArea *wa)
+{
+	if (!config.hasher.lock)
+		return false;
+	if (mlock(wa->p, wa->size) != 0) {
+		log_warn(SS_INT, "unable to lock hasher work area: %s",
+				strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static struct WorkArea *
+alloc_work_areas(size_t n, uint32_t memory)
+{
+	struct WorkArea *work_areas = smalloc(n * sizeof(*work_areas));
+	enum WorkAreaMode mode, worst = WAM_HUGETLB;
+	bool locked = config.hasher.lock;
+
+	for (size_t i = 0; i < n; ++i) {
+		work_areas[i].size = WORK_AREA_SIZE(memory);
+		work_areas[i].p = map_work_area(work_areas[i].size, &mode);
+		if (mode > worst)
+			worst = mode;
+		if (!lock_work_area(&work_areas[i]))
+			locked = false;
+	}
+	log_info(SS_INT, "hasher work areas: %zu x %zu MB in %s%s",
+			n, WORK_AREA_SIZE(memory) >> 20,
+			work_area_mode_name(worst), locked ? ", locked" : "");
+
+	return work_areas;
+}
+
+/*
+ * Maps a work area for a single hash that needs more memory than wa has, as
+ * accounts hashed with more memory than is now configured do; unmapped again
+ * right after the hash, so that a worker does not keep the most memory it
+ * has ever needed.
+ * Sets tmp->p to NULL if wa is large enough.
+ */
+static void
+map_oversized_work_area(struct WorkArea *tmp, const struct WorkArea *wa,
+		uint32_t memory)
+{
+	enum WorkAreaMode mode;
+
+	tmp->size = WORK_AREA_SIZE(memory);
+	if (tmp->size <= wa->size) {
+		tmp->p = NULL;
+		return;
+	}
+
+	tmp->p = map_work_area(tmp->size, &mode);
+	(void)lock_work_area(tmp);
+	log_debug(SS_INT, "mapped a %zu MB work area for one hash in %s",
+			tmp->size >> 20, work_area_mode_name(mode));
+}
+
+/*
+ * Gives the pages of idle work areas back to the OS; they are faulted in
+ * again, zeroed, by the next hash.  Locked work areas are kept.
+ */
+static void
+release_work_areas(struct WorkArea *work_areas, size_t n)
+{
+	if (config.hasher.lock)
+		return;
+
+	for (size_t i = 0; i < n; ++i)
+		(void)madvise(work_areas[i].p, work_areas[i].size,
+				MADV_DONTNEED);
+	log_debug(SS_INT, "hasher idle, released its work areas");
+}
+
+static void
+free_work_areas(struct WorkArea *work_areas, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		(void)munmap(work_areas[i].p, work_areas[i].size);
+	free(work_areas);
+}
+
+/*
+ * Hashes n requests at once; see argon2i_multi().
+ * Only single-lane argon2i requests with the same parameters can be
+ * interleaved, so runs of those are hashed together; anything else is hashed
+ * on its own, its lanes in parallel.
+ * compute_us, unless NULL, gets how long every hash took in microseconds.
+ */
+static void
+compute(struct Argon2Input *in, const struct HashParams *hp,
+		struct WorkArea *work_areas, size_t n, uint32_t *compute_us)
+{
+	struct WorkArea oversized[ARGON2_MAX_WAYS];
+	struct timespec t;
+	uint64_t us;
+	size_t start, end;
+
+	for (size_t i = 0; i < n; ++i) {
+		map_oversized_work_area(&oversized[i], &work_areas[i],
+				hp[i].memory);
+		in[i].work_area = (oversized[i].p != NULL)
+			? oversized[i].p : work_areas[i].p;
+	}
+
+	for (start = 0; start < n; start = end) {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		if (hp[start].algorithm != PA_ARGON2I
+				|| hp[start].lanes != 1) {
+			end = start + 1;
+			argon2(hp[start].algorithm == PA_ARGON2ID
+					? ARGON2_ID : ARGON2_I,
+					in[start].hash, HASH_LEN,
+					in[start].work_area,
+					hp[start].memory, hp[start].passes,
+					hp[start].lanes,
+					in[start].password,
+					in[start].password_size,
+					in[start].salt, in[start].salt_size,
+					NULL, 0, NULL, 0);
+		} else {
+			for (end = start + 1; end < n
+					&& hasher_params_equal(&hp[start],
+						&hp[end]); ++end)
+				;
+			argon2i_multi(in + start, end - start, HASH_LEN,
+					hp[start].memory, hp[start].passes);
+		}
+
+		/* Interleaved hashes all take as long as the lot. */
+		us = stats_elapsed_us(&t);
+		for (size_t i = start; compute_us != NULL && i < end; ++i)
+			compute_us[i] = (us > UINT32_MAX)
+				? UINT32_MAX : (uint32_t)us;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (oversized[i].p != NULL)
+			(void)munmap(oversized[i].p, oversized[i].size);
+	}
+}
+
+/* Drops what a new worker inherited of the workers forked before it. */
+static void
+detach_workers(const struct HasherWorker *self)
+{
+	for (size_t i = 0; i < nworkers; ++i) {
+		struct HasherWorker *w = &workers[i];
+
+		if (w == self || w->state == WS_FREE)
+			continue;
+		shmring_detach(w->requests);
+		shmring_detach(w->results);
+		doorbell_close(w->request_bell);
+		doorbell_close(w->result_bell);
+	}
+}
+
+static void
+hasher(struct HasherWorker *w, bool parked)
+{
+	/* A parked worker takes its memory only once it is put to use. */
+	struct WorkArea *work_areas = parked ? NULL
+		: alloc_work_areas(WORKER_DEPTH, params.memory);
+	struct RingRequest *req[ARGON2_MAX_WAYS];
+	struct RingResult *res[ARGON2_MAX_WAYS];
+	struct Argon2Input in[ARGON2_MAX_WAYS];
+	struct HashParams hp[ARGON2_MAX_WAYS];
+	uint32_t compute_us[ARGON2_MAX_WAYS];
+	struct pollfd pfd;
+	bool idle = false;
+	size_t n;
+
+#ifdef HAS_OPENBSD
+	setproctitle("hasher");
+#endif
+#ifdef HAS_OPENBSD
+	if (pledge("stdio", "") != 0)
+		exit(1);
+#endif
+
+	pfd.fd = w->request_bell[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* take whatever is queued, up to what we hash at once */
+		for (n = 0; n < WORKER_DEPTH
+				&& (req[n] = shmring_read_slot(w->requests, n))
+				!= NULL; ++n)
+			;
+
+		if (n == 0) {
+			if (shmring_eof(w->requests))
+				break;
+			switch (poll(&pfd, 1, idle ? -1 : IDLE_TIMEOUT_MS)) {
+			case -1:
+				if (errno == EINTR)
+					break;
+				log_error(SS_INT, "unable to poll hasher "
+						"doorbell: %s",
+						strerror(errno));
+				exit(1);
+			case 0:
+				if (work_areas != NULL)
+					release_work_areas(work_areas,
+							WORKER_DEPTH);
+				idle = true;
+				break;
+			}
+			doorbell_drain(pfd.fd);
+			continue;
+		}
+		idle = false;
+		if (work_areas == NULL)
+			work_areas = alloc_work_areas(WORKER_DEPTH,
+					params.memory);
+
+		/* Hash straight from the request slots into result slots. */
+		for (size_t i = 0; i < n; ++i) {
+			/* Cannot be full: the main process keeps at most
+			 * WORKER_DEPTH requests outstanding.
+			 */
+			if ((res[i] = shmring_write_slot(w->results, i))
+					== NULL) {
+				log_error(SS_INT, "hasher result ring full");
+				exit(1);
+			}
+			res[i]->id = req[i]->id;
+			set_input(&in[i], res[i]->hash, req[i]->password,
+					req[i]->pwlen, req[i]->salt);
+			hp[i] = req[i]->params;
+			if (!hasher_params_valid(&hp[i])) {
+				log_error(SS_INT, "bad argon2 parameters "
+						"in request");
+				exit(1);
+			}
+		}
+		compute(in, hp, work_areas, n, compute_us);
+		for (size_t i = 0; i < n; ++i)
+			res[i]->compute_us = compute_us[i];
+
+		/* wipes the passwords and salts */
+		shmring_release(w->requests, n);
+		shmring_commit(w->results, n);
+		doorbell_ring(w->result_bell[1]);
+		log_debug(SS_INT, "sent %zu hash(es)", n);
+	}
+
+	if (work_areas != NULL)
+		free_work_areas(work_areas, WORKER_DEPTH);
+	exit(0);
+}
+
+static void
+hasher_result_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	struct HasherWorker *w = arg;
+	struct RingResult *res;
+
+	doorbell_drain(fd);
+	while ((res = shmring_read_slot(w->results, 0)) != NULL) {
+		log_debug(SS_INT, "got hash from hasher %d", (int)w->pid);
+		if (w->inflight == 0) {
+			log_fatal(SS_INT, "hasher %d sent unsolicited hash",
+					(int)w->pid);
+			return;
+		}
+		if (--w->inflight == 0)
+			w->idle_since = time(NULL);
+		stats_record(ST_COMPUTE, res->compute_us);
+		db_hash_response(res->id, res->hash);
+		/* wipes the hash */
+		shmring_release(w->results, 1);
+	}
+}
+
+static size_t
+count_workers(enum WorkerState state)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < nworkers; ++i) {
+		if (workers[i].state == state)
+			++n;
+	}
+
+	return n;
+}
+
+/* Frees what a worker that has exited (or never started) leaves behind. */
+static void
+clear_worker(struct HasherWorker *w)
+{
+	if (w->ev != NULL) {
+		event_free(w->ev);
+		w->ev = NULL;
+	}
+	shmring_free(w->requests);
+	shmring_free(w->results);
+	w->requests = w->results = NULL;
+	doorbell_close(w->request_bell);
+	doorbell_close(w->result_bell);
+	w->pid = 0;
+	w->inflight = 0;
+	w->state = WS_FREE;
+
+	while (nworkers > 0 && workers[nworkers - 1].state == WS_FREE)
+		--nworkers;
+}
+
+/*
+ * Hashers only ever exit because hasher_fini() told them to, which removes
+ * this event first.
+ */
+static void
+hasher_sigchld_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	int status;
+
+	for (size_t i = 0; i < nworkers; ++i) {
+		struct HasherWorker *w = &workers[i];
+
+		if (w->state == WS_FREE || w->pid == 0
+				|| waitpid(w->pid, &status, WNOHANG) != w->pid)
+			continue;
+		w->pid = 0;
+		log_fatal(SS_INT, "hasher died (status %d)", status);
+		return;
+	}
+}
+
+static int
+fork_worker(struct HasherWorker *w, bool parked)
+{
+	pid_t pid;
+
+	w->request_bell[0] = w->request_bell[1] = -1;
+	w->result_bell[0] = w->result_bell[1] = -1;
+	if ((w->requests = shmring_new(ARGON2_MAX_WAYS,
+					sizeof(struct RingRequest))) == NULL
+			|| (w->results = shmring_new(ARGON2_MAX_WAYS,
+					sizeof(struct RingResult))) == NULL
+			|| doorbell_open(w->request_bell) != 0
+			|| doorbell_open(w->result_bell) != 0) {
+		clear_worker(w);
+		return -1;
+	}
+
+	switch ((pid = fork())) {
+	case 0:
+		/* Don't keep the other workers' requests around. */
+		detach_workers(w);
+		hasher(w, parked);
+		break;
+	case -1:
+		log_error(SS_INT, "unable to fork: %s", strerror(errno));
+		clear_worker(w);
+		return -1;
+	default:
+		if ((w->ev = event_new(hasher_base, w->result_bell[0],
+						EV_READ | EV_PERSIST,
+						hasher_result_cb, w)) == NULL)
+			oom();
+		event_add(w->ev, NULL);
+		w->pid = pid;
+		w->inflight = 0;
+		w->idle_since = time(NULL);
+		w->state = parked ? WS_PARKED : WS_RUNNING;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts a worker in the first free slot, parked or ready to hash; returns it
+ * or NULL.
+ */
+static struct HasherWorker *
+spawn_worker(bool parked)
+{
+	size_t i;
+
+	for (i = 0; i < nworkers && workers[i].state != WS_FREE; ++i)
+		;
+	if (i == HASHER_MAX_WORKERS)
+		return NULL;
+	if (i == nworkers)
+		++nworkers;
+	if (fork_worker(&workers[i], parked) != 0)
+		return NULL;
+
+	return &workers[i];
+}
+
+/* The most workers hasher:memory_budget has room for */
+static size_t
+max_workers(void)
+{
+	size_t n;
+
+	if (config.hasher.memory_budget == 0)
+		return config.hasher.workers;
+
+	n = ((size_t)config.hasher.memory_budget << 20) / WORKER_FOOTPRINT;
+	if (n > HASHER_MAX_WORKERS)
+		n = HASHER_MAX_WORKERS;
+	return (n > config.hasher.workers ? n : config.hasher.workers);
+}
+
+/* Puts a parked worker to use for a request that would otherwise wait. */
+static struct HasherWorker *
+unpark_worker(void)
+{
+	for (size_t i = 0; i < nworkers; ++i) {
+		struct HasherWorker *w = &workers[i];
+
+		if (w->state != WS_PARKED)
+			continue;
+		w->state = WS_RUNNING;
+		w->idle_since = time(NULL);
+		log_info(SS_INT, "hasher %d back in use, %zu running",
+				(int)w->pid, count_workers(WS_RUNNING));
+		return w;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parks workers beyond hasher:workers that have been idle for
+ * hasher:idle_timeout; runs every hasher:idle_timeout, so a worker goes
+ * after between one and two of those.
+ * A parked worker gives its work areas back once it has been idle for
+ * hasher:idle_timeout itself.
+ */
+static void
+hasher_idle_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	time_t now = time(NULL);
+
+	for (size_t i = 0; i < nworkers
+			&& count_workers(WS_RUNNING) > config.hasher.workers;
+			++i) {
+		struct HasherWorker *w = &workers[i];
+
+		if (w->state == WS_RUNNING && w->inflight == 0
+				&& now - w->idle_since
+				>= (time_t)config.hasher.idle_timeout) {
+			log_debug(SS_INT, "parking idle hasher %d",
+					(int)w->pid);
+			w->state = WS_PARKED;
+		}
+	}
+}
+
+static void *
+hasher_thread(void *arg)
+{
+	struct WorkArea *work_areas = alloc_work_areas(WORKER_DEPTH,
+			params.memory);
+	struct ThreadJob *batch[ARGON2_MAX_WAYS];
+	struct Argon2Input in[ARGON2_MAX_WAYS];
+	struct HashParams hp[ARGON2_MAX_WAYS];
+	uint32_t compute_us[ARGON2_MAX_WAYS];
+	struct ThreadJob *job;
+	struct timespec deadline;
+	bool idle = false;
+	size_t n;
+
+	(void)arg;
+
+	for (;;) {
+		for (;;) {
+			if (idle || config.hasher.idle_timeout == 0) {
+				if (sem_wait(&request_sem) == 0)
+					break;
+				continue;
+			}
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += (time_t)config.hasher.idle_timeout;
+			if (sem_timedwait(&request_sem, &deadline) == 0)
+				break;
+			if (errno == ETIMEDOUT) {
+				release_work_areas(work_areas, WORKER_DEPTH);
+				idle = true;
+			}
+		}
+		idle = false;
+		if (atomic_load(&threads_stopping))
+			break;
+		/* The semaphore counts queued jobs, so there must be one. */
+		if ((job = lfqueue_pop(&request_queue)) == NULL)
+			continue;
+		batch[0] = job;
+		n = 1;
+		/* Take along whatever else is queued right now. */
+		while (n < WORKER_DEPTH && sem_trywait(&request_sem) == 0) {
+			if ((job = lfqueue_pop(&request_queue)) == NULL) {
+				/* A wakeup from stop_threads(); put it back. */
+				sem_post(&request_sem);
+				break;
+			}
+			batch[n++] = job;
+		}
+
+		for (size_t i = 0; i < n; ++i) {
+			job = batch[i];
+			set_input(&in[i], job->hash, job->password, job->pwlen,
+					job->salt);
+			hp[i] = job->params;
+		}
+		compute(in, hp, work_areas, n, compute_us);
+
+		for (size_t i = 0; i < n; ++i) {
+			job = batch[i];
+			job->compute_us = compute_us[i];
+			crypto_wipe(job->password, sizeof(job->password));
+			crypto_wipe(job->salt, sizeof(job->salt));
+			/* Cannot be full: there are no more jobs than cells. */
+			lfqueue_push(&result_queue, job);
+		}
+		doorbell_ring(doorbell[1]);
+	}
+
+	free_work_areas(work_areas, WORKER_DEPTH);
+	return NULL;
+}
+
+static void
+doorbell_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	struct ThreadJob *job;
+
+	doorbell_drain(fd);
+	while ((job = lfqueue_pop(&result_queue)) != NULL) {
+		log_debug(SS_INT, "got hash from hasher thread");
+		--threads_inflight;
+		stats_record(ST_COMPUTE, job->compute_us);
+		db_hash_response(job->id, job->hash);
+		crypto_wipe(job, sizeof(*job));
+		job->next_free = free_jobs;
+		free_jobs = job;
+	}
+}
+
+static int
+start_threads(struct event_base *base)
+{
+	int error;
+
+	for (size_t i = 0; i < QUEUE_SIZE; ++i) {
+		jobs[i].next_free = free_jobs;
+		free_jobs = &jobs[i];
+	}
+	lfqueue_init(&request_queue, QUEUE_SIZE);
+	lfqueue_init(&result_queue, QUEUE_SIZE);
+	if (sem_init(&request_sem, 0, 0) != 0) {
+		log_fatal(SS_INT, "unable to create semaphore: %s",
+				strerror(errno));
+		return -1;
+	}
+	atomic_init(&threads_stopping, false);
+
+	if (doorbell_open(doorbell) != 0)
+		return -1;
+	if ((doorbell_ev = event_new(base, doorbell[0], EV_READ | EV_PERSIST,
+					doorbell_cb, NULL)) == NULL)
+		oom();
+	event_add(doorbell_ev, NULL);
+
+	while (nthreads < config.hasher.workers) {
+		if ((error = pthread_create(&threads[nthreads], NULL,
+						hasher_thread, NULL)) != 0) {
+			log_fatal(SS_INT, "unable to create hasher thread: %s",
+					strerror(error));
+			return -1;
+		}
+		++nthreads;
+	}
+
+	return 0;
+}
+
+static void
+stop_threads(void)
+{
+	if (doorbell_ev == NULL)
+		return;
+
+	atomic_store(&threads_stopping, true);
+	for (size_t i = 0; i < nthreads; ++i)
+		sem_post(&request_sem);
+	log_info(SS_INT, "waiting on %zu hasher thread(s) to finish...",
+			nthreads);
+	for (size_t i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	nthreads = 0;
+
+	event_free(doorbell_ev);
+	doorbell_ev = NULL;
+	doorbell_close(doorbell);
+	sem_destroy(&request_sem);
+	lfqueue_fini(&request_queue);
+	lfqueue_fini(&result_queue);
+	crypto_wipe(jobs, sizeof(jobs));
+	free_jobs = NULL;
+	threads_inflight = 0;
+	log_info(SS_INT, "hasher threads finished");
+}
+
+static void
+daemon_read_cb(struct bufferevent *b, void *arg)
+{
+	struct evbuffer *in = bufferevent_get_input(b);
+	uint8_t frame[HASHERD_HEADER_LEN + HASHERD_HASHED_LEN];
+	size_t len;
+	uint32_t tag;
+
+	while (evbuffer_get_length(in) >= HASHERD_HEADER_LEN) {
+		evbuffer_copyout(in, frame, HASHERD_HEADER_LEN);
+		len = (size_t)(frame[2] | (frame[3] << 8));
+		tag = load32_le(frame + 4);
+
+		if (frame[0] != HASHERD_VERSION
+				|| (frame[1] == HF_HASHED
+					&& len != HASHERD_HASHED_LEN)
+				|| (frame[1] == HF_ERROR && len != 1)
+				|| (frame[1] != HF_HASHED
+					&& frame[1] != HF_ERROR)) {
+			log_fatal(SS_INT, "bad frame from lm-hasherd");
+			break;
+		}
+		if (evbuffer_get_length(in) < HASHERD_HEADER_LEN + len)
+			break;
+		evbuffer_remove(in, frame, HASHERD_HEADER_LEN + len);
+
+		if (daemon_inflight == 0) {
+			log_fatal(SS_INT, "lm-hasherd sent unsolicited reply");
+			break;
+		}
+		--daemon_inflight;
+
+		/* The daemon is shared, so it may well be full; and it
+		 * may allow less memory than accounts here were hashed with.
+		 */
+		if (frame[1] == HF_ERROR) {
+			log_warn(SS_INT, "lm-hasherd refused request %lu "
+					"(error %d)", (unsigned long)tag,
+					(int)frame[HASHERD_HEADER_LEN]);
+			db_hash_failed(tag,
+					frame[HASHERD_HEADER_LEN] == HDE_BUSY
+					? DBE_BUSY : DBE_CRYPTO);
+			continue;
+		}
+		stats_record(ST_COMPUTE, load32_le(frame + HASHERD_HEADER_LEN
+					+ HASH_LEN));
+		db_hash_response(tag, frame + HASHERD_HEADER_LEN);
+	}
+	/* Whatever way out, the last hash read must not stay behind. */
+	crypto_wipe(frame, sizeof(frame));
+}
+
+static void
+daemon_retry(void)
+{
+	struct timeval tv = {daemon_backoff, 0};
+
+	log_info(SS_INT, "reconnecting to lm-hasherd in %lld s",
+			(long long)daemon_backoff);
+	event_add(daemon_retry_ev, &tv);
+	if ((daemon_backoff *= 2) > DAEMON_BACKOFF_MAX)
+		daemon_backoff = DAEMON_BACKOFF_MAX;
+}
+
+/*
+ * lm-hasherd went away, most likely to be restarted: what it had is answered
+ * with DBE_BUSY, and new requests wait in the queue until it is back.
+ */
+static void
+daemon_event_cb(struct bufferevent *b, short revents, void *arg)
+{
+	if (revents & BEV_EVENT_ERROR) {
+		log_error(SS_INT, "socket error from lm-hasherd: %s",
+				evutil_socket_error_to_string(
+					EVUTIL_SOCKET_ERROR()));
+	} else if (revents & BEV_EVENT_EOF) {
+		log_error(SS_INT, "EOF received from lm-hasherd");
+	} else {
+		return;
+	}
+
+	bufferevent_free(daemon_bev);
+	daemon_bev = NULL;
+	daemon_inflight = 0;
+	db_hash_failed_all(DBE_BUSY);
+	daemon_retry();
+}
+
+static int
+connect_daemon(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	/* hasher:socket is shorter than sun_path. */
+	strcpy(sun.sun_path, config.hasher.socket);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_error(SS_INT, "unable to create socket: %s",
+				strerror(errno));
+		return -1;
+	}
+	/* Local, so blocking is fine; it either answers or refuses. */
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		log_error(SS_INT, "unable to connect to lm-hasherd at %s: %s",
+				config.hasher.socket, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	evutil_make_socket_nonblocking(fd);
+
+	if ((daemon_bev = bufferevent_socket_new(hasher_base, fd,
+					BEV_OPT_CLOSE_ON_FREE)) == NULL)
+		oom();
+	bufferevent_setcb(daemon_bev, daemon_read_cb, NULL, daemon_event_cb,
+			NULL);
+	bufferevent_enable(daemon_bev, EV_READ | EV_WRITE);
+
+	return 0;
+}
+
+static void
+daemon_retry_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	if (connect_daemon() != 0) {
+		daemon_retry();
+		return;
+	}
+
+	log_info(SS_INT, "reconnected to lm-hasherd");
+	daemon_backoff = 1;
+	db_hash_dispatch();
+}
+
+static void
+submit_daemon(uint32_t id, const char *password, const uint8_t *salt,
+		const struct HashParams *hp)
+{
+	uint8_t frame[HASHERD_HEADER_LEN + HASHERD_MAX_PAYLOAD];
+	uint8_t *p = frame + HASHERD_HEADER_LEN;
+	size_t pwlen = strlen(password);
+	size_t len = HASHERD_HASH_FIXED + pwlen;
+
+	frame[0] = HASHERD_VERSION;
+	frame[1] = HF_HASH;
+	frame[2] = len & 0xff;
+	frame[3] = (uint8_t)(len >> 8);
+	store32_le(frame + 4, id);
+	p[0] = (uint8_t)hp->algorithm;
+	p[1] = (uint8_t)hp->lanes;
+	store32_le(p + 2, hp->memory);
+	store32_le(p + 6, hp->passes);
+	memcpy(p + 10, salt, SALT_LEN);
+	memcpy(p + HASHERD_HASH_FIXED, password, pwlen);
+
+	/* caller wipes password and salt */
+
+	evbuffer_add(bufferevent_get_output(daemon_bev), frame,
+			HASHERD_HEADER_LEN + len);
+	++daemon_inflight;
+
+	crypto_wipe(frame, sizeof(frame));
+}
+
+static double
+elapsed_since(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - start->tv_sec)
+		+ (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns how long a single hash with the given parameters takes, in ms. */
+static double
+time_hash(struct WorkArea *wa, const struct HashParams *hp)
+{
+	static const uint8_t password[] = "calibration";
+	uint8_t salt[SALT_LEN] = {0};
+	uint8_t hash[HASH_LEN];
+	struct Argon2Input in;
+	struct timespec start;
+
+	set_input(&in, hash, password, sizeof(password) - 1, salt);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	compute(&in, hp, wa, 1, NULL);
+	return elapsed_since(&start) * 1000;
+}
+
+/*
+ * Picks the strongest parameters that meet both hasher:target_latency per
+ * hash and hasher:target_rate hashes per second over all hashers.
+ * hasher:memory is the most memory to use and hasher:passes the fewest
+ * passes to make; more passes are added while there is time left, memory is
+ * only given up if even the fewest passes take too long.
+ * The cost of a pass is taken to be linear in the memory.
+ */
+static void
+calibrate(void)
+{
+	struct WorkArea *wa = alloc_work_areas(1, config.hasher.memory);
+	struct HashParams probe = params;
+	double budget = (double)config.hasher.target_latency;
+	double pass_ms;
+	uint64_t memory;
+
+	probe.memory = (uint32_t)config.hasher.memory;
+	probe.passes = 1;
+
+	if (config.hasher.target_rate != 0) {
+		double rate_budget = 1000.0 * (double)config.hasher.workers
+			/ (double)config.hasher.target_rate;
+
+		if (rate_budget < budget)
+			budget = rate_budget;
+	}
+
+	/* Time the probe the way hashes with prepared parameters run; the
+	 * first run faults in the work area, so don't count it.
+	 */
+	if (probe.algorithm == PA_ARGON2I && probe.lanes == 1)
+		(void)argon2_prepare(probe.memory, probe.passes);
+	(void)time_hash(wa, &probe);
+	pass_ms = time_hash(wa, &probe);
+
+	if (pass_ms * config.hasher.passes <= budget) {
+		params.memory = config.hasher.memory;
+		params.passes = (uint32_t)(budget / pass_ms);
+		if (params.passes > HASHER_MAX_PASSES)
+			params.passes = HASHER_MAX_PASSES;
+	} else {
+		params.passes = (uint32_t)config.hasher.passes;
+		memory = (uint64_t)((double)config.hasher.memory * budget
+				/ (pass_ms * params.passes));
+		/* Whole MB where possible, just for tidiness */
+		if (memory >= 1024)
+			memory -= memory % 1024;
+		if (memory < 8 * params.lanes) {
+			log_warn(SS_INT, "cannot meet the hasher latency/rate "
+					"targets on this host");
+			memory = 8 * params.lanes;
+		}
+		params.memory = (uint32_t)memory;
+	}
+
+	if (params.algorithm == PA_ARGON2I && params.lanes == 1)
+		(void)argon2_prepare(params.memory, params.passes);
+	log_info(SS_INT, "calibrated %s to %" PRIu32 " KiB, %" PRIu32
+			" passes: %.0f ms per hash (target %.0f ms)",
+			algorithm_name(params.algorithm),
+			params.memory, params.passes,
+			time_hash(wa, &params), budget);
+	free_work_areas(wa, 1);
+}
+
+/* Chooses the kernel and the parameters for new hashes. */
+static int
+setup(void)
+{
+	/* Before any worker exists so that forked workers inherit the choice. */
+	if (argon2_init(config.hasher.kernel) != 0)
+		return -1;
+
+	params.algorithm = strcmp(config.hasher.algorithm, "argon2id")
+		? PA_ARGON2I : PA_ARGON2ID;
+	params.lanes = (uint32_t)config.hasher.lanes;
+	if (config.hasher.calibrate) {
+		calibrate();
+	} else {
+		params.memory = (uint32_t)config.hasher.memory;
+		params.passes = (uint32_t)config.hasher.passes;
+	}
+
+	/* Only single-lane argon2i has an index schedule to compute. */
+	if (params.algorithm == PA_ARGON2I && params.lanes == 1
+			&& argon2_prepare(params.memory, params.passes) != 0)
+		return -1;
+	log_info(SS_INT, "new hashes use %s with %" PRIu32 " KiB, %"
+			PRIu32 " passes, %" PRIu32 " lane(s)",
+			algorithm_name(params.algorithm),
+			params.memory, params.passes, params.lanes);
+	return 0;
+}
+
+int
+hasher_init(struct event_base *base)
+{
+	if (setup() != 0)
+		return -1;
+
+	if (!strcmp(config.hasher.engine, "thread")) {
+		engine = HE_THREAD;
+		if (start_threads(base) != 0)
+			return -1;
+		log_info(SS_INT, "started %zu hasher thread(s)", nthreads);
+		return 0;
+	}
+
+	if (!strcmp(config.hasher.engine, "daemon")) {
+		engine = HE_DAEMON;
+		hasher_base = base;
+		if ((daemon_retry_ev = evtimer_new(base, daemon_retry_cb,
+						NULL)) == NULL)
+			oom();
+		daemon_backoff = 1;
+		if (connect_daemon() != 0)
+			return -1;
+		log_info(SS_INT, "using lm-hasherd at %s",
+				config.hasher.socket);
+		return 0;
+	}
+
+	engine = HE_FORK;
+	hasher_base = base;
+	if ((sigchld_ev = evsignal_new(base, SIGCHLD, hasher_sigchld_cb,
+					NULL)) == NULL)
+		oom();
+	event_add(sigchld_ev, NULL);
+	while (nworkers < max_workers()) {
+		if (spawn_worker(nworkers >= config.hasher.workers) == NULL) {
+			log_fatal(SS_INT, "unable to start hashers");
+			return -1;
+		}
+	}
+
+	if (max_workers() > config.hasher.workers
+			&& config.hasher.idle_timeout != 0) {
+		struct timeval tv = {(time_t)config.hasher.idle_timeout, 0};
+
+		if ((idle_ev = event_new(base, -1, EV_PERSIST,
+						hasher_idle_cb, NULL)) == NULL)
+			oom();
+		event_add(idle_ev, &tv);
+	}
+
+	log_info(SS_INT, "started %zu hasher(s), %zu of them parked until "
+			"needed", nworkers, count_workers(WS_PARKED));
+	return 0;
+}
+
+static struct HasherWorker *
+least_loaded(void)
+{
+	struct HasherWorker *best = NULL;
+
+	for (size_t i = 0; i < nworkers; ++i) {
+		if (workers[i].state != WS_RUNNING
+				|| workers[i].inflight >= WORKER_DEPTH)
+			continue;
+		if (best == NULL || workers[i].inflight < best->inflight)
+			best = &workers[i];
+	}
+
+	return best;
+}
+
+bool
+hasher_can_submit(void)
+{
+	if (engine == HE_THREAD)
+		return (threads_inflight < nthreads * WORKER_DEPTH);
+	if (engine == HE_DAEMON)
+		return (daemon_bev != NULL
+				&& daemon_inflight < config.hasher.workers);
+
+	return (least_loaded() != NULL || count_workers(WS_PARKED) != 0);
+}
+
+/* How many hashes may be in progress at once, at most */
+size_t
+hasher_parallelism(void)
+{
+	if (engine == HE_THREAD)
+		return nthreads * WORKER_DEPTH;
+	if (engine == HE_DAEMON)
+		return config.hasher.workers;
+
+	return max_workers() * WORKER_DEPTH;
+}
+
+#ifdef __linux__
+/* Resident memory of a process in KiB, or 0 if unknown */
+static uint64_t
+rss_of(const char *pid)
+{
+	char path[32];
+	unsigned long long size, resident;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%s/statm", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	n = fscanf(f, "%llu %llu", &size, &resident);
+	fclose(f);
+	if (n != 2)
+		return 0;
+
+	return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+#endif
+
+void
+hasher_stats(struct HasherStats *hs)
+{
+	memset(hs, 0, sizeof(*hs));
+	hs->engine = config.hasher.engine;
+	hs->min_workers = config.hasher.workers;
+	hs->footprint = WORKER_FOOTPRINT >> 20;
+	hs->budget = config.hasher.memory_budget;
+
+	if (engine == HE_DAEMON) {
+		/* The daemon's own hashers are its business. */
+		hs->workers = hs->max_workers = config.hasher.workers;
+		hs->busy = daemon_inflight;
+		return;
+	}
+	if (engine == HE_THREAD) {
+		hs->workers = nthreads;
+		hs->max_workers = nthreads;
+		hs->busy = threads_inflight;
+#ifdef __linux__
+		/* All of LM, not just the hashers */
+		hs->rss = rss_of("self");
+#endif
+		return;
+	}
+
+	hs->max_workers = max_workers();
+	for (size_t i = 0; i < nworkers; ++i) {
+		const struct HasherWorker *w = &workers[i];
+#ifdef __linux__
+		char pid[16];
+#endif
+
+		if (w->state == WS_FREE)
+			continue;
+		if (w->state == WS_RUNNING)
+			++hs->workers;
+		hs->busy += w->inflight;
+#ifdef __linux__
+		snprintf(pid, sizeof(pid), "%d", (int)w->pid);
+		hs->rss += rss_of(pid);
+#endif
+	}
+}
+
+const struct HashParams *
+hasher_params(void)
+{
+	return &params;
+}
+
+static void
+submit_thread(uint32_t id, const char *password, const uint8_t *salt,
+		const struct HashParams *hp)
+{
+	struct ThreadJob *job;
+	size_t pwlen = strlen(password);
+
+	if ((job = free_jobs) == NULL
+			|| threads_inflight >= nthreads * WORKER_DEPTH) {
+		log_fatal(SS_INT, "hash submitted without a free hasher");
+		return;
+	}
+	free_jobs = job->next_free;
+
+	job->id = id;
+	job->pwlen = (uint8_t)pwlen;
+	memset(job->password, 0, sizeof(job->password));
+	memcpy(job->password, password, pwlen);
+	memcpy(job->salt, salt, SALT_LEN);
+	job->params = *hp;
+
+	/* Cannot be full: there are no more jobs than cells. */
+	lfqueue_push(&request_queue, job);
+	++threads_inflight;
+	sem_post(&request_sem);
+}
+
+void
+hasher_submit(uint32_t id, const char *password, const uint8_t *salt,
+		const struct HashParams *hp)
+{
+	struct HasherWorker *w;
+	struct RingRequest *req;
+	size_t pwlen = strlen(password);
+
+	if (!hasher_params_valid(hp)) {
+		log_fatal(SS_INT, "bad argon2 parameters submitted");
+		return;
+	}
+
+	if (engine == HE_THREAD) {
+		submit_thread(id, password, salt, hp);
+		return;
+	}
+	if (engine == HE_DAEMON) {
+		submit_daemon(id, password, salt, hp);
+		return;
+	}
+
+	/* Cannot be full: there are no more slots than WORKER_DEPTH. */
+	if (((w = least_loaded()) == NULL && (w = unpark_worker()) == NULL)
+			|| (req = shmring_write_slot(w->requests, 0)) == NULL) {
+		log_fatal(SS_INT, "hash submitted without a free hasher");
+		return;
+	}
+
+	/* Released slots are wiped, so the password is zero-padded. */
+	req->id = id;
+	req->pwlen = (uint8_t)pwlen;
+	memcpy(req->password, password, pwlen);
+	memcpy(req->salt, salt, SALT_LEN);
+	req->params = *hp;
+
+	/* caller wipes password and salt */
+
+	shmring_commit(w->requests, 1);
+	++w->inflight;
+	doorbell_ring(w->request_bell[1]);
+}
+
+void
+hasher_fini(void)
+{
+	size_t n;
+
+	stop_threads();
+	if (daemon_bev != NULL) {
+		bufferevent_free(daemon_bev);
+		daemon_bev = NULL;
+		daemon_inflight = 0;
+	}
+	if (daemon_retry_ev != NULL) {
+		event_free(daemon_retry_ev);
+		daemon_retry_ev = NULL;
+	}
+
+	/* Hashers exiting from here on are expected to. */
+	if (sigchld_ev != NULL) {
+		event_free(sigchld_ev);
+		sigchld_ev = NULL;
+	}
+	if (idle_ev != NULL) {
+		event_free(idle_ev);
+		idle_ev = NULL;
+	}
+
+	for (size_t i = 0; i < nworkers; ++i) {
+		struct HasherWorker *w = &workers[i];
+
+		if (w->state == WS_FREE)
+			continue;
+		log_info(SS_INT, "closing the rings of hasher %d",
+				(int)w->pid);
+		if (w->ev != NULL) {
+			event_free(w->ev);
+			w->ev = NULL;
+		}
+		shmring_close(w->requests);
+		doorbell_ring(w->request_bell[1]);
+		/*
+		 * Cannot kill the hasher after pledge() because missing proc,
+		 * but it should come home anyway because we closed its ring.
+		 */
+#ifndef HAS_OPENBSD
+		/* Just in case it got stuck. */
+		if (w->pid != 0)
+			(void)kill(w->pid, SIGTERM);
+#endif
+	}
+
+	n = count_workers(WS_RUNNING) + count_workers(WS_PARKED);
+	log_info(SS_INT, "waiting on %zu hasher(s) to die...", n);
+	/* clear_worker() shrinks nworkers; go from the top. */
+	while (nworkers > 0) {
+		struct HasherWorker *w = &workers[nworkers - 1];
+
+		if (w->pid != 0)
+			(void)waitpid(w->pid, NULL, 0);
+		clear_worker(w);
+	}
+	if (n != 0)
+		log_info(SS_INT, "hashers dead");
+
+	argon2_fini();
+}
+
+static double
+benchmark(struct Argon2Input *in, struct WorkArea *work_areas, size_t n)
+{
+	struct HashParams hp[ARGON2_MAX_WAYS];
+	struct timespec start;
+
+	for (size_t i = 0; i < n; ++i)
+		hp[i] = params;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < BENCHMARK_HASHES / n; ++i)
+		compute(in, hp, work_areas, n, NULL);
+	return elapsed_since(&start);
+}
+
+/*
+ * Measures how many hashes per second a single hasher manages at every
+ * interleave width and prints the results; this is lm -b.
+ * A plain malloc(3) work area, faulted in during the first hash, is
+ * measured as well for comparison with the mapped ones.
+ */
+int
+hasher_benchmark(void)
+{
+	static const uint8_t password[] = "benchmark";
+	uint8_t salt[SALT_LEN] = {0};
+	uint8_t hash[ARGON2_MAX_WAYS][HASH_LEN];
+	struct WorkArea *work_areas;
+	struct WorkArea plain;
+	struct Argon2Input in[ARGON2_MAX_WAYS];
+	double elapsed;
+
+	if (setup() != 0)
+		return -1;
+
+	printf("%s, %" PRIu32 " KiB, %" PRIu32 " passes, %" PRIu32
+			" lane(s), %s kernel\n",
+			algorithm_name(params.algorithm),
+			params.memory, params.passes, params.lanes,
+			argon2_kernel_name());
+
+	for (size_t i = 0; i < ARGON2_MAX_WAYS; ++i)
+		set_input(&in[i], hash[i], password, sizeof(password) - 1,
+				salt);
+
+	/* compute() leaves a work area that is big enough alone. */
+	plain.size = WORK_AREA_SIZE(params.memory);
+	plain.p = smalloc(plain.size);
+	elapsed = benchmark(in, &plain, 1);
+	printf("malloc(3) work area: %.2f hashes/s per core "
+			"(%.1f ms per hash)\n",
+			BENCHMARK_HASHES / elapsed,
+			elapsed * 1000 / BENCHMARK_HASHES);
+	free(plain.p);
+
+	work_areas = alloc_work_areas(ARGON2_MAX_WAYS, params.memory);
+	for (size_t n = 1; n <= ARGON2_MAX_WAYS; n *= 2) {
+		elapsed = benchmark(in, work_areas, n);
+		printf("%zu-way interleave: %.2f hashes/s per core "
+				"(%.1f ms per hash)\n",
+				n, BENCHMARK_HASHES / elapsed,
+				elapsed * 1000 / BENCHMARK_HASHES);
+	}
+
+	free_work_areas(work_areas, ARGON2_MAX_WAYS);
+	argon2_fini();
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Written in 2017, 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_HASHER_H
+#define LM_HASHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Upper bound for hasher:workers; each worker costs ~100 MB. */
+#define HASHER_MAX_WORKERS	(64)
+
+/* Bounds for the argon2 parameters; memory is in KiB (argon2 blocks). */
+#define HASHER_MIN_MEMORY	(8)
+#define HASHER_MAX_MEMORY	(4194304)
+#define HASHER_MAX_PASSES	(64)
+
+/* In case argon2i ever gets broken, it's best we encode this information
+ * already.
+ * These are the values of pwalgo in the accounts table; never renumber them.
+ */
+enum PasswordAlgorithm {
+	PA_ARGON2I = 0,
+	/* RFC 9106 argon2id, any number of lanes */
+	PA_ARGON2ID = 1,
+	/* Imported from elsewhere, see legacy.c; pwmemory, pwpasses and
+	 * pwlanes mean nothing for these.
+	 */
+	PA_PLAIN = 2,
+	PA_CRYPT = 3
+};
+
+/* The parameters a hash was (or is to be) computed with */
+struct HashParams {
+	enum PasswordAlgorithm algorithm;
+	uint32_t memory;
+	uint32_t passes;
+	uint32_t lanes;
+};
+
+/* What STATS shows about the hashers; memory is in MB, rss in KiB */
+struct HasherStats {
+	const char *engine;
+	size_t workers;
+	size_t min_workers;
+	size_t max_workers;
+	unsigned int busy;
+	size_t footprint;
+	unsigned long budget;
+	/* 0 if unknown */
+	uint64_t rss;
+};
+
+struct event_base;
+
+int hasher_init(struct event_base *base);
+const struct HashParams *hasher_params(void);
+bool hasher_params_valid(const struct HashParams *hp);
+bool hasher_params_equal(const struct HashParams *a,
+		const struct HashParams *b);
+bool hasher_can_submit(void);
+size_t hasher_parallelism(void);
+void hasher_submit(uint32_t id, const char *password, const uint8_t *salt,
+		const struct HashParams *hp);
+void hasher_fini(void);
+int hasher_benchmark(void);
+void hasher_stats(struct HasherStats *hs);
+
+#endif
+
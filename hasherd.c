@@ -0,0 +1,679 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * lm-hasherd: argon2 for several local services from one pool of hashers.
+ *
+ * Clients connect to a UNIX socket and speak the protocol in hasherd.h;
+ * LM does with hasher:engine = daemon.
+ * Requests are queued per client and handed to the hasher threads round
+ * robin, one per client with anything queued, so a busy client cannot
+ * starve a quiet one.
+ * Who may connect is up to the permissions of the socket's directory.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hasherd.h"
+#include "argon2.h"
+#include "hasher.h"
+#include "lfqueue.h"
+#include "lm.h"
+#include "logging.h"
+#include "monocypher.h"
+#include "util.h"
+
+/* Jobs over all clients; a power of two for lfqueue_init(). */
+#define MAX_JOBS	(256)
+/* Requests a single client may have queued or being hashed */
+#define CLIENT_QUEUE	(64)
+/* How much unparsed input a client may leave with us */
+#define CLIENT_READ_MAX	(64 * 1024)
+
+struct Client;
+
+struct Job {
+	/* client queue or free list */
+	struct Job *next;
+	/* NULL once the client is gone */
+	struct Client *client;
+	uint32_t tag;
+	struct HashParams params;
+	uint8_t pwlen;
+	uint8_t password[PASSWORD_LEN];
+	uint8_t salt[SALT_LEN];
+	uint8_t hash[HASH_LEN];
+	uint32_t compute_us;
+};
+
+struct Client {
+	struct Client *prev;
+	struct Client *next;
+	struct bufferevent *bev;
+	/* waiting for a hasher, oldest first */
+	struct Job *head;
+	struct Job *tail;
+	/* queued or being hashed */
+	unsigned int pending;
+	/* only flushing an error before being closed */
+	bool closing;
+};
+
+struct WorkArea {
+	void *p;
+	size_t size;
+};
+
+static struct event_base *base;
+static struct Client *clients;
+/* where the next round robin pass starts */
+static struct Client *next_client;
+
+static uint32_t max_memory = 1048576;
+static size_t nworkers = 1;
+static pthread_t threads[HASHER_MAX_WORKERS];
+static size_t nthreads;
+static size_t busy;
+
+static struct Job jobs[MAX_JOBS];
+static struct Job *free_jobs;
+static struct LFQueue request_queue;
+static struct LFQueue result_queue;
+static sem_t request_sem;
+static atomic_bool stopping;
+static int doorbell[2] = {-1, -1};
+
+static void
+store32_le(uint8_t out[4], uint32_t in)
+{
+	out[0] =  in        & 0xff;
+	out[1] = (in >>  8) & 0xff;
+	out[2] = (in >> 16) & 0xff;
+	out[3] = (in >> 24) & 0xff;
+}
+
+static uint32_t
+load32_le(const uint8_t s[4])
+{
+	return (uint32_t)s[0]
+		| ((uint32_t)s[1] <<  8)
+		| ((uint32_t)s[2] << 16)
+		| ((uint32_t)s[3] << 24);
+}
+
+/* logging.c calls this on fatal errors. */
+void
+lm_exit(void)
+{
+	if (base != NULL)
+		event_base_loopbreak(base);
+	else
+		exit(1);
+}
+
+static bool
+params_valid(const struct HashParams *hp)
+{
+	return ((hp->algorithm == PA_ARGON2I
+				|| hp->algorithm == PA_ARGON2ID)
+			&& hp->memory >= HASHER_MIN_MEMORY
+			&& hp->memory <= max_memory
+			&& hp->passes >= 1
+			&& hp->passes <= HASHER_MAX_PASSES
+			&& hp->lanes >= 1
+			&& hp->lanes <= ARGON2_MAX_LANES
+			&& hp->memory >= 8 * hp->lanes);
+}
+
+static void
+hash(struct Job *job, struct WorkArea *wa)
+{
+	size_t size = (size_t)job->params.memory * 1024;
+	struct timespec start, end;
+	int64_t us;
+
+	if (size > wa->size) {
+		if (wa->p != NULL)
+			(void)munmap(wa->p, wa->size);
+		if ((wa->p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANON, -1, 0))
+				== MAP_FAILED)
+			oom();
+		wa->size = size;
+#ifdef MADV_HUGEPAGE
+		(void)madvise(wa->p, wa->size, MADV_HUGEPAGE);
+#endif
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (job->params.algorithm == PA_ARGON2I && job->params.lanes == 1)
+		argon2i(job->hash, HASH_LEN, wa->p, job->params.memory,
+				job->params.passes,
+				job->password, job->pwlen,
+				job->salt, SALT_LEN);
+	else
+		argon2(job->params.algorithm == PA_ARGON2ID
+				? ARGON2_ID : ARGON2_I,
+				job->hash, HASH_LEN, wa->p,
+				job->params.memory, job->params.passes,
+				job->params.lanes,
+				job->password, job->pwlen,
+				job->salt, SALT_LEN, NULL, 0, NULL, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	us = (int64_t)(end.tv_sec - start.tv_sec) * 1000000
+		+ (end.tv_nsec - start.tv_nsec) / 1000;
+	job->compute_us = (us < 0) ? 0
+		: (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+static void *
+hasher_thread(void *arg)
+{
+	struct WorkArea wa = {NULL, 0};
+	struct Job *job;
+
+	(void)arg;
+
+	for (;;) {
+		while (sem_wait(&request_sem) != 0)
+			;
+		if (atomic_load(&stopping))
+			break;
+		/* The semaphore counts queued jobs, so there must be one. */
+		if ((job = lfqueue_pop(&request_queue)) == NULL)
+			continue;
+
+		hash(job, &wa);
+		crypto_wipe(job->password, sizeof(job->password));
+		crypto_wipe(job->salt, sizeof(job->salt));
+		/* Cannot be full: there are no more jobs than cells. */
+		lfqueue_push(&result_queue, job);
+		doorbell_ring(doorbell[1]);
+	}
+
+	if (wa.p != NULL)
+		(void)munmap(wa.p, wa.size);
+	return NULL;
+}
+
+static void
+send_frame(struct Client *c, enum HasherdFrame type, uint32_t tag,
+		const uint8_t *payload, uint16_t len)
+{
+	uint8_t header[HASHERD_HEADER_LEN];
+
+	header[0] = HASHERD_VERSION;
+	header[1] = (uint8_t)type;
+	header[2] = len & 0xff;
+	header[3] = (uint8_t)(len >> 8);
+	store32_le(header + 4, tag);
+	evbuffer_add(bufferevent_get_output(c->bev), header, sizeof(header));
+	evbuffer_add(bufferevent_get_output(c->bev), payload, len);
+}
+
+static void
+send_error(struct Client *c, uint32_t tag, enum HasherdError error)
+{
+	uint8_t e = (uint8_t)error;
+
+	send_frame(c, HF_ERROR, tag, &e, 1);
+}
+
+static void
+free_job(struct Job *job)
+{
+	crypto_wipe(job, sizeof(*job));
+	job->next = free_jobs;
+	free_jobs = job;
+}
+
+static void
+close_client(struct Client *c)
+{
+	struct Job *job;
+
+	log_debug(SS_INT, "client %p gone", (void *)c);
+	while ((job = c->head) != NULL) {
+		c->head = job->next;
+		free_job(job);
+	}
+	/* The rest are being hashed; drop their results. */
+	for (size_t i = 0; i < MAX_JOBS; ++i) {
+		if (jobs[i].client == c)
+			jobs[i].client = NULL;
+	}
+
+	if (next_client == c)
+		next_client = c->next;
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		clients = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+
+	bufferevent_free(c->bev);
+	free(c);
+}
+
+/* Hands out queued jobs to idle hashers, one client at a time. */
+static void
+dispatch(void)
+{
+	struct Client *c, *start;
+	struct Job *job;
+
+	while (busy < nthreads && clients != NULL) {
+		if ((start = next_client) == NULL)
+			start = clients;
+		c = start;
+		while (c->head == NULL) {
+			if ((c = c->next) == NULL)
+				c = clients;
+			if (c == start)
+				return;
+		}
+
+		job = c->head;
+		if ((c->head = job->next) == NULL)
+			c->tail = NULL;
+		job->next = NULL;
+		next_client = c->next;
+
+		/* Cannot be full: there are no more jobs than cells. */
+		lfqueue_push(&request_queue, job);
+		++busy;
+		sem_post(&request_sem);
+	}
+}
+
+static void
+doorbell_cb(evutil_socket_t fd, short revents, void *arg)
+{
+	struct Job *job;
+	uint8_t payload[HASHERD_HASHED_LEN];
+
+	doorbell_drain(fd);
+	while ((job = lfqueue_pop(&result_queue)) != NULL) {
+		--busy;
+		if (job->client != NULL) {
+			--job->client->pending;
+			memcpy(payload, job->hash, HASH_LEN);
+			store32_le(payload + HASH_LEN, job->compute_us);
+			send_frame(job->client, HF_HASHED, job->tag,
+					payload, sizeof(payload));
+		}
+		free_job(job);
+	}
+	crypto_wipe(payload, sizeof(payload));
+	dispatch();
+}
+
+/* Sends an error and closes the connection once it is out. */
+static void
+fail_client(struct Client *c, uint32_t tag, enum HasherdError error)
+{
+	log_warn(SS_INT, "dropping client %p: protocol error %d",
+			(void *)c, (int)error);
+	send_error(c, tag, error);
+	c->closing = true;
+	bufferevent_disable(c->bev, EV_READ);
+}
+
+static void
+handle_hash(struct Client *c, uint32_t tag, const uint8_t *p, uint16_t len)
+{
+	struct Job *job;
+	struct HashParams hp;
+	size_t pwlen = len - HASHERD_HASH_FIXED;
+
+	hp.algorithm = (enum PasswordAlgorithm)p[0];
+	hp.lanes = p[1];
+	hp.memory = load32_le(p + 2);
+	hp.passes = load32_le(p + 6);
+	if (!params_valid(&hp)) {
+		send_error(c, tag, HDE_PARAMS);
+		return;
+	}
+	if (c->pending >= CLIENT_QUEUE || (job = free_jobs) == NULL) {
+		send_error(c, tag, HDE_BUSY);
+		return;
+	}
+	free_jobs = job->next;
+
+	job->next = NULL;
+	job->client = c;
+	job->tag = tag;
+	job->params = hp;
+	memcpy(job->salt, p + 10, SALT_LEN);
+	job->pwlen = (uint8_t)pwlen;
+	memcpy(job->password, p + HASHERD_HASH_FIXED, pwlen);
+
+	if (c->tail == NULL)
+		c->head = job;
+	else
+		c->tail->next = job;
+	c->tail = job;
+	++c->pending;
+}
+
+static void
+client_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct Client *c = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	uint8_t frame[HASHERD_HEADER_LEN + HASHERD_MAX_PAYLOAD];
+	uint16_t len;
+	uint32_t tag;
+
+	while (!c->closing && evbuffer_get_length(in) >= HASHERD_HEADER_LEN) {
+		evbuffer_copyout(in, frame, HASHERD_HEADER_LEN);
+		len = (uint16_t)(frame[2] | (frame[3] << 8));
+		tag = load32_le(frame + 4);
+
+		if (frame[0] != HASHERD_VERSION) {
+			fail_client(c, tag, HDE_VERSION);
+			break;
+		}
+		if (frame[1] != HF_HASH || len < HASHERD_HASH_FIXED
+				|| len > HASHERD_MAX_PAYLOAD) {
+			fail_client(c, tag, HDE_MALFORMED);
+			break;
+		}
+		if (evbuffer_get_length(in) < HASHERD_HEADER_LEN + (size_t)len)
+			break;
+
+		evbuffer_remove(in, frame, HASHERD_HEADER_LEN + (size_t)len);
+		handle_hash(c, tag, frame + HASHERD_HEADER_LEN, len);
+	}
+	crypto_wipe(frame, sizeof(frame));
+
+	dispatch();
+}
+
+static void
+client_write_cb(struct bufferevent *bev, void *arg)
+{
+	struct Client *c = arg;
+
+	if (c->closing)
+		close_client(c);
+}
+
+static void
+client_event_cb(struct bufferevent *bev, short revents, void *arg)
+{
+	struct Client *c = arg;
+
+	if (revents & BEV_EVENT_ERROR)
+		log_info(SS_INT, "client %p: %s", (void *)c,
+				evutil_socket_error_to_string(
+					EVUTIL_SOCKET_ERROR()));
+	if (revents & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		close_client(c);
+}
+
+static void
+accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+		struct sockaddr *sa, int socklen, void *arg)
+{
+	struct Client *c = scalloc(1, sizeof(*c));
+
+	if ((c->bev = bufferevent_socket_new(base, fd,
+					BEV_OPT_CLOSE_ON_FREE)) == NULL)
+		oom();
+	bufferevent_setcb(c->bev, client_read_cb, client_write_cb,
+			client_event_cb, c);
+	bufferevent_setwatermark(c->bev, EV_READ, 0, CLIENT_READ_MAX);
+	bufferevent_enable(c->bev, EV_READ | EV_WRITE);
+
+	if ((c->next = clients) != NULL)
+		clients->prev = c;
+	clients = c;
+	log_debug(SS_INT, "client %p connected", (void *)c);
+}
+
+static void
+signal_cb(evutil_socket_t sfd, short revents, void *arg)
+{
+	log_info(SS_INT, "received signal %d, exiting",
+			event_get_signal((struct event *)arg));
+	event_base_loopbreak(base);
+}
+
+static int
+start_threads(void)
+{
+	int error;
+
+	for (size_t i = 0; i < MAX_JOBS; ++i)
+		free_job(&jobs[i]);
+	lfqueue_init(&request_queue, MAX_JOBS);
+	lfqueue_init(&result_queue, MAX_JOBS);
+	if (sem_init(&request_sem, 0, 0) != 0) {
+		log_fatal(SS_INT, "unable to create semaphore: %s",
+				strerror(errno));
+		return -1;
+	}
+	atomic_init(&stopping, false);
+
+	while (nthreads < nworkers) {
+		if ((error = pthread_create(&threads[nthreads], NULL,
+						hasher_thread, NULL)) != 0) {
+			log_fatal(SS_INT, "unable to create hasher thread: %s",
+					strerror(error));
+			return -1;
+		}
+		++nthreads;
+	}
+
+	return 0;
+}
+
+static void
+stop_threads(void)
+{
+	atomic_store(&stopping, true);
+	for (size_t i = 0; i < nthreads; ++i)
+		sem_post(&request_sem);
+	for (size_t i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	nthreads = 0;
+	sem_destroy(&request_sem);
+	lfqueue_fini(&request_queue);
+	lfqueue_fini(&result_queue);
+	crypto_wipe(jobs, sizeof(jobs));
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		log_fatal(SS_INT, "socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_fatal(SS_INT, "unable to create socket: %s",
+				strerror(errno));
+		return -1;
+	}
+	/* A stale socket from an earlier run would make bind(2) fail. */
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0
+			|| listen(fd, 16) != 0) {
+		log_fatal(SS_INT, "unable to listen on %s: %s", path,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+	evutil_make_socket_nonblocking(fd);
+
+	return fd;
+}
+
+static unsigned long
+parse_option(int c, const char *value, unsigned long min, unsigned long max)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (errno != 0 || *end != '\0' || *value == '\0' || n < min
+			|| n > max) {
+		fprintf(stderr, "-%c must be a number between %lu and %lu\n",
+				c, min, max);
+		exit(1);
+	}
+
+	return n;
+}
+
+static void
+help(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-dh] [-k kernel] [-m memory] "
+			"[-w workers] socket\n"
+			"  -d      log debug messages\n"
+			"  -h      show this help\n"
+			"  -k      argon2 kernel (default: auto)\n"
+			"  -m      most memory per hash in KiB "
+			"(default: 1048576)\n"
+			"  -w      hasher threads (default: 1)\n",
+			progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct evconnlistener *listener;
+	struct event *sigev_int, *sigev_term, *doorbell_ev;
+	const char *kernel = "auto";
+	bool debug = false;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "dhk:m:w:")) != -1) {
+		switch (c) {
+		case 'd':
+			debug = true;
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'm':
+			max_memory = (uint32_t)parse_option(c, optarg,
+					HASHER_MIN_MEMORY, HASHER_MAX_MEMORY);
+			break;
+		case 'w':
+			nworkers = parse_option(c, optarg, 1,
+					HASHER_MAX_WORKERS);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			return (c != 'h');
+		}
+	}
+	if (optind != argc - 1) {
+		help(argv[0]);
+		return 1;
+	}
+
+	if (log_init(true, debug) != 0)
+		return 1;
+	if (argon2_init(kernel) != 0)
+		return 1;
+	if ((fd = listen_on(argv[optind])) == -1)
+		return 1;
+#ifdef HAS_OPENBSD
+	if (pledge("stdio unix", NULL) != 0) {
+		log_fatal(SS_INT, "unable to pledge: %s", strerror(errno));
+		return 1;
+	}
+#endif
+	/* A client going away must not take us with it. */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((base = event_base_new()) == NULL)
+		oom();
+	if ((listener = evconnlistener_new(base, accept_cb, NULL,
+					LEV_OPT_CLOSE_ON_FREE, -1, fd))
+			== NULL)
+		oom();
+	if (doorbell_open(doorbell) != 0)
+		return 1;
+	if ((doorbell_ev = event_new(base, doorbell[0], EV_READ | EV_PERSIST,
+					doorbell_cb, NULL)) == NULL)
+		oom();
+	event_add(doorbell_ev, NULL);
+	sigev_int = evsignal_new(base, SIGINT, signal_cb, event_self_cbarg());
+	sigev_term = evsignal_new(base, SIGTERM, signal_cb,
+			event_self_cbarg());
+	if (sigev_int == NULL || sigev_term == NULL)
+		oom();
+	event_add(sigev_int, NULL);
+	event_add(sigev_term, NULL);
+
+	if (start_threads() != 0)
+		return 1;
+	log_info(SS_INT, "listening on %s with %zu hasher(s), at most %"
+			PRIu32 " KiB per hash", argv[optind], nthreads,
+			max_memory);
+
+	event_base_dispatch(base);
+
+	while (clients != NULL)
+		close_client(clients);
+	stop_threads();
+	evconnlistener_free(listener);
+	event_free(doorbell_ev);
+	doorbell_close(doorbell);
+	event_free(sigev_int);
+	event_free(sigev_term);
+	event_base_free(base);
+	(void)unlink(argv[optind]);
+	argon2_fini();
+	log_fini();
+
+	return 0;
+}
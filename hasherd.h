@@ -0,0 +1,70 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_HASHERD_H
+#define LM_HASHERD_H
+
+#include "db.h"
+
+/*
+ * The lm-hasherd protocol, spoken over a UNIX stream socket.
+ *
+ * Every frame is a header followed by a payload:
+ *   1 byte version (HASHERD_VERSION) ||
+ *   1 byte type (enum HasherdFrame) ||
+ *   2 bytes payload length (little endian) ||
+ *   4 bytes tag (little endian)
+ *
+ * The tag is chosen by the client and echoed in the reply; replies may come
+ * in any order.
+ *
+ * HF_HASH (client to daemon):
+ *   1 byte algorithm (enum PasswordAlgorithm) ||
+ *   1 byte lanes ||
+ *   4 bytes memory in KiB (little endian) ||
+ *   4 bytes passes (little endian) ||
+ *   SALT_LEN bytes salt ||
+ *   the password (the rest of the payload)
+ *
+ * HF_HASHED (daemon to client):
+ *   HASH_LEN bytes hash ||
+ *   4 bytes time argon2 took in microseconds (little endian)
+ *
+ * HF_ERROR (daemon to client):
+ *   1 byte error (enum HasherdError)
+ *
+ * A frame of another version gets HDE_VERSION and the connection closed, as
+ * does a malformed one with HDE_MALFORMED.
+ */
+
+#define HASHERD_VERSION		(1)
+#define HASHERD_HEADER_LEN	(8)
+#define HASHERD_HASH_FIXED	(1 + 1 + 4 + 4 + SALT_LEN)
+#define HASHERD_MAX_PAYLOAD	(HASHERD_HASH_FIXED + PASSWORD_LEN)
+#define HASHERD_HASHED_LEN	(HASH_LEN + 4)
+
+enum HasherdFrame {
+	HF_HASH = 1,
+	HF_HASHED = 2,
+	HF_ERROR = 3
+};
+
+enum HasherdError {
+	HDE_VERSION = 1,
+	HDE_MALFORMED = 2,
+	/* parameters invalid or beyond what the daemon allows */
+	HDE_PARAMS = 3,
+	/* too many requests queued for this client */
+	HDE_BUSY = 4
+};
+
+#endif
@@ -0,0 +1,512 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+
+/*
+ * lm-import: loads accounts from another services package into lm.db.
+ *
+ * The dump has one account per line, fields separated by blanks:
+ *
+ *     name email algorithm secret
+ *
+ * With algorithm "plain", secret is the password, which is hashed here with
+ * argon2 on all hasher threads.
+ * Any other algorithm names a legacy verifier (see legacy.c); secret is then
+ * that hash, stored as it is until the account's owner next authenticates.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * Accounts go in in batches, each in a single transaction.
+ * Accounts that already exist are skipped before hashing, so an import that
+ * was interrupted can simply be run again.
+ * LM must have opened lm.db once so that the schema is current.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "argon2.h"
+#include "db.h"
+#include "hasher.h"
+#include "legacy.h"
+#include "logging.h"
+#include "monocypher.h"
+#include "sqlite3.h"
+#include "util.h"
+
+struct Record {
+	unsigned long line;
+	char name[ACCOUNT_LEN + 1];
+	char email[EMAIL_LEN + 1];
+	/* the password if hashed, the legacy hash otherwise */
+	uint8_t secret[LEGACY_HASH_MAX];
+	size_t secret_len;
+	const struct LegacyVerifier *legacy;
+	uint8_t salt[SALT_LEN];
+	uint8_t hash[HASH_LEN];
+};
+
+static struct HashParams params = {PA_ARGON2I, 100000, 3, 1};
+static size_t nthreads;
+static void **work_areas;
+
+static struct Record *batch;
+static size_t batch_size = 1000;
+static size_t batch_len;
+static atomic_size_t next_record;
+
+static sqlite3 *db;
+static sqlite3_stmt *exists_stmt;
+static sqlite3_stmt *insert_stmt;
+
+static unsigned long imported, skipped, failed;
+
+/* logging.c calls this on fatal errors. */
+void
+lm_exit(void)
+{
+	exit(1);
+}
+
+static void *
+hasher_thread(void *arg)
+{
+	void *work_area = arg;
+	struct Record *r;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&next_record, 1)) < batch_len) {
+		r = &batch[i];
+		if (r->legacy != NULL)
+			continue;
+
+		if (params.algorithm == PA_ARGON2I && params.lanes == 1)
+			argon2i(r->hash, HASH_LEN, work_area, params.memory,
+					params.passes,
+					r->secret, (uint32_t)r->secret_len,
+					r->salt, SALT_LEN);
+		else
+			argon2(params.algorithm == PA_ARGON2ID
+					? ARGON2_ID : ARGON2_I,
+					r->hash, HASH_LEN, work_area,
+					params.memory, params.passes,
+					params.lanes,
+					r->secret, (uint32_t)r->secret_len,
+					r->salt, SALT_LEN, NULL, 0, NULL, 0);
+		crypto_wipe(r->secret, sizeof(r->secret));
+	}
+
+	return NULL;
+}
+
+static void
+hash_batch(void)
+{
+	pthread_t threads[HASHER_MAX_WORKERS];
+	uint8_t *salts;
+	size_t n;
+	int error;
+
+	/* One read of /dev/urandom for the whole batch */
+	salts = smalloc(batch_len * SALT_LEN);
+	if (randombytes(salts, batch_len * SALT_LEN) == NULL)
+		exit(1);
+	for (size_t i = 0; i < batch_len; ++i)
+		memcpy(batch[i].salt, &salts[i * SALT_LEN], SALT_LEN);
+	crypto_wipe(salts, batch_len * SALT_LEN);
+	free(salts);
+
+	atomic_store(&next_record, 0);
+	for (n = 0; n < nthreads; ++n) {
+		if ((error = pthread_create(&threads[n], NULL, hasher_thread,
+						work_areas[n])) != 0) {
+			log_fatal(SS_INT, "unable to start hasher thread: %s",
+					strerror(error));
+			exit(1);
+		}
+	}
+	for (size_t i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+static void
+insert_batch(void)
+{
+	struct Record *r;
+	char name_key[ACCOUNT_LEN + 1];
+	char email_key[EMAIL_LEN + 1];
+	int sqlite_ret;
+
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to BEGIN: %s", sqlite3_errmsg(db));
+		exit(1);
+	}
+
+	for (size_t i = 0; i < batch_len; ++i) {
+		r = &batch[i];
+		sqlite3_reset(insert_stmt);
+		sqlite3_bind_text(insert_stmt, 1, r->name, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_stmt, 2, r->email, -1, SQLITE_STATIC);
+		if (r->legacy != NULL) {
+			sqlite3_bind_int(insert_stmt, 3, r->legacy->algorithm);
+			sqlite3_bind_blob(insert_stmt, 4, "", 0,
+					SQLITE_STATIC);
+			sqlite3_bind_blob(insert_stmt, 5, r->secret,
+					(int)r->secret_len, SQLITE_STATIC);
+		} else {
+			sqlite3_bind_int(insert_stmt, 3, params.algorithm);
+			sqlite3_bind_blob(insert_stmt, 4, r->salt, SALT_LEN,
+					SQLITE_STATIC);
+			sqlite3_bind_blob(insert_stmt, 5, r->hash, HASH_LEN,
+					SQLITE_STATIC);
+		}
+		sqlite3_bind_int64(insert_stmt, 6, params.memory);
+		sqlite3_bind_int64(insert_stmt, 7, params.passes);
+		sqlite3_bind_int64(insert_stmt, 8, params.lanes);
+		sqlite3_bind_text(insert_stmt, 9, casefold(name_key, r->name,
+					true), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(insert_stmt, 10, casefold(email_key,
+					r->email, false), -1, SQLITE_TRANSIENT);
+
+		sqlite_ret = sqlite3_step(insert_stmt);
+		if (sqlite_ret == SQLITE_DONE) {
+			++imported;
+		} else if (sqlite_ret == SQLITE_CONSTRAINT) {
+			/* Most likely a duplicate within the dump */
+			log_warn(SS_SQL, "line %lu: account %s or e-mail %s "
+					"already taken", r->line, r->name,
+					r->email);
+			++failed;
+		} else {
+			log_fatal(SS_SQL, "unable to INSERT: %s",
+					sqlite3_errstr(sqlite_ret));
+			(void)sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+			exit(1);
+		}
+	}
+	sqlite3_reset(insert_stmt);
+	sqlite3_clear_bindings(insert_stmt);
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to COMMIT: %s", sqlite3_errmsg(db));
+		exit(1);
+	}
+
+	crypto_wipe(batch, batch_len * sizeof(*batch));
+	batch_len = 0;
+}
+
+static bool
+account_exists(const char *name)
+{
+	char key[ACCOUNT_LEN + 1];
+	bool ret;
+
+	sqlite3_bind_text(exists_stmt, 1, casefold(key, name, true), -1,
+			SQLITE_TRANSIENT);
+	ret = (sqlite3_step(exists_stmt) == SQLITE_ROW);
+	sqlite3_reset(exists_stmt);
+	return ret;
+}
+
+/* Fills in r from line; false if the line is to be skipped. */
+static bool
+parse_line(struct Record *r, char *line, unsigned long lineno)
+{
+	char *name, *email, *algorithm, *secret, *p;
+	size_t max;
+
+	if ((p = strchr(line, '\n')) != NULL)
+		*p = '\0';
+	name = strtok(line, " \t\r");
+	if (name == NULL || *name == '#')
+		return false;
+	email = strtok(NULL, " \t\r");
+	algorithm = strtok(NULL, " \t\r");
+	secret = strtok(NULL, " \t\r");
+	if (secret == NULL) {
+		log_warn(SS_INT, "line %lu: expected name, e-mail, algorithm "
+				"and secret", lineno);
+		++failed;
+		return false;
+	}
+
+	if (strlen(name) > ACCOUNT_LEN || strlen(email) > EMAIL_LEN) {
+		log_warn(SS_INT, "line %lu: account name or e-mail too long",
+				lineno);
+		++failed;
+		return false;
+	}
+	if (strcmp(algorithm, "plain") == 0) {
+		r->legacy = NULL;
+		max = PASSWORD_LEN - 1;
+	} else if ((r->legacy = legacy_verifier_by_name(algorithm))
+			!= NULL) {
+		max = LEGACY_HASH_MAX;
+	} else {
+		log_warn(SS_INT, "line %lu: unknown algorithm %s",
+				lineno, algorithm);
+		++failed;
+		return false;
+	}
+	if ((r->secret_len = strlen(secret)) > max) {
+		log_warn(SS_INT, "line %lu: password or hash too long",
+				lineno);
+		++failed;
+		return false;
+	}
+
+	if (account_exists(name)) {
+		++skipped;
+		return false;
+	}
+
+	r->line = lineno;
+	strcpy(r->name, name);
+	strcpy(r->email, email);
+	memcpy(r->secret, secret, r->secret_len);
+	return true;
+}
+
+static void
+report(const struct timespec *start)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - start->tv_sec)
+		+ (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+	log_info(SS_INT, "%lu imported, %lu skipped, %lu failed; "
+			"%.1f accounts/s", imported, skipped, failed,
+			elapsed > 0 ? (double)imported / elapsed : 0.0);
+}
+
+static int
+open_db(const char *path)
+{
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL)
+			!= SQLITE_OK) {
+		log_fatal(SS_SQL, "unable to open %s: %s", path,
+				sqlite3_errmsg(db));
+		return -1;
+	}
+	/* LM itself may be holding a lock for a moment. */
+	sqlite3_busy_timeout(db, 10000);
+
+	if (sqlite3_prepare_v2(db, "SELECT 1 FROM accounts WHERE "
+				"name_key = ? LIMIT 1", -1,
+				&exists_stmt, NULL) != SQLITE_OK
+			|| sqlite3_prepare_v2(db, "INSERT INTO accounts(name, "
+				"email, pwalgo, pwsalt, pwhash, pwmemory, "
+				"pwpasses, pwlanes, expires, name_key, "
+				"email_key) "
+				"VALUES (?, ?, ?, ?, ?, ?, ?, ?, 0, ?, ?)", -1,
+				&insert_stmt, NULL) != SQLITE_OK) {
+		log_fatal(SS_SQL, "unexpected schema in %s (%s); start LM "
+				"once to bring it up to date", path,
+				sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned long
+parse_option(int c, const char *value, unsigned long min, unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (errno != 0 || *end != '\0' || *value == '\0' || n < min
+			|| n > max) {
+		fprintf(stderr, "-%c must be a number between %lu and %lu\n",
+				c, min, max);
+		exit(1);
+	}
+
+	return n;
+}
+
+static void
+help(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-dh] [-a algorithm] [-b batch] "
+			"[-k kernel] [-l lanes] [-m memory] [-p passes]\n"
+			"       [-w workers] dump [lm.db]\n"
+			"  -a      argon2i or argon2id (default: argon2i)\n"
+			"  -b      accounts per transaction (default: 1000)\n"
+			"  -d      log debug messages\n"
+			"  -h      show this help\n"
+			"  -k      argon2 kernel (default: auto)\n"
+			"  -l      argon2 lanes (default: 1)\n"
+			"  -m      argon2 memory in KiB (default: 100000)\n"
+			"  -p      argon2 passes (default: 3)\n"
+			"  -w      hasher threads (default: one per CPU)\n"
+			"The argon2 parameters should match those in lm.ini; "
+			"accounts hashed\nwith others are rehashed as they "
+			"authenticate.\n"
+			"dump may be - for standard input.\n",
+			progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec start;
+	const char *kernel = "auto";
+	const char *dbpath = "lm.db";
+	FILE *dump;
+	char *line = NULL;
+	size_t linecap = 0;
+	unsigned long lineno = 0;
+	long ncpus;
+	bool debug = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:b:dhk:l:m:p:w:")) != -1) {
+		switch (c) {
+		case 'a':
+			if (strcmp(optarg, "argon2i") == 0) {
+				params.algorithm = PA_ARGON2I;
+			} else if (strcmp(optarg, "argon2id") == 0) {
+				params.algorithm = PA_ARGON2ID;
+			} else {
+				fputs("-a must be argon2i or argon2id\n",
+						stderr);
+				return 1;
+			}
+			break;
+		case 'b':
+			batch_size = parse_option(c, optarg, 1, 1000000);
+			break;
+		case 'd':
+			debug = true;
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'l':
+			params.lanes = (uint32_t)parse_option(c, optarg, 1,
+					ARGON2_MAX_LANES);
+			break;
+		case 'm':
+			params.memory = (uint32_t)parse_option(c, optarg,
+					HASHER_MIN_MEMORY, HASHER_MAX_MEMORY);
+			break;
+		case 'p':
+			params.passes = (uint32_t)parse_option(c, optarg, 1,
+					HASHER_MAX_PASSES);
+			break;
+		case 'w':
+			nthreads = parse_option(c, optarg, 1,
+					HASHER_MAX_WORKERS);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			return (c != 'h');
+		}
+	}
+	if (optind != argc - 1 && optind != argc - 2) {
+		help(argv[0]);
+		return 1;
+	}
+	if (optind == argc - 2)
+		dbpath = argv[optind + 1];
+	if (params.memory < 8 * params.lanes) {
+		fputs("-m must be at least 8 KiB per lane\n", stderr);
+		return 1;
+	}
+	if (nthreads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpus < 1) ? 1
+			: (ncpus > HASHER_MAX_WORKERS) ? HASHER_MAX_WORKERS
+			: (size_t)ncpus;
+	}
+
+	if (log_init(true, debug) != 0)
+		return 1;
+	if (argon2_init(kernel) != 0)
+		return 1;
+	if (params.algorithm == PA_ARGON2I && params.lanes == 1
+			&& argon2_prepare(params.memory, params.passes) != 0)
+		return 1;
+	if (open_db(dbpath) != 0)
+		return 1;
+	if (strcmp(argv[optind], "-") == 0) {
+		dump = stdin;
+	} else if ((dump = fopen(argv[optind], "r")) == NULL) {
+		log_fatal(SS_INT, "unable to open %s: %s", argv[optind],
+				strerror(errno));
+		return 1;
+	}
+
+	batch = scalloc(batch_size, sizeof(*batch));
+	work_areas = smalloc(nthreads * sizeof(*work_areas));
+	for (size_t i = 0; i < nthreads; ++i)
+		work_areas[i] = smalloc((size_t)params.memory * 1024);
+
+	log_info(SS_INT, "importing into %s with %zu hasher(s), %s, %"
+			PRIu32 " KiB, %" PRIu32 " passes, %" PRIu32
+			" lane(s)", dbpath, nthreads,
+			params.algorithm == PA_ARGON2ID
+			? "argon2id" : "argon2i",
+			params.memory, params.passes, params.lanes);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (getline(&line, &linecap, dump) != -1) {
+		if (parse_line(&batch[batch_len], line, ++lineno))
+			++batch_len;
+		crypto_wipe(line, linecap);
+		if (batch_len == batch_size) {
+			hash_batch();
+			insert_batch();
+			report(&start);
+		}
+	}
+	if (ferror(dump)) {
+		log_fatal(SS_INT, "unable to read %s: %s", argv[optind],
+				strerror(errno));
+		return 1;
+	}
+	if (batch_len != 0) {
+		hash_batch();
+		insert_batch();
+	}
+	report(&start);
+
+	free(line);
+	if (dump != stdin)
+		fclose(dump);
+	for (size_t i = 0; i < nthreads; ++i)
+		free(work_areas[i]);
+	free(work_areas);
+	free(batch);
+	sqlite3_finalize(exists_stmt);
+	sqlite3_finalize(insert_stmt);
+	sqlite3_close(db);
+	argon2_fini();
+	log_fini();
+
+	return 0;
+}
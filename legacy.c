@@ -0,0 +1,129 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+
+#ifdef HAS_CRYPT
+# ifdef HAS_OPENBSD
+#  include <unistd.h>
+# else
+#  include <crypt.h>
+# endif
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "legacy.h"
+#include "logging.h"
+#include "monocypher.h"
+
+/* Compares without bailing out at the first difference. */
+static bool
+equal(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+	uint8_t diff = 0;
+
+	if (a_len != b_len)
+		return false;
+	for (size_t i = 0; i < a_len; ++i)
+		diff |= a[i] ^ b[i];
+	return (diff == 0);
+}
+
+/* Some packages keep passwords in the clear; best they stop soon. */
+static bool
+verify_plain(const char *password, const uint8_t *hash, size_t hash_len,
+		const uint8_t *salt, size_t salt_len)
+{
+	(void)salt;
+	(void)salt_len;
+
+	return equal((const uint8_t *)password, strlen(password),
+			hash, hash_len);
+}
+
+/*
+ * Whatever crypt(3) understands; the salt and scheme are part of the hash
+ * ($1$, $5$, $6$, $2b$ and so on, depending on the system).
+ * crypt(3) keeps its result in static storage, which is fine as long as only
+ * one thread calls it: the database thread in lm.
+ */
+static bool
+verify_crypt(const char *password, const uint8_t *hash, size_t hash_len,
+		const uint8_t *salt, size_t salt_len)
+{
+#ifdef HAS_CRYPT
+	char setting[LEGACY_HASH_MAX + 1];
+	const char *result;
+	bool ok;
+
+	(void)salt;
+	(void)salt_len;
+
+	if (hash_len > LEGACY_HASH_MAX)
+		return false;
+	memcpy(setting, hash, hash_len);
+	setting[hash_len] = '\0';
+
+	/* Failure is NULL or a string starting with '*', neither of
+	 * which can match a hash that crypt(3) made.
+	 */
+	if ((result = crypt(password, setting)) == NULL) {
+		crypto_wipe(setting, sizeof(setting));
+		return false;
+	}
+	ok = equal((const uint8_t *)result, strlen(result), hash, hash_len);
+	crypto_wipe(setting, sizeof(setting));
+	return ok;
+#else
+	(void)password;
+	(void)hash;
+	(void)hash_len;
+	(void)salt;
+	(void)salt_len;
+
+	log_error(SS_SQL, "crypt(3) hash found, but lm was built without "
+			"HAS_CRYPT");
+	return false;
+#endif
+}
+
+static const struct LegacyVerifier verifiers[] = {
+	{PA_PLAIN, "plain", verify_plain},
+	{PA_CRYPT, "crypt", verify_crypt}
+};
+
+#define NVERIFIERS	(sizeof(verifiers)/sizeof(*verifiers))
+
+/* NULL if algorithm is not a legacy one (i.e. it is argon2) */
+const struct LegacyVerifier *
+legacy_verifier(enum PasswordAlgorithm algorithm)
+{
+	for (size_t i = 0; i < NVERIFIERS; ++i) {
+		if (verifiers[i].algorithm == algorithm)
+			return &verifiers[i];
+	}
+
+	return NULL;
+}
+
+const struct LegacyVerifier *
+legacy_verifier_by_name(const char *name)
+{
+	for (size_t i = 0; i < NVERIFIERS; ++i) {
+		if (strcmp(verifiers[i].name, name) == 0)
+			return &verifiers[i];
+	}
+
+	return NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+
+#ifndef LM_LEGACY_H
+#define LM_LEGACY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hasher.h"
+
+/* Longest legacy hash or salt we accept, in bytes */
+#define LEGACY_HASH_MAX	(255)
+
+/*
+ * Checks passwords against hashes imported from other services packages.
+ * An account keeps such a hash only until its owner next authenticates;
+ * db.c then rehashes the password with the current argon2 parameters.
+ */
+struct LegacyVerifier {
+	enum PasswordAlgorithm algorithm;
+	/* as used by lm-import */
+	const char *name;
+	/* hash and salt are as stored in pwhash and pwsalt */
+	bool (*verify)(const char *password,
+			const uint8_t *hash, size_t hash_len,
+			const uint8_t *salt, size_t salt_len);
+};
+
+const struct LegacyVerifier *legacy_verifier(enum PasswordAlgorithm algorithm);
+const struct LegacyVerifier *legacy_verifier_by_name(const char *name);
+
+#endif
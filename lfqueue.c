@@ -0,0 +1,117 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * This is Dmitry Vyukov's bounded MPMC queue.
+ * Every cell carries a sequence number that tells producers and consumers
+ * whose turn it is; claiming a cell is a single CAS on head or tail.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "lfqueue.h"
+#include "logging.h"
+#include "util.h"
+
+struct LFQueueCell {
+	atomic_size_t seq;
+	void *p;
+};
+
+/* size must be a power of two */
+void
+lfqueue_init(struct LFQueue *q, size_t size)
+{
+	if (size < 2 || (size & (size - 1)) != 0)
+		log_fatal(SS_INT, "lfqueue size %zu is not a power of two",
+				size);
+
+	q->cells = scalloc(size, sizeof(*q->cells));
+	q->mask = size - 1;
+	for (size_t i = 0; i < size; ++i)
+		atomic_init(&q->cells[i].seq, i);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+bool
+lfqueue_push(struct LFQueue *q, void *p)
+{
+	struct LFQueueCell *cell;
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t seq;
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail,
+						&pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed))
+				break;
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			/* full */
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->tail,
+					memory_order_relaxed);
+		}
+	}
+
+	cell->p = p;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return true;
+}
+
+void *
+lfqueue_pop(struct LFQueue *q)
+{
+	struct LFQueueCell *cell;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t seq;
+	void *p;
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(&q->head,
+						&pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed))
+				break;
+		} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+			/* empty */
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&q->head,
+					memory_order_relaxed);
+		}
+	}
+
+	p = cell->p;
+	atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+			memory_order_release);
+	return p;
+}
+
+void
+lfqueue_fini(struct LFQueue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
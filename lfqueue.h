@@ -0,0 +1,39 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_LFQUEUE_H
+#define LM_LFQUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct LFQueueCell;
+
+/* Bounded multi-producer/multi-consumer queue of pointers.
+ * Neither push nor pop ever blocks; callers bring their own wakeups.
+ */
+struct LFQueue {
+	struct LFQueueCell *cells;
+	size_t mask;
+	/* separate cache lines so producers and consumers don't fight */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+};
+
+void lfqueue_init(struct LFQueue *q, size_t size);
+bool lfqueue_push(struct LFQueue *q, void *p);
+void *lfqueue_pop(struct LFQueue *q);
+void lfqueue_fini(struct LFQueue *q);
+
+#endif
+
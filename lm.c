@@ -13,7 +13,6 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -25,6 +24,7 @@
 #include <err.h>
 #endif
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -37,10 +37,12 @@
 #include "lm.h"
 #include "db.h"
 #include "commands.h"
+#include "argon2.h"
+#include "hasher.h"
 #include "ini.h"
 #include "logging.h"
-#include "monocypher.h"
 #include "numnick.h"
+#include "stats.h"
 #include "util.h"
 
 /* newserv defines this to be 20, but ircu makes it 15.
@@ -51,22 +53,61 @@
 static struct event_base *ev_base;
 static struct User *L_user;
 static struct bufferevent *irc_bev;
-static struct bufferevent *hasher_bev;
 static struct Server *me;
 static bool initial_link = true;
 static bool event_loop_running = false;
+/* The thread running the event loop, once there are others */
+static pthread_t main_thread;
+static bool threads_started = false;
 static char uplink_numeric[3];
 
-static pid_t hasher_pid;
-
 struct Config config;
 
+static unsigned long
+parse_number(const char *section, const char *key, const char *value,
+		unsigned long min, unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (errno != 0 || *value == '\0' || *end != '\0'
+			|| n < min || n > max) {
+		log_fatal(SS_INT, "%s:%s must be a number between %lu and %lu",
+				section, key, min, max);
+		return min;
+	}
+
+	return n;
+}
+
+static bool
+parse_bool(const char *section, const char *key, const char *value)
+{
+	if (!strcmp(value, "yes"))
+		return true;
+	if (!strcmp(value, "no"))
+		return false;
+
+	log_fatal(SS_INT, "%s:%s must be yes or no", section, key);
+	return false;
+}
+
 static void
 handle_config_item(const char *section, const char *key, const char *value)
 {
 #define IS_KEY_AND_COPY(s, k)	if (!strcmp(section, (#s)) \
 		&& !strcmp(key, (#k))) {\
 	snprintf(config.s.k, sizeof(config.s.k), "%s", value);\
+} else
+#define IS_KEY_AND_NUMBER(s, k, min, max)	if (!strcmp(section, (#s)) \
+		&& !strcmp(key, (#k))) {\
+	config.s.k = parse_number(section, key, value, (min), (max));\
+} else
+#define IS_KEY_AND_BOOL(s, k)	if (!strcmp(section, (#s)) \
+		&& !strcmp(key, (#k))) {\
+	config.s.k = parse_bool(section, key, value);\
 } else
 	IS_KEY_AND_COPY(server, name)
 	IS_KEY_AND_COPY(server, desc)
@@ -83,11 +124,43 @@ handle_config_item(const char *section, const char *key, const char *value)
 	IS_KEY_AND_COPY(mail, sendmailcmd)
 	IS_KEY_AND_COPY(mail, fromemail)
 	IS_KEY_AND_COPY(mail, fromname)
+	IS_KEY_AND_COPY(hasher, engine)
+	IS_KEY_AND_COPY(hasher, kernel)
+	IS_KEY_AND_COPY(hasher, socket)
+	IS_KEY_AND_COPY(hasher, algorithm)
+	IS_KEY_AND_NUMBER(hasher, workers, 1, HASHER_MAX_WORKERS)
+	IS_KEY_AND_NUMBER(hasher, memory_budget, 0, 1048576)
+	IS_KEY_AND_NUMBER(hasher, idle_timeout, 0, 86400)
+	IS_KEY_AND_NUMBER(hasher, queue_length, 0, 1000000)
+	IS_KEY_AND_NUMBER(hasher, queue_timeout, 0, 3600)
+	IS_KEY_AND_NUMBER(hasher, auth_weight, 1, 100)
+	IS_KEY_AND_NUMBER(hasher, account_weight, 1, 100)
+	IS_KEY_AND_NUMBER(hasher, oper_weight, 1, 100)
+	IS_KEY_AND_NUMBER(hasher, verify_cache, 0, 1000000)
+	IS_KEY_AND_NUMBER(hasher, verify_cache_ttl, 1, 86400)
+	IS_KEY_AND_NUMBER(hasher, interleave, 1, ARGON2_MAX_WAYS)
+	IS_KEY_AND_NUMBER(hasher, memory, HASHER_MIN_MEMORY, HASHER_MAX_MEMORY)
+	IS_KEY_AND_NUMBER(hasher, passes, 1, HASHER_MAX_PASSES)
+	IS_KEY_AND_NUMBER(hasher, lanes, 1, ARGON2_MAX_LANES)
+	IS_KEY_AND_BOOL(hasher, calibrate)
+	IS_KEY_AND_NUMBER(hasher, target_latency, 1, 60000)
+	IS_KEY_AND_NUMBER(hasher, target_rate, 0, 1000000)
+	IS_KEY_AND_BOOL(hasher, hugepages)
+	IS_KEY_AND_BOOL(hasher, lock)
+	IS_KEY_AND_COPY(database, journal_mode)
+	IS_KEY_AND_COPY(database, synchronous)
+	IS_KEY_AND_COPY(database, temp_store)
+	IS_KEY_AND_NUMBER(database, cache_size, 100, 4194304)
+	IS_KEY_AND_NUMBER(database, mmap_size, 0, 65536)
+	IS_KEY_AND_NUMBER(database, checkpoint_interval, 0, 3600)
+	IS_KEY_AND_BOOL(database, account_index)
 	{
 		log_warn(SS_INT, "unknown configuration directive %s:%s",
 				section, key);
 	}
-#undef IS_KEY
+#undef IS_KEY_AND_BOOL
+#undef IS_KEY_AND_NUMBER
+#undef IS_KEY_AND_COPY
 }
 
 static void
@@ -101,6 +174,30 @@ read_config(void)
 	int r;
 
 	memset(&config, 0, sizeof(config));
+	strcpy(config.hasher.engine, "fork");
+	strcpy(config.hasher.kernel, "auto");
+	strcpy(config.hasher.socket, "lm-hasherd.sock");
+	strcpy(config.hasher.algorithm, "argon2i");
+	config.hasher.workers = 1;
+	config.hasher.idle_timeout = 60;
+	config.hasher.queue_length = 256;
+	config.hasher.queue_timeout = 30;
+	config.hasher.auth_weight = 1;
+	config.hasher.account_weight = 4;
+	config.hasher.oper_weight = 4;
+	config.hasher.verify_cache_ttl = 600;
+	config.hasher.interleave = 1;
+	config.hasher.hugepages = true;
+	config.hasher.memory = 100000;
+	config.hasher.passes = 3;
+	config.hasher.lanes = 1;
+	config.hasher.target_latency = 500;
+	strcpy(config.database.journal_mode, "delete");
+	strcpy(config.database.synchronous, "full");
+	strcpy(config.database.temp_store, "default");
+	config.database.cache_size = 2000;
+	config.database.checkpoint_interval = 60;
+	config.database.account_index = true;
 
 	if (ini_open(&ctx, "lm.ini") != 0) {
 		log_fatal(SS_INT, "unable to open lm.ini");
@@ -144,6 +241,43 @@ read_config(void)
 		ERROR_IF_MISSING(mail, fromname);
 	}
 #undef ERROR_IF_MISSING
+	if (strcmp(config.hasher.engine, "fork")
+			&& strcmp(config.hasher.engine, "thread")
+			&& strcmp(config.hasher.engine, "daemon"))
+		log_fatal(SS_INT, "hasher:engine must be fork, thread or "
+				"daemon");
+	if (strcmp(config.hasher.algorithm, "argon2i")
+			&& strcmp(config.hasher.algorithm, "argon2id"))
+		log_fatal(SS_INT, "hasher:algorithm must be argon2i or "
+				"argon2id");
+	if (config.hasher.memory < 8 * config.hasher.lanes)
+		log_fatal(SS_INT, "hasher:memory must be at least 8 KiB per "
+				"lane");
+	/* Hashers started for the budget could never give memory back. */
+	if (config.hasher.memory_budget != 0
+			&& !strcmp(config.hasher.engine, "fork")
+			&& (config.hasher.lock
+				|| config.hasher.idle_timeout == 0))
+		log_fatal(SS_INT, "hasher:memory_budget needs "
+				"hasher:idle_timeout and cannot be used with "
+				"hasher:lock");
+	if (strcmp(config.database.journal_mode, "delete")
+			&& strcmp(config.database.journal_mode, "truncate")
+			&& strcmp(config.database.journal_mode, "persist")
+			&& strcmp(config.database.journal_mode, "wal"))
+		log_fatal(SS_INT, "database:journal_mode must be delete, "
+				"truncate, persist or wal");
+	if (strcmp(config.database.synchronous, "off")
+			&& strcmp(config.database.synchronous, "normal")
+			&& strcmp(config.database.synchronous, "full")
+			&& strcmp(config.database.synchronous, "extra"))
+		log_fatal(SS_INT, "database:synchronous must be off, normal, "
+				"full or extra");
+	if (strcmp(config.database.temp_store, "default")
+			&& strcmp(config.database.temp_store, "file")
+			&& strcmp(config.database.temp_store, "memory"))
+		log_fatal(SS_INT, "database:temp_store must be default, file "
+				"or memory");
 
 	my_server_numnick_info[0] = config.server.numeric[0];
 	my_server_numnick_info[1] = config.server.numeric[1];
@@ -238,33 +372,6 @@ disconnect()
 	log_info(SS_NET, "exited event loop");
 }
 
-static void
-reap_hasher(void)
-{
-	if (hasher_pid != 0) {
-		int fd;
-
-		fd = bufferevent_getfd(hasher_bev);
-		log_info(SS_INT, "shutting down the hasher socket %d", fd);
-		shutdown(fd, SHUT_RDWR);
-		log_info(SS_INT, "freeing the hasher bufferevent");
-		bufferevent_free(hasher_bev);
-		log_info(SS_INT, "freed the hasher bufferevent");
-		/*
-		 * Cannot kill the hasher after pledge() because missing proc,
-		 * but it should come home anyway because we closed its socket.
-		 */
-#ifndef HAS_OPENBSD
-		/* Just in case it got stuck. */
-		(void)kill(hasher_pid, SIGTERM);
-#endif
-		log_info(SS_INT, "waiting on hasher to die...");
-		(void)wait(NULL);
-		log_info(SS_INT, "hasher dead");
-		hasher_pid = 0;
-	}
-}
-
 static void
 conn_event_cb(struct bufferevent *b, short revents, void *arg)
 {
@@ -417,6 +524,7 @@ static void
 handle_quit(char *source, size_t argc, char *argv[])
 {
 	numnick_deregister_user(source);
+	db_cancel_orphans();
 }
 
 static void
@@ -436,6 +544,7 @@ handle_squit(char *source, size_t argc, char *argv[])
 	 * us.
 	 */
 	deregister_server_by_name(argv[0]);
+	db_cancel_orphans();
 }
 
 static void
@@ -630,13 +739,27 @@ static void
 heartbeat_cb(evutil_socket_t sfd, short revents, void *arg)
 {
 	db_purge_expired();
+	stats_log();
+}
+
+static void
+queue_cb(evutil_socket_t sfd, short revents, void *arg)
+{
+	db_expire_hash_requests();
+}
+
+static void
+checkpoint_cb(evutil_socket_t sfd, short revents, void *arg)
+{
+	db_checkpoint();
 }
 
 static void
 help(const char *name)
 {
-	fprintf(stderr, "Usage: %s [-dhn]\n"
+	fprintf(stderr, "Usage: %s [-bdhn]\n"
 			"\n"
+			"  -b      benchmark the hasher and exit (implies -n)\n"
 			"  -d      show debug messages (implies -n)\n"
 			"  -h      show this help message\n"
 			"  -n      no fork; log to stdout\n",
@@ -646,9 +769,16 @@ help(const char *name)
 void
 lm_exit(void)
 {
+	/* Only the event loop may tear down; it calls back in here. */
+	if (threads_started && !pthread_equal(pthread_self(), main_thread)) {
+		db_post_exit();
+		return;
+	}
+
 	if (event_loop_running) {
 		disconnect();
-		reap_hasher();
+		db_stop();
+		hasher_fini();
 	} else {
 		exit(1);
 	}
@@ -676,142 +806,18 @@ daemonize(void)
 #endif
 }
 
-void
-lm_send_hasher_request(const char *password, const uint8_t *salt)
-{
-	uint8_t buf[PASSWORD_LEN + SALT_LEN + sizeof(uint8_t)];
-
-	memset(buf, 0, sizeof(buf));
-
-	memcpy(buf, password, strlen(password));
-	memcpy(buf + PASSWORD_LEN, salt, SALT_LEN);
-	buf[PASSWORD_LEN + SALT_LEN] = (uint8_t)strlen(password);
-
-	/* caller wipes password and salt */
-
-	evbuffer_expand(bufferevent_get_output(hasher_bev), sizeof(buf));
-	evbuffer_add(bufferevent_get_output(hasher_bev), buf, sizeof(buf));
-
-	crypto_wipe(buf, sizeof(buf));
-}
-
-static void
-hasher(int fd)
-{
-	void *work_area = smalloc(102400000LU);
-	uint8_t hash[HASH_LEN];
-	uint8_t buf[PASSWORD_LEN + SALT_LEN + sizeof(uint8_t)];
-	uint8_t *password = buf;
-	uint8_t *salt = buf + PASSWORD_LEN;
-	uint8_t *pwlen = buf + PASSWORD_LEN + SALT_LEN;
-
-#ifdef HAS_OPENBSD
-	setproctitle("hasher");
-#endif
-#ifdef HAS_OPENBSD
-	if (pledge("stdio", "") != 0)
-		exit(1);
-#endif
-
-	/* The hasher is in the position of only having to read and write from
-	 * the one fd -- synchronous handling is good enough.
-	 */
-
-	/* read password and salt */
-	errno = 0;
-	while (recv(fd, buf, sizeof(buf), MSG_WAITALL)
-			== (ssize_t)sizeof(buf)) {
-		/* hash */
-		crypto_argon2i(hash, HASH_LEN,
-				work_area, 100000,
-				3,
-				password, *pwlen,
-				salt, SALT_LEN);
-		crypto_wipe(buf, sizeof(buf));
-		/* write hash */
-		if (write(fd, hash, HASH_LEN) != HASH_LEN) {
-			log_error(SS_INT, "unable to write hash: %s",
-					strerror(errno));
-			crypto_wipe(hash, sizeof(hash));
-			exit(1);
-		}
-		crypto_wipe(hash, sizeof(hash));
-		log_debug(SS_INT, "sent hash");
-	}
-	free(work_area);
-	if (errno != 0)
-		log_error(SS_INT, "unable to read hasher fd: %s",
-				strerror(errno));
-	exit(errno == 0);
-}
-
-static void
-hasher_read_cb(struct bufferevent *b, void *arg)
-{
-	int nr;
-	uint8_t buf[HASH_LEN];
-
-	while ((nr = evbuffer_remove(bufferevent_get_input(b), buf,
-				sizeof(buf))) == (int)sizeof(buf)) {
-		log_debug(SS_INT, "got hash (len %d)", nr);
-		/* This assumes response order matching outgoing order. */
-		db_hash_response(buf);
-	}
-}
-
-static void
-hasher_event_cb(struct bufferevent *b, short revents, void *arg)
-{
-	if (revents & BEV_EVENT_ERROR) {
-		log_fatal(SS_INT, "socket error from hasher: %s",
-				evutil_socket_error_to_string(
-					EVUTIL_SOCKET_ERROR()));
-	} else if (revents & BEV_EVENT_EOF) {
-		log_fatal(SS_INT, "EOF received from hasher");
-	}
-}
-
-static int
-lm_fork_hasher(void)
-{
-	int fdv[2];
-	pid_t pid;
-
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fdv) != 0)
-		log_fatal(SS_INT, "unable to get socketpair: %s",
-				strerror(errno));
-
-	switch ((pid = fork())) {
-	case 0:
-		hasher(fdv[0]);
-		break;
-	case -1:
-		log_fatal(SS_INT, "unable to fork: %s", strerror(errno));
-		return -1;
-	default:
-		if ((hasher_bev = bufferevent_socket_new(ev_base, fdv[1],
-						BEV_OPT_CLOSE_ON_FREE))
-				== NULL)
-			oom();
-
-		bufferevent_setcb(hasher_bev, hasher_read_cb, NULL,
-				hasher_event_cb, NULL);
-		bufferevent_enable(hasher_bev, EV_READ | EV_WRITE);
-		hasher_pid = pid;
-		break;
-	}
-
-	return 0;
-}
-
 int
 main(int argc, char *argv[])
 {
-	struct event sigev_int, sigev_term, ev_heartbeat;
+	struct event sigev_int, sigev_term, ev_heartbeat, ev_queue;
+	struct event ev_checkpoint;
 	/* 5 minutes */
 	struct timeval heartbeat_freq = {300, 0};
+	/* How closely hasher:queue_timeout is kept to */
+	struct timeval queue_freq = {1, 0};
+	struct timeval checkpoint_freq = {0, 0};
 	int c;
-	bool dofork = true, debug = false;
+	bool dofork = true, debug = false, benchmark = false;
 
 #ifdef HAS_OPENBSD
 	/* unveil(2) the files we need */
@@ -837,8 +843,12 @@ main(int argc, char *argv[])
 		err(1, "pledge 1");
 #endif
 
-	while ((c = getopt(argc, argv, "dhn")) != -1) {
+	while ((c = getopt(argc, argv, "bdhn")) != -1) {
 		switch (c) {
+		case 'b':
+			dofork = false;
+			benchmark = true;
+			break;
 		case 'd':
 			dofork = false;
 			debug = true;
@@ -856,11 +866,20 @@ main(int argc, char *argv[])
 		return 1;
 
 	read_config();
+	if (benchmark) {
+		c = hasher_benchmark();
+		log_fini();
+		return (c != 0);
+	}
 #ifdef HAS_OPENBSD
 	if (*config.mail.sendmailcmd != '\0') {
 		if (unveil(config.mail.sendmailcmd, "x") != 0)
 			err(1, "unveil %s", config.mail.sendmailcmd);
 	}
+	if (!strcmp(config.hasher.engine, "daemon")) {
+		if (unveil(config.hasher.socket, "rw") != 0)
+			err(1, "unveil %s", config.hasher.socket);
+	}
 	if (pledge("stdio rpath cpath wpath flock fattr proc exec inet unix dns", NULL) != 0)
 		err(1, "pledge 2");
 #endif
@@ -893,7 +912,9 @@ main(int argc, char *argv[])
 		oom();
 	connect_remote();
 
-	if (lm_fork_hasher() != 0)
+	main_thread = pthread_self();
+	threads_started = true;
+	if (hasher_init(ev_base) != 0 || db_start(ev_base) != 0)
 		return 1;
 #ifdef HAS_OPENBSD
 	if (*config.mail.sendmailcmd != '\0') {
@@ -913,11 +934,22 @@ main(int argc, char *argv[])
 	event_add(&sigev_int, NULL);
 	event_add(&sigev_term, NULL);
 	event_add(&ev_heartbeat, &heartbeat_freq);
+	event_assign(&ev_queue, ev_base, -1, EV_PERSIST, queue_cb, NULL);
+	if (config.hasher.queue_timeout != 0)
+		event_add(&ev_queue, &queue_freq);
+	event_assign(&ev_checkpoint, ev_base, -1, EV_PERSIST, checkpoint_cb,
+			NULL);
+	if (db_checkpoints()) {
+		checkpoint_freq.tv_sec =
+			(time_t)config.database.checkpoint_interval;
+		event_add(&ev_checkpoint, &checkpoint_freq);
+	}
 	event_loop_running = true;
 	event_base_dispatch(ev_base);
 
 	disconnect();
-	reap_hasher();
+	db_stop();
+	hasher_fini();
 	event_base_free(ev_base);
 	db_fini();
 	log_fini();
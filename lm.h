@@ -13,6 +13,7 @@
 #ifndef LM_LM_H
 #define LM_LM_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "entities.h"
@@ -41,6 +42,40 @@ struct Config {
 		char fromemail[255];
 		char fromname[50];
 	} mail;
+	struct {
+		char engine[8];
+		char kernel[8];
+		char socket[100];
+		char algorithm[9];
+		unsigned long workers;
+		unsigned long memory_budget;
+		unsigned long idle_timeout;
+		unsigned long queue_length;
+		unsigned long queue_timeout;
+		unsigned long auth_weight;
+		unsigned long account_weight;
+		unsigned long oper_weight;
+		unsigned long verify_cache;
+		unsigned long verify_cache_ttl;
+		unsigned long interleave;
+		unsigned long memory;
+		unsigned long passes;
+		unsigned long lanes;
+		bool calibrate;
+		unsigned long target_latency;
+		unsigned long target_rate;
+		bool hugepages;
+		bool lock;
+	} hasher;
+	struct {
+		char journal_mode[9];
+		char synchronous[7];
+		char temp_store[8];
+		unsigned long cache_size;
+		unsigned long mmap_size;
+		unsigned long checkpoint_interval;
+		bool account_index;
+	} database;
 };
 
 extern struct Config config;
@@ -49,7 +84,6 @@ void send_line(const char *fmt, ...);
 void reply(const struct User *u, const char *fmt, ...);
 void s2s_line(const char *fmt, ...);
 void lm_exit(void);
-void lm_send_hasher_request(const char *password, const uint8_t *salt);
 
 #endif
 
@@ -60,6 +60,7 @@ vlog_generic(enum LogSubsystem ss, enum LogLevel level, const char *fmt,
 		va_list ap)
 {
 	time_t now = time(NULL);
+	struct tm tm;
 	char timebuf[24];
 
 	/* Start with stderr until we switch to stdout because log before event
@@ -68,15 +69,18 @@ vlog_generic(enum LogSubsystem ss, enum LogLevel level, const char *fmt,
 	if (logfile == NULL)
 		logfile = stderr;
 
-	if (strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S UTC",
-				gmtime(&now))
-			== 0)
+	if (gmtime_r(&now, &tm) == NULL
+			|| strftime(timebuf, sizeof(timebuf),
+				"%Y-%m-%d %H:%M:%S UTC", &tm) == 0)
 		strcpy(timebuf, "UNKNOWN TIME");
+	/* The database thread logs, too; keep its lines in one piece. */
+	flockfile(logfile);
 	fprintf(logfile, "[%s] %-5s %-7s - ", timebuf, level_name(level),
 			subsystem_name(ss));
 	vfprintf(logfile, fmt, ap);
 	putc('\n', logfile);
 	fflush(logfile);
+	funlockfile(logfile);
 
 	if (level == LV_FATAL)
 		lm_exit();
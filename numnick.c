@@ -26,6 +26,8 @@
 #include "util.h"
 
 static struct Server servers[4096];
+/* Last generation handed out to a user, see struct UserHandle */
+static uint32_t last_generation;
 
 static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 	"abcdefghijklmnopqrstuvwxyz0123456789[]";
@@ -209,7 +211,10 @@ numnick_register_server(const char *numnick, const char *name,
 
 	log_network("server %s (%s/%zu) linking", name, numnick, server);
 
+	/* usercount is the highest user numeric the server may use. */
+	++usercount;
 	servers[server].users = scalloc(usercount, sizeof(*servers[server].users));
+	servers[server].nusers = usercount;
 	servers[server].uplink = uplink;
 	snprintf(servers[server].name, sizeof(servers[server].name),
 			"%s", name);
@@ -298,6 +303,10 @@ numnick_register_user(const char *numnick, const char *nick, const char *ident,
 	log_debug(SS_NET, "registering user %s (%s!%s@%s[=%s]/%s)", numnick,
 			nick, ident, host, ip_numeric, gecos);
 
+	if (++last_generation == 0)
+		++last_generation;
+	u->generation = last_generation;
+
 	if (accname != NULL)
 		snprintf(u->account, sizeof(u->account), "%s", accname);
 #define FILLFIELD(field)	do {\
@@ -393,6 +402,36 @@ user_numnick(char out[static 6], const struct User *u)
 	return out;
 }
 
+struct UserHandle
+user_handle(const struct User *u)
+{
+	struct UserHandle h = {
+		.sid = u->sid,
+		.uid = u->uid,
+		.generation = u->generation
+	};
+
+	return h;
+}
+
+/* Returns NULL if the user has since quit or been split off. */
+struct User *
+user_from_handle(const struct UserHandle *h)
+{
+	const struct Server *s;
+	struct User *u;
+
+	if (h->generation == 0 || h->sid >= sizeof(servers)/sizeof(*servers))
+		return NULL;
+
+	s = &servers[h->sid];
+	if (s->users == NULL || h->uid >= s->nusers)
+		return NULL;
+
+	u = &s->users[h->uid];
+	return (u->generation == h->generation) ? u : NULL;
+}
+
 static uint32_t
 decode_token_quintuplet(const char t[4])
 {
@@ -28,6 +28,8 @@ struct User *numnick_register_user(const char *numnick, const char *nick,
 void numnick_deregister_user(const char *numnick);
 void deregister_server_by_name(const char *name);
 char *user_numnick(char out[static 6], const struct User *u);
+struct UserHandle user_handle(const struct User *u);
+struct User *user_from_handle(const struct UserHandle *h);
 int decode_token(uint8_t bToken[60], const char szToken[81]);
 void encode_token(char szToken[81], const uint8_t bToken[60]);
 
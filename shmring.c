@@ -0,0 +1,160 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * head and tail only ever grow; head is written by the consumer alone and
+ * tail by the producer alone, so a release store on one side and an acquire
+ * load on the other is all the synchronization there is.
+ * This only works across processes if the atomics are lock-free, which
+ * shmring_new() checks.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "shmring.h"
+#include "logging.h"
+#include "monocypher.h"
+
+/* nslots must be a power of two; slot_size is rounded up to 64 bytes. */
+struct ShmRing *
+shmring_new(size_t nslots, size_t slot_size)
+{
+	struct ShmRing *r;
+	size_t map_size;
+
+	if (nslots < 2 || (nslots & (nslots - 1)) != 0) {
+		log_fatal(SS_INT, "shmring size %zu is not a power of two",
+				nslots);
+		return NULL;
+	}
+
+	slot_size = (slot_size + 63) & ~(size_t)63;
+	map_size = sizeof(*r) + nslots * slot_size;
+	if ((r = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANON, -1, 0))
+			== MAP_FAILED) {
+		log_fatal(SS_INT, "unable to map shared memory: %s",
+				strerror(errno));
+		return NULL;
+	}
+
+	r->mask = nslots - 1;
+	r->slot_size = slot_size;
+	r->map_size = map_size;
+	atomic_init(&r->closed, false);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	if (!atomic_is_lock_free(&r->head)
+			|| !atomic_is_lock_free(&r->closed)) {
+		log_fatal(SS_INT, "shmring needs lock-free atomics");
+		(void)munmap(r, map_size);
+		return NULL;
+	}
+
+	return r;
+}
+
+/*
+ * Producer: returns the i-th free slot past the ones already committed, or
+ * NULL if the ring has no such slot.
+ */
+void *
+shmring_write_slot(struct ShmRing *r, size_t i)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (tail + i - head > r->mask)
+		return NULL;
+	return r->slots + ((tail + i) & r->mask) * r->slot_size;
+}
+
+/* Producer: hands the next n slots to the consumer. */
+void
+shmring_commit(struct ShmRing *r, size_t n)
+{
+	atomic_fetch_add_explicit(&r->tail, n, memory_order_release);
+}
+
+/* Consumer: returns the i-th committed slot, or NULL if there is none. */
+void *
+shmring_read_slot(struct ShmRing *r, size_t i)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (tail - head <= i)
+		return NULL;
+	return r->slots + ((head + i) & r->mask) * r->slot_size;
+}
+
+/* Consumer: wipes the next n slots and gives them back to the producer. */
+void
+shmring_release(struct ShmRing *r, size_t n)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	for (size_t i = 0; i < n; ++i)
+		crypto_wipe(r->slots + ((head + i) & r->mask) * r->slot_size,
+				r->slot_size);
+	atomic_store_explicit(&r->head, head + n, memory_order_release);
+}
+
+/* Producer: tells the consumer that nothing more is coming. */
+void
+shmring_close(struct ShmRing *r)
+{
+	atomic_store_explicit(&r->closed, true, memory_order_release);
+}
+
+/* Consumer: whether the producer is done and everything has been read. */
+bool
+shmring_eof(struct ShmRing *r)
+{
+	if (!atomic_load_explicit(&r->closed, memory_order_acquire))
+		return false;
+	return (atomic_load_explicit(&r->tail, memory_order_acquire)
+			== atomic_load_explicit(&r->head,
+				memory_order_relaxed));
+}
+
+/*
+ * Unmaps a ring in a process that has no business with it, leaving it
+ * intact for the processes that do.
+ */
+void
+shmring_detach(struct ShmRing *r)
+{
+	if (r != NULL)
+		(void)munmap(r, r->map_size);
+}
+
+/* Wipes and unmaps a ring; only its last user may do this. */
+void
+shmring_free(struct ShmRing *r)
+{
+	size_t map_size;
+
+	if (r == NULL)
+		return;
+
+	map_size = r->map_size;
+	crypto_wipe(r, map_size);
+	(void)munmap(r, map_size);
+}
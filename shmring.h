@@ -0,0 +1,46 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_SHMRING_H
+#define LM_SHMRING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bounded single-producer/single-consumer ring of fixed-size slots in memory
+ * shared with forked processes; create it before fork(2).
+ * Slots are filled and read in place.  Neither side ever blocks; callers
+ * bring their own wakeups.
+ */
+struct ShmRing {
+	size_t mask;
+	size_t slot_size;
+	size_t map_size;
+	atomic_bool closed;
+	/* separate cache lines so producer and consumer don't fight */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+	_Alignas(64) unsigned char slots[];
+};
+
+struct ShmRing *shmring_new(size_t nslots, size_t slot_size);
+void *shmring_write_slot(struct ShmRing *r, size_t i);
+void shmring_commit(struct ShmRing *r, size_t n);
+void *shmring_read_slot(struct ShmRing *r, size_t i);
+void shmring_release(struct ShmRing *r, size_t n);
+void shmring_close(struct ShmRing *r);
+bool shmring_eof(struct ShmRing *r);
+void shmring_detach(struct ShmRing *r);
+void shmring_free(struct ShmRing *r);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Where the time of a hash request goes: how long it waited for a hasher,
+ * how long argon2 took, and how long it took altogether.
+ * See STATS in commands.c; heartbeat_cb() in lm.c also logs them.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "logging.h"
+#include "stats.h"
+
+static struct Histogram stages[ST_COUNT];
+static size_t queue_peak;
+
+static const char *const stage_names[ST_COUNT] = {
+	[ST_QUEUE] = "queue wait",
+	[ST_COMPUTE] = "argon2",
+	[ST_SERVICE] = "hasher round trip",
+	[ST_TOTAL] = "total"
+};
+
+/*
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each; above that, every
+ * power of two gets 2^HISTOGRAM_SUB_BITS buckets of equal width.
+ */
+static size_t
+bucket_of(uint64_t value)
+{
+	unsigned int msb = 63;
+	unsigned int shift;
+
+	if (value < (1U << HISTOGRAM_SUB_BITS))
+		return (size_t)value;
+
+	while (!(value & ((uint64_t)1 << msb)))
+		--msb;
+	shift = msb - HISTOGRAM_SUB_BITS;
+	return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS)
+		+ (size_t)((value >> shift) - (1U << HISTOGRAM_SUB_BITS));
+}
+
+/* The highest value that falls into bucket b */
+static uint64_t
+bucket_top(size_t b)
+{
+	size_t shift;
+
+	if (b < (1U << HISTOGRAM_SUB_BITS))
+		return (uint64_t)b;
+
+	shift = (b >> HISTOGRAM_SUB_BITS) - 1;
+	return ((((uint64_t)(b & ((1U << HISTOGRAM_SUB_BITS) - 1))
+			+ (1U << HISTOGRAM_SUB_BITS) + 1) << shift) - 1);
+}
+
+void
+histogram_record(struct Histogram *h, uint64_t value)
+{
+	size_t b = bucket_of(value);
+
+	if (b >= HISTOGRAM_BUCKETS)
+		b = HISTOGRAM_BUCKETS - 1;
+	++h->buckets[b];
+	++h->count;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+/* The value below which p (0 to 1) of the recorded values fall, give or take
+ * a bucket.
+ */
+uint64_t
+histogram_percentile(const struct Histogram *h, double p)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t top;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (uint64_t)(p * (double)h->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			top = bucket_top(b);
+			return (top < h->max) ? top : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+uint64_t
+stats_elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (int64_t)(now.tv_sec - since->tv_sec) * 1000000
+		+ (now.tv_nsec - since->tv_nsec) / 1000;
+	return (us > 0) ? (uint64_t)us : 0;
+}
+
+void
+stats_record(enum Stage stage, uint64_t us)
+{
+	histogram_record(&stages[stage], us);
+}
+
+/* Called whenever requests are queued */
+void
+stats_queue_depth(size_t depth)
+{
+	if (depth > queue_peak)
+		queue_peak = depth;
+}
+
+const char *
+stats_stage_name(enum Stage stage)
+{
+	return stage_names[stage];
+}
+
+const struct Histogram *
+stats_histogram(enum Stage stage)
+{
+	return &stages[stage];
+}
+
+size_t
+stats_queue_peak(void)
+{
+	return queue_peak;
+}
+
+void
+stats_log(void)
+{
+	const struct Histogram *h;
+
+	for (size_t i = 0; i < ST_COUNT; ++i) {
+		h = &stages[i];
+		if (h->count == 0)
+			continue;
+		log_info(SS_INT, "%s: %" PRIu64 " hashes, mean %" PRIu64
+				" us, p50 %" PRIu64 " us, p90 %" PRIu64
+				" us, p99 %" PRIu64 " us, max %" PRIu64 " us",
+				stage_names[i], h->count, h->sum / h->count,
+				histogram_percentile(h, 0.5),
+				histogram_percentile(h, 0.9),
+				histogram_percentile(h, 0.99),
+				h->max);
+	}
+	log_info(SS_INT, "hash queue peaked at %zu request(s)", queue_peak);
+}
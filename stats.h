@@ -0,0 +1,61 @@
+/*
+ * Written in 2019 by Fabio Scotoni
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide.  This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software.  If not, see
+ * <https://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef LM_STATS_H
+#define LM_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Every power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so a
+ * recorded value is off by at most 1/16th.
+ */
+#define HISTOGRAM_SUB_BITS	(4)
+/* Up to 2^40 us, which is about 12 days */
+#define HISTOGRAM_BUCKETS	((40 - HISTOGRAM_SUB_BITS + 1) \
+		<< HISTOGRAM_SUB_BITS)
+
+/* Log-linear histogram of durations in microseconds */
+struct Histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* Stages of a hash request */
+enum Stage {
+	/* queued until handed to a hasher */
+	ST_QUEUE,
+	/* argon2 itself, as timed by the hasher */
+	ST_COMPUTE,
+	/* handed to a hasher until the hash is back */
+	ST_SERVICE,
+	/* queued until the hash is back */
+	ST_TOTAL,
+	ST_COUNT
+};
+
+void histogram_record(struct Histogram *h, uint64_t value);
+uint64_t histogram_percentile(const struct Histogram *h, double p);
+
+uint64_t stats_elapsed_us(const struct timespec *since);
+void stats_record(enum Stage stage, uint64_t us);
+void stats_queue_depth(size_t depth);
+const char *stats_stage_name(enum Stage stage);
+const struct Histogram *stats_histogram(enum Stage stage);
+size_t stats_queue_peak(void);
+void stats_log(void);
+
+#endif
+
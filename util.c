@@ -12,11 +12,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
@@ -169,3 +173,88 @@ stripesc(char *s)
 	return s;
 }
 
+/*
+ * Copies src to dst in lower case, ASCII only and whatever the locale.
+ * With irc, [\]^ are lowered to {|}~ as well (rfc1459 casemapping, as ircu
+ * does), so that names that are the same nick on IRC are the same here.
+ * dst must have room for strlen(src) + 1 bytes.
+ */
+char *
+casefold(char *dst, const char *src, bool irc)
+{
+	char *p = dst;
+
+	for (; *src != '\0'; ++src) {
+		if ((*src >= 'A' && *src <= 'Z')
+				|| (irc && *src >= '[' && *src <= '^'))
+			*p++ = (char)(*src + ('a' - 'A'));
+		else
+			*p++ = *src;
+	}
+	*p = '\0';
+
+	return dst;
+}
+
+
+/*
+ * A doorbell wakes up an event loop from another thread.
+ * It's an eventfd where we have one and a non-blocking pipe elsewhere;
+ * fds[0] is the end to watch, fds[1] the end to ring.
+ */
+int
+doorbell_open(int fds[2])
+{
+#ifdef __linux__
+	if ((fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		log_fatal(SS_INT, "unable to create eventfd: %s",
+				strerror(errno));
+		return -1;
+	}
+	fds[1] = fds[0];
+#else
+	if (pipe(fds) != 0) {
+		log_fatal(SS_INT, "unable to create pipe: %s",
+				strerror(errno));
+		return -1;
+	}
+	for (size_t i = 0; i < 2; ++i) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	return 0;
+}
+
+void
+doorbell_ring(int fd)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	/* Can only fail on counter overflow, which still leaves it readable. */
+	(void)write(fd, &one, sizeof(one));
+#else
+	/* A full pipe means the bell is already ringing. */
+	(void)write(fd, "", 1);
+#endif
+}
+
+void
+doorbell_drain(int fd)
+{
+	uint64_t buf[8];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+void
+doorbell_close(int fds[2])
+{
+	close(fds[0]);
+	if (fds[1] != fds[0])
+		close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
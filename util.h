@@ -25,6 +25,11 @@ void split_args(char *line, size_t max_args, size_t *argc, char **argv,
 		bool colonize);
 int util_rebind_stdfd(void);
 char *stripesc(char *s);
+char *casefold(char *dst, const char *src, bool irc);
+int doorbell_open(int fds[2]);
+void doorbell_ring(int fd);
+void doorbell_drain(int fd);
+void doorbell_close(int fds[2]);
 
 #endif
 